@@ -0,0 +1,545 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aot.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/* Under $XDG_CACHE_HOME, or else under $HOME */
+#define NATIVE_CACHE_NAME "fave"
+#define NATIVE_CACHE_HOME ".cache/fave"
+#define NATIVE_PATH_MAX 4096
+
+#ifdef NAN_BOXING
+#define NATIVE_LAYOUT "nanbox"
+#else
+#define NATIVE_LAYOUT "tagged"
+#endif
+
+/* Bumped whenever the generated code or NativeRuntime changes shape */
+#define NATIVE_VERSION "fave-native-3"
+
+/* Non-number constants as the generated file lists them */
+typedef struct
+{
+    int index;
+    const char *chars;
+    int length;
+} NativeString;
+
+/* The generated file depends on nothing but libc: it carries its own copy
+   of the value layout this binary was built with. */
+#ifdef NAN_BOXING
+static const char *valuePrelude =
+    "typedef uint64_t Value;\n"
+    "#define QNAN 0x7ffc000000000000ull\n"
+    "#define NIL_VAL (QNAN | 1)\n"
+    "#define FALSE_VAL (QNAN | 2)\n"
+    "#define TRUE_VAL (QNAN | 3)\n"
+    "#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)\n"
+    "#define IS_NUMBER(v) (((v) & QNAN) != QNAN)\n"
+    "#define IS_FALSEY(v) ((v) == NIL_VAL || (v) == FALSE_VAL)\n"
+    "static inline double AS_NUMBER(Value v) { double d; memcpy(&d, &v, 8); return d; }\n"
+    "static inline Value NUMBER_VAL(double d) { Value v; memcpy(&v, &d, 8); return v; }\n";
+#else
+static const char *valuePrelude =
+    "enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ };\n"
+    "typedef struct { int type; union { _Bool boolean; double number; void *obj; } as; } Value;\n"
+    "#define NIL_VAL ((Value){VAL_NIL, {.number = 0}})\n"
+    "#define BOOL_VAL(b) ((Value){VAL_BOOL, {.boolean = (b)}})\n"
+    "#define NUMBER_VAL(d) ((Value){VAL_NUMBER, {.number = (d)}})\n"
+    "#define IS_NUMBER(v) ((v).type == VAL_NUMBER)\n"
+    "#define IS_FALSEY(v) ((v).type == VAL_NIL || ((v).type == VAL_BOOL && !(v).as.boolean))\n"
+    "#define AS_NUMBER(v) ((v).as.number)\n";
+#endif
+
+static const char *runtimePrelude =
+    "typedef struct\n"
+    "{\n"
+    "    const Value *constants;\n"
+    "    const Value *inputs;\n"
+    "    void *heap;\n"
+    "    _Bool (*valuesEqual)(Value a, Value b);\n"
+    "    const char *(*concatenate)(void *heap, Value *a, Value b);\n"
+    "    void (*runtimeError)(int line, const char *message);\n"
+    "} NativeRuntime;\n"
+    "\n"
+    "typedef struct { int index; const char *chars; int length; } NativeString;\n"
+    "\n"
+    "static inline double bitsToNumber(uint64_t bits) { double d; memcpy(&d, &bits, 8); return d; }\n";
+
+static bool emitInstruction(Chunk *chunk, FILE *out, uint8_t *ip, int *depth, int *labels);
+static void emitCheck(FILE *out, const char *condition, int line, const char *message);
+static void emitAddition(FILE *out, int target, const char *operand, int line);
+static void emitValue(Chunk *chunk, FILE *out, int constant);
+static void emitStrings(Chunk *chunk, FILE *out);
+static void nativePath(char *path, const char *directory, const char *src, const char *const *inputs,
+                       int inputCount, const char *extension);
+static bool cacheDirectory(char *directory);
+static bool makeDirectory(char *path);
+static bool trusted(const char *path, mode_t type);
+static void nativeError(int line, const char *message);
+
+bool emitC(Chunk *chunk, FILE *out)
+{
+    fprintf(out, "/* Generated by fave (%s, %s). */\n\n", NATIVE_VERSION, NATIVE_LAYOUT);
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(out, "%s\n%s\n", valuePrelude, runtimePrelude);
+    emitStrings(chunk, out);
+
+    fprintf(out, "int faveRun(const NativeRuntime *rt, Value *result)\n{\n");
+    for (int slot = 0; slot < chunk->maxStack; slot++)
+        fprintf(out, "    Value s%d;\n", slot);
+    fprintf(out, "\n");
+
+    /* Stack depth at each jump target, -1 elsewhere. Jumps only go
+       forward, so every target is known before the pass reaches it. */
+    int *labels = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        labels[i] = -1;
+
+    bool emitted = true;
+    int depth = 0;
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        if (labels[offset] != -1)
+        {
+            fprintf(out, "L%d:;\n", offset);
+            depth = labels[offset];
+        }
+        if (!emitInstruction(chunk, out, &chunk->code[offset], &depth, labels))
+        {
+            emitted = false;
+            break;
+        }
+        offset += opcodeLength(chunk->code[offset]);
+    }
+    FREE_ARRAY(int, labels, chunk->count);
+
+    fprintf(out, "}\n");
+    return emitted;
+}
+
+/* Each instruction becomes a statement over the locals standing in for
+   its stack slots; after inlining the C compiler keeps them in registers
+   and drops the type checks it can prove. */
+static bool emitInstruction(Chunk *chunk, FILE *out, uint8_t *ip, int *depth, int *labels)
+{
+    int offset = (int)(ip - chunk->code);
+    int line = getLine(&chunk->lines, &offset);
+    int top = *depth - 1;
+
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    {
+        int constant = ip[0] == OP_CONSTANT ? ip[1] : ip[1] | (ip[2] << 8) | (ip[3] << 16);
+        fprintf(out, "    s%d = ", top + 1);
+        emitValue(chunk, out, constant);
+        fprintf(out, ";\n");
+        break;
+    }
+    case OP_NIL:
+        fprintf(out, "    s%d = NIL_VAL;\n", top + 1);
+        break;
+    case OP_TRUE:
+        fprintf(out, "    s%d = BOOL_VAL(1);\n", top + 1);
+        break;
+    case OP_FALSE:
+        fprintf(out, "    s%d = BOOL_VAL(0);\n", top + 1);
+        break;
+    case OP_GET_INPUT:
+        fprintf(out, "    s%d = rt->inputs[%d];\n", top + 1, ip[1]);
+        break;
+    case OP_PICK:
+        fprintf(out, "    s%d = s%d;\n", top + 1, top - ip[1]);
+        break;
+    case OP_SLIDE:
+        if (ip[1] > 0)
+            fprintf(out, "    s%d = s%d;\n", top - ip[1], top);
+        break;
+    case OP_POP:
+    case OP_POPN:
+        break;
+    case OP_GET_LOCAL:
+        fprintf(out, "    s%d = s%d;\n", top + 1, ip[1]);
+        break;
+    case OP_SET_LOCAL:
+        fprintf(out, "    s%d = s%d;\n", ip[1], top);
+        break;
+
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+    {
+        int target = jumpTarget(chunk->code, offset);
+        labels[target] = *depth;
+        if (ip[0] == OP_JUMP || ip[0] == OP_JUMP_LONG)
+            fprintf(out, "    goto L%d;\n", target);
+        else
+            fprintf(out, "    if (IS_FALSEY(s%d)) goto L%d;\n", top, target);
+        break;
+    }
+
+    case OP_NOT:
+        fprintf(out, "    s%d = BOOL_VAL(IS_FALSEY(s%d));\n", top, top);
+        break;
+
+    case OP_NEGATE_N:
+        fprintf(out, "    s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n", top, top);
+        break;
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    {
+        char condition[32];
+        snprintf(condition, sizeof(condition), "!IS_NUMBER(s%d)", top);
+        emitCheck(out, condition, line, "Operand must be a number.");
+        fprintf(out, "    s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n", top, top);
+        break;
+    }
+
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+        fprintf(out, "    {\n        Value k = ");
+        emitValue(chunk, out, ip[1]);
+        fprintf(out, ";\n");
+        emitAddition(out, top, "k", line);
+        fprintf(out, "    }\n");
+        break;
+    case OP_ADD_CONSTANT_NN:
+        fprintf(out, "    s%d = NUMBER_VAL(AS_NUMBER(s%d) + AS_NUMBER(", top, top);
+        emitValue(chunk, out, ip[1]);
+        fprintf(out, "));\n");
+        break;
+
+    case OP_ADD:
+    case OP_ADD_NUM:
+    {
+        char operand[16];
+        snprintf(operand, sizeof(operand), "s%d", top);
+        emitAddition(out, top - 1, operand, line);
+        break;
+    }
+
+    case OP_EQUAL:
+        fprintf(out, "    s%d = BOOL_VAL(rt->valuesEqual(s%d, s%d));\n", top - 1, top - 1, top);
+        break;
+    case OP_NOT_EQUAL:
+        fprintf(out, "    s%d = BOOL_VAL(!rt->valuesEqual(s%d, s%d));\n", top - 1, top - 1, top);
+        break;
+
+    case OP_RETURN:
+        fprintf(out, "    *result = s%d;\n    return %d;\n", top, INTERPRET_OK);
+        break;
+
+    default:
+    {
+        /* Numeric binary operators, written as run() evaluates them */
+        const char *format;
+        switch (ip[0])
+        {
+        case OP_ADD_NN: format = "NUMBER_VAL(%s + %s)"; break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_SUBTRACT_NN: format = "NUMBER_VAL(%s - %s)"; break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_MULTIPLY_NN: format = "NUMBER_VAL(%s * %s)"; break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+        case OP_DIVIDE_NN: format = "NUMBER_VAL(%s / %s)"; break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_GREATER_NN: format = "BOOL_VAL(%s > %s)"; break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_LESS_NN: format = "BOOL_VAL(%s < %s)"; break;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NN: format = "BOOL_VAL(!(%s < %s))"; break;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM:
+        case OP_LESS_EQUAL_NN: format = "BOOL_VAL(!(%s > %s))"; break;
+        default: return false;
+        }
+
+        char a[32], b[32], condition[64];
+        snprintf(a, sizeof(a), "AS_NUMBER(s%d)", top - 1);
+        snprintf(b, sizeof(b), "AS_NUMBER(s%d)", top);
+        snprintf(condition, sizeof(condition), "!IS_NUMBER(s%d) || !IS_NUMBER(s%d)", top, top - 1);
+        if (!assumesNumbers(ip[0]))
+            emitCheck(out, condition, line, "Operands must be numbers.");
+
+        fprintf(out, "    s%d = ", top - 1);
+        fprintf(out, format, a, b);
+        fprintf(out, ";\n");
+        break;
+    }
+    }
+
+    *depth += stackEffect(ip);
+    return true;
+}
+
+static void emitCheck(FILE *out, const char *condition, int line, const char *message)
+{
+    fprintf(out, "    if (%s)\n    {\n", condition);
+    fprintf(out, "        rt->runtimeError(%d, \"%s\");\n", line, message);
+    fprintf(out, "        return %d;\n    }\n", INTERPRET_RUNTIME_ERROR);
+}
+
+/* s<target> + operand, for numbers or strings as run() does it */
+static void emitAddition(FILE *out, int target, const char *operand, int line)
+{
+    fprintf(out, "    if (IS_NUMBER(s%d) && IS_NUMBER(%s))\n", target, operand);
+    fprintf(out, "        s%d = NUMBER_VAL(AS_NUMBER(s%d) + AS_NUMBER(%s));\n", target, target, operand);
+    fprintf(out, "    else\n    {\n");
+    fprintf(out, "        const char *error = rt->concatenate(rt->heap, &s%d, %s);\n", target, operand);
+    fprintf(out, "        if (error)\n        {\n");
+    fprintf(out, "            rt->runtimeError(%d, error);\n", line);
+    fprintf(out, "            return %d;\n        }\n    }\n", INTERPRET_RUNTIME_ERROR);
+}
+
+/* Numbers are written as their exact bits so the C compiler can fold them;
+   other constants are loaded from the pool the loader builds. */
+static void emitValue(Chunk *chunk, FILE *out, int constant)
+{
+    Value value = chunk->constants.values[constant];
+    if (!IS_NUMBER(value))
+    {
+        fprintf(out, "rt->constants[%d]", constant);
+        return;
+    }
+
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    fprintf(out, "NUMBER_VAL(bitsToNumber(0x%016llxull))", (unsigned long long)bits);
+}
+
+static void emitStrings(Chunk *chunk, FILE *out)
+{
+    fprintf(out, "const int faveConstantCount = %d;\n", chunk->constants.count);
+    fprintf(out, "const NativeString faveStrings[] = {\n");
+
+    int count = 0;
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value value = chunk->constants.values[i];
+        if (!IS_STRING(value))
+            continue;
+
+        ObjString *string = AS_STRING(value);
+        fprintf(out, "    {%d, \"", i);
+        for (int c = 0; c < string->length; c++)
+        {
+            unsigned char character = (unsigned char)string->chars[c];
+            if (character == '"' || character == '\\' || character < 0x20 || character >= 0x7f)
+                fprintf(out, "\\%03o", character);
+            else
+                fputc(character, out);
+        }
+        fprintf(out, "\", %d},\n", string->length);
+        count++;
+    }
+
+    fprintf(out, "    {-1, \"\", 0}\n};\n");
+    fprintf(out, "const int faveStringCount = %d;\n\n", count);
+}
+
+bool buildNative(Chunk *chunk, const char *src, const char *const *inputs, int inputCount)
+{
+    char directory[NATIVE_PATH_MAX];
+    if (!cacheDirectory(directory) || strchr(directory, '\'') != NULL)
+        return false;
+    if (!makeDirectory(directory) || !trusted(directory, S_IFDIR))
+        return false;
+
+    char source[NATIVE_PATH_MAX];
+    char library[NATIVE_PATH_MAX];
+    char partial[NATIVE_PATH_MAX + 16];
+    nativePath(source, directory, src, inputs, inputCount, ".c");
+    nativePath(library, directory, src, inputs, inputCount, ".so");
+    snprintf(partial, sizeof(partial), "%s.%d", library, (int)getpid());
+
+    FILE *file = fopen(source, "w");
+    if (file == NULL)
+        return false;
+
+    bool emitted = emitC(chunk, file);
+    fclose(file);
+    if (!emitted)
+    {
+        remove(source);
+        return false;
+    }
+
+    const char *compiler = getenv("CC");
+    if (compiler == NULL)
+        compiler = "cc";
+
+    char command[3 * NATIVE_PATH_MAX];
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -o '%s' '%s'", compiler, partial, source);
+    if (system(command) != 0)
+    {
+        remove(partial);
+        return false;
+    }
+
+    /* loadNative() refuses a library others can write, whatever the umask */
+    if (chmod(partial, 0700) != 0)
+    {
+        remove(partial);
+        return false;
+    }
+
+    /* Readers only ever see a complete library */
+    return rename(partial, library) == 0;
+}
+
+bool loadNative(NativeCode *native, const char *src, const char *const *inputs, int inputCount)
+{
+    char directory[NATIVE_PATH_MAX];
+    char library[NATIVE_PATH_MAX];
+    if (!cacheDirectory(directory))
+        return false;
+    nativePath(library, directory, src, inputs, inputCount, ".so");
+
+    /* dlopen() runs the library's code; only load what this user wrote */
+    if (!trusted(directory, S_IFDIR) || !trusted(library, S_IFREG))
+        return false;
+
+    void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+        return false;
+
+    NativeFunction function = (NativeFunction)dlsym(handle, "faveRun");
+    const int *constantCount = dlsym(handle, "faveConstantCount");
+    const int *stringCount = dlsym(handle, "faveStringCount");
+    const NativeString *strings = dlsym(handle, "faveStrings");
+
+    if (function == NULL || constantCount == NULL || stringCount == NULL || strings == NULL)
+    {
+        dlclose(handle);
+        return false;
+    }
+
+    native->handle = handle;
+    native->function = function;
+    for (int i = 0; i < *constantCount; i++)
+        writeValueArray(&native->constants, NIL_VAL);
+    for (int i = 0; i < *stringCount; i++)
+        native->constants.values[strings[i].index] = OBJ_VAL(copyString(strings[i].chars, strings[i].length));
+
+    return true;
+}
+
+void initNativeCode(NativeCode *native)
+{
+    native->handle = NULL;
+    native->function = NULL;
+    initValueArray(&native->constants);
+}
+
+void freeNativeCode(NativeCode *native)
+{
+    if (native->handle != NULL)
+        dlclose(native->handle);
+    for (int i = 0; i < native->constants.count; i++)
+        releaseValue(native->constants.values[i]);
+    freeValueArray(&native->constants);
+    initNativeCode(native);
+}
+
+int runNative(NativeCode *native, Heap *heap, const Value *inputs, Value *result)
+{
+    NativeRuntime runtime;
+    runtime.constants = native->constants.values;
+    runtime.inputs = inputs;
+    runtime.heap = heap;
+    runtime.valuesEqual = valuesEqual;
+    runtime.concatenate = concatenate;
+    runtime.runtimeError = nativeError;
+    return native->function(&runtime, result);
+}
+
+/* FNV-1a over everything the generated code depends on */
+static void nativePath(char *path, const char *directory, const char *src, const char *const *inputs,
+                       int inputCount, const char *extension)
+{
+    uint64_t hash = 14695981039346656037ull;
+    const char *parts[] = {NATIVE_VERSION, NATIVE_LAYOUT, src};
+
+    for (int i = 0; i < 3 + inputCount; i++)
+    {
+        const char *part = i < 3 ? parts[i] : inputs[i - 3];
+        for (const char *c = part; ; c++)
+        {
+            hash ^= (uint8_t)*c;
+            hash *= 1099511628211ull;
+            if (*c == '\0')
+                break;
+        }
+    }
+
+    snprintf(path, NATIVE_PATH_MAX, "%s/%016llx%s", directory, (unsigned long long)hash, extension);
+}
+
+/* False when there is nowhere per-user to put the cache */
+static bool cacheDirectory(char *directory)
+{
+    const char *path = getenv("FAVE_CACHE");
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int length;
+
+    if (path != NULL && path[0] != '\0')
+        length = snprintf(directory, NATIVE_PATH_MAX, "%s", path);
+    else if (base != NULL && base[0] == '/')
+        length = snprintf(directory, NATIVE_PATH_MAX, "%s/%s", base, NATIVE_CACHE_NAME);
+    else if (home != NULL && home[0] != '\0')
+        length = snprintf(directory, NATIVE_PATH_MAX, "%s/%s", home, NATIVE_CACHE_HOME);
+    else
+        return false;
+
+    return length > 0 && length < NATIVE_PATH_MAX;
+}
+
+/* Creates path and any missing parents, each private to this user */
+static bool makeDirectory(char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        bool made = mkdir(path, 0700) == 0 || errno == EEXIST;
+        *slash = '/';
+        if (!made)
+            return false;
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+/* True for a file of the given type that belongs to this user and that
+   no one else can write. Symbolic links are not followed. */
+static bool trusted(const char *path, mode_t type)
+{
+    struct stat status;
+    if (lstat(path, &status) != 0)
+        return false;
+
+    return (status.st_mode & S_IFMT) == type && status.st_uid == geteuid() &&
+           (status.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+static void nativeError(int line, const char *message)
+{
+    fprintf(stderr, "%s\n[line %d] in script\n", message, line);
+}
@@ -0,0 +1,46 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "common.h"
+#include "chunk.h"
+#include "memory.h"
+
+/* Hooks the generated C calls back into; mirrored by the prelude that
+   emitC() writes, so the two must change together. */
+typedef struct
+{
+    const Value *constants;
+    const Value *inputs;
+    /* Where the strings the code builds are allocated */
+    Heap *heap;
+    bool (*valuesEqual)(Value a, Value b);
+    const char *(*concatenate)(Heap *heap, Value *a, Value b);
+    void (*runtimeError)(int line, const char *message);
+} NativeRuntime;
+
+typedef int (*NativeFunction)(const NativeRuntime *runtime, Value *result);
+
+/* A translated chunk loaded from the native cache */
+typedef struct
+{
+    void *handle;
+    NativeFunction function;
+    ValueArray constants;
+} NativeCode;
+
+/* Writes chunk as a self-contained C function; false if it has an
+   instruction with no C translation. */
+bool emitC(Chunk *chunk, FILE *out);
+
+/* Cache entries are keyed by a hash of the source, the input names and the
+   value layout. The cache directory is $FAVE_CACHE, $XDG_CACHE_HOME/fave or
+   ~/.cache/fave; it and every library in it must belong to the current user
+   and be writable by no one else, or the cache is not used. */
+bool buildNative(Chunk *chunk, const char *src, const char *const *inputs, int inputCount);
+bool loadNative(NativeCode *native, const char *src, const char *const *inputs, int inputCount);
+
+void initNativeCode(NativeCode *native);
+void freeNativeCode(NativeCode *native);
+int runNative(NativeCode *native, Heap *heap, const Value *inputs, Value *result);
+
+#endif
@@ -0,0 +1,530 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+#include "memory.h"
+
+/* Every input is a number, so a stack slot holds the same kind of value
+   in every row of a block; only the lanes differ. Booleans are kept as 1
+   and 0, nil has no lanes at all. */
+typedef enum
+{
+    LANE_NUMBER,
+    LANE_BOOL,
+    LANE_NIL
+} LaneKind;
+
+typedef struct
+{
+    LaneKind kind;
+    double lanes[BATCH_BLOCK];
+} BatchSlot;
+
+/* The stack, as it was for the lanes that jumped, waiting for the
+   instruction they jumped to */
+typedef struct
+{
+    int target;
+    bool taken[BATCH_BLOCK];
+    int depth;
+    BatchSlot *slots;
+} PendingMerge;
+
+/* Rows can disagree on a conditional jump. The block then runs both paths
+   one after the other: the lanes that jumped are parked with a copy of the
+   stack, the rest carry on, and the two are merged lane by lane at the
+   target. Jumps only go forward, so the nearest target is always the next
+   one reached. */
+typedef struct
+{
+    bool active[BATCH_BLOCK];
+    /* False once every lane has jumped away */
+    bool live;
+    PendingMerge *pending;
+    int pendingCount;
+    int pendingCapacity;
+    /* The nearest pending target, -1 when nothing is pending */
+    int next;
+    int maxStack;
+} BatchFlow;
+
+static InterpretResult runBlock(Chunk *chunk, BatchSlot *stack, BatchFlow *flow,
+                                const double *const *columns, int row, int count, double *output);
+static bool diverge(BatchFlow *flow, BatchSlot *stack, BatchSlot *top, int target,
+                    const BatchSlot *condition);
+static bool converge(BatchFlow *flow, BatchSlot *stack, BatchSlot **top);
+static bool mergeSlots(BatchSlot *into, const BatchSlot *from, const bool *taken, int depth);
+static bool fillConstant(BatchSlot *slot, Value value);
+static void batchError(Chunk *chunk, uint8_t *ip, const char *format, ...);
+
+InterpretResult executeBatch(Prepared *prepared, const double *const *columns, int rows, double *output)
+{
+    /* runBlock() trusts its bytecode, and native code from the cache
+       comes without any */
+    Chunk *chunk = &prepared->chunk;
+    if (!chunk->verified)
+    {
+        fprintf(stderr, "Chunk has not been verified.\n");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    BatchSlot *stack = ALLOCATE(BatchSlot, chunk->maxStack);
+    memset(stack, 0, sizeof(BatchSlot) * chunk->maxStack);
+
+    BatchFlow flow;
+    flow.pending = NULL;
+    flow.pendingCapacity = 0;
+    flow.maxStack = chunk->maxStack;
+
+    InterpretResult result = INTERPRET_OK;
+    for (int row = 0; row < rows && result == INTERPRET_OK; row += BATCH_BLOCK)
+    {
+        int count = rows - row < BATCH_BLOCK ? rows - row : BATCH_BLOCK;
+        result = runBlock(chunk, stack, &flow, columns, row, count, output + row);
+    }
+
+    for (int i = 0; i < flow.pendingCapacity; i++)
+        FREE_ARRAY(BatchSlot, flow.pending[i].slots, chunk->maxStack);
+    FREE_ARRAY(PendingMerge, flow.pending, flow.pendingCapacity);
+    FREE_ARRAY(BatchSlot, stack, chunk->maxStack);
+    return result;
+}
+
+/* Runs the whole chunk once for rows [row, row + count). Each instruction
+   is dispatched once and then applied to every lane in a plain loop the
+   compiler can vectorize. Loops always cover the full block, since a fixed
+   trip count vectorizes even at -O2; lanes past count are never output. */
+static InterpretResult runBlock(Chunk *chunk, BatchSlot *stack, BatchFlow *flow,
+                                const double *const *columns, int row, int count, double *output)
+{
+    uint8_t *ip = chunk->code;
+    BatchSlot *top = stack;
+
+    for (int i = 0; i < BATCH_BLOCK; i++)
+        flow->active[i] = true;
+    flow->live = true;
+    flow->pendingCount = 0;
+    flow->next = -1;
+
+#define READ_BYTE() (*ip++)
+
+#define BATCH_ERROR(...)                            \
+    do                                              \
+    {                                               \
+        batchError(chunk, ip, __VA_ARGS__);         \
+        return INTERPRET_RUNTIME_ERROR;             \
+    } while (false)
+
+/* Combines the lanes of the two topmost slots into the lower one */
+#define LANEWISE(resultKind, expression)            \
+    do                                              \
+    {                                               \
+        double *restrict a = top[-2].lanes;         \
+        const double *restrict b = top[-1].lanes;   \
+        for (int i = 0; i < BATCH_BLOCK; i++)       \
+            a[i] = (expression);                    \
+        top[-2].kind = (resultKind);                \
+        top--;                                      \
+    } while (false)
+
+#define NUMERIC_OPERATION(resultKind, expression)                           \
+    do                                                                      \
+    {                                                                       \
+        if (top[-1].kind != LANE_NUMBER || top[-2].kind != LANE_NUMBER)     \
+            BATCH_ERROR("Operands must be numbers.");                       \
+        LANEWISE(resultKind, expression);                                   \
+    } while (false)
+
+    for (;;)
+    {
+        uint8_t instruction = READ_BYTE();
+        if (ip - 1 - chunk->code == flow->next && !converge(flow, stack, &top))
+            BATCH_ERROR("Both operands of and/or must have the same type in a batch.");
+
+        switch (instruction)
+        {
+        case OP_CONSTANT:
+        {
+            Value constant = chunk->constants.values[READ_BYTE()];
+            if (!fillConstant(top++, constant))
+                BATCH_ERROR("Only numbers, booleans and nil can be evaluated in a batch.");
+            break;
+        }
+        case OP_CONSTANT_LONG:
+        {
+            Value constant = chunk->constants.values[ip[0] | (ip[1] << 8) | (ip[2] << 16)];
+            ip += 3;
+            if (!fillConstant(top++, constant))
+                BATCH_ERROR("Only numbers, booleans and nil can be evaluated in a batch.");
+            break;
+        }
+        case OP_NIL:
+            fillConstant(top++, NIL_VAL);
+            break;
+        case OP_TRUE:
+            fillConstant(top++, BOOL_VAL(true));
+            break;
+        case OP_FALSE:
+            fillConstant(top++, BOOL_VAL(false));
+            break;
+
+        case OP_GET_INPUT:
+            top->kind = LANE_NUMBER;
+            memcpy(top->lanes, columns[READ_BYTE()] + row, sizeof(double) * count);
+            top++;
+            break;
+
+        case OP_PICK:
+        {
+            BatchSlot *slot = &top[-1 - READ_BYTE()];
+            *top++ = *slot;
+            break;
+        }
+        case OP_SLIDE:
+        {
+            int dropped = READ_BYTE();
+            if (dropped > 0)
+            {
+                top[-1 - dropped] = top[-1];
+                top -= dropped;
+            }
+            break;
+        }
+        case OP_POP:
+            top--;
+            break;
+        case OP_POPN:
+            top -= READ_BYTE();
+            break;
+
+        case OP_GET_LOCAL:
+        {
+            BatchSlot *slot = &stack[READ_BYTE()];
+            *top++ = *slot;
+            break;
+        }
+        case OP_SET_LOCAL:
+            stack[READ_BYTE()] = top[-1];
+            break;
+
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        {
+            int offset = (int)(ip - 1 - chunk->code);
+            bool conditional = instruction == OP_JUMP_IF_FALSE || instruction == OP_JUMP_IF_FALSE_LONG;
+            ip = chunk->code + offset + opcodeLength(instruction);
+
+            if (!diverge(flow, stack, top, jumpTarget(chunk->code, offset),
+                         conditional ? &top[-1] : NULL))
+                BATCH_ERROR("Both operands of and/or must have the same type in a batch.");
+
+            /* Nothing left to run on this path */
+            if (!flow->live)
+                ip = chunk->code + flow->next;
+            break;
+        }
+
+        /* Rows have no VM to keep globals in */
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+            BATCH_ERROR("Global variables cannot be used in a batch.");
+
+        case OP_NOT:
+        {
+            BatchSlot *slot = &top[-1];
+            if (slot->kind != LANE_BOOL)
+            {
+                fillConstant(slot, BOOL_VAL(slot->kind == LANE_NIL));
+                break;
+            }
+
+            double *restrict a = slot->lanes;
+            for (int i = 0; i < BATCH_BLOCK; i++)
+                a[i] = a[i] == 0.0;
+            break;
+        }
+
+        case OP_NEGATE:
+        case OP_NEGATE_NUM:
+        case OP_NEGATE_N:
+        {
+            if (top[-1].kind != LANE_NUMBER)
+                BATCH_ERROR("Operand must be a number.");
+
+            double *restrict a = top[-1].lanes;
+            for (int i = 0; i < BATCH_BLOCK; i++)
+                a[i] = -a[i];
+            break;
+        }
+
+        case OP_ADD_CONSTANT:
+        case OP_ADD_CONSTANT_NUM:
+        case OP_ADD_CONSTANT_NN:
+        {
+            Value constant = chunk->constants.values[READ_BYTE()];
+            if (top[-1].kind != LANE_NUMBER || !IS_NUMBER(constant))
+                BATCH_ERROR("Operands must be numbers.");
+
+            double *restrict a = top[-1].lanes;
+            double addend = AS_NUMBER(constant);
+            for (int i = 0; i < BATCH_BLOCK; i++)
+                a[i] += addend;
+            break;
+        }
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_NN:
+            NUMERIC_OPERATION(LANE_NUMBER, a[i] + b[i]);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_SUBTRACT_NN:
+            NUMERIC_OPERATION(LANE_NUMBER, a[i] - b[i]);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_MULTIPLY_NN:
+            NUMERIC_OPERATION(LANE_NUMBER, a[i] * b[i]);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+        case OP_DIVIDE_NN:
+            NUMERIC_OPERATION(LANE_NUMBER, a[i] / b[i]);
+            break;
+
+        /* Written exactly as run() computes them, so NaNs compare the same */
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_GREATER_NN:
+            NUMERIC_OPERATION(LANE_BOOL, a[i] > b[i]);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_LESS_NN:
+            NUMERIC_OPERATION(LANE_BOOL, a[i] < b[i]);
+            break;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NN:
+            NUMERIC_OPERATION(LANE_BOOL, !(a[i] < b[i]));
+            break;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM:
+        case OP_LESS_EQUAL_NN:
+            NUMERIC_OPERATION(LANE_BOOL, !(a[i] > b[i]));
+            break;
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        {
+            bool negate = instruction == OP_NOT_EQUAL;
+            if (top[-1].kind != top[-2].kind || top[-1].kind == LANE_NIL)
+            {
+                bool equal = top[-1].kind == top[-2].kind;
+                top--;
+                fillConstant(&top[-1], BOOL_VAL(equal != negate));
+            }
+            else if (negate)
+            {
+                LANEWISE(LANE_BOOL, a[i] != b[i]);
+            }
+            else
+            {
+                LANEWISE(LANE_BOOL, a[i] == b[i]);
+            }
+            break;
+        }
+
+        case OP_RETURN:
+        {
+            BatchSlot *slot = &top[-1];
+            if (slot->kind == LANE_NIL)
+            {
+                for (int i = 0; i < count; i++)
+                    output[i] = NAN;
+            }
+            else
+            {
+                memcpy(output, slot->lanes, sizeof(double) * count);
+            }
+            return INTERPRET_OK;
+        }
+
+        default:
+            BATCH_ERROR("Unknown opcode %d.", instruction);
+        }
+    }
+
+#undef READ_BYTE
+#undef BATCH_ERROR
+#undef LANEWISE
+#undef NUMERIC_OPERATION
+}
+
+/* Parks the active lanes that take a jump to target, all of them when
+   condition is NULL; false if they meet lanes already parked there with a
+   differently typed stack. */
+static bool diverge(BatchFlow *flow, BatchSlot *stack, BatchSlot *top, int target,
+                    const BatchSlot *condition)
+{
+    /* Numbers are always truthy and nil never is */
+    if (condition != NULL && condition->kind == LANE_NUMBER)
+        return true;
+
+    bool taken[BATCH_BLOCK];
+    bool any = false;
+    for (int i = 0; i < BATCH_BLOCK; i++)
+    {
+        bool falsey = condition == NULL || condition->kind == LANE_NIL || condition->lanes[i] == 0.0;
+        taken[i] = flow->active[i] && falsey;
+        any |= taken[i];
+    }
+    if (!any)
+        return true;
+
+    int depth = (int)(top - stack);
+    PendingMerge *merge = NULL;
+    for (int i = 0; i < flow->pendingCount; i++)
+    {
+        if (flow->pending[i].target == target)
+            merge = &flow->pending[i];
+    }
+
+    if (merge != NULL)
+    {
+        if (!mergeSlots(merge->slots, stack, taken, depth))
+            return false;
+        for (int i = 0; i < BATCH_BLOCK; i++)
+            merge->taken[i] |= taken[i];
+    }
+    else
+    {
+        if (flow->pendingCount == flow->pendingCapacity)
+        {
+            int oldCapacity = flow->pendingCapacity;
+            flow->pendingCapacity = GROW_CAPACITY(oldCapacity);
+            flow->pending = GROW_ARRAY(PendingMerge, flow->pending, oldCapacity, flow->pendingCapacity);
+            for (int i = oldCapacity; i < flow->pendingCapacity; i++)
+                flow->pending[i].slots = ALLOCATE(BatchSlot, flow->maxStack);
+        }
+
+        merge = &flow->pending[flow->pendingCount++];
+        merge->target = target;
+        merge->depth = depth;
+        memcpy(merge->taken, taken, sizeof(taken));
+        memcpy(merge->slots, stack, sizeof(BatchSlot) * depth);
+        if (flow->next == -1 || target < flow->next)
+            flow->next = target;
+    }
+
+    flow->live = false;
+    for (int i = 0; i < BATCH_BLOCK; i++)
+    {
+        flow->active[i] &= !taken[i];
+        flow->live |= flow->active[i];
+    }
+    return true;
+}
+
+/* Brings back the lanes parked at the nearest target, which the block has
+   just reached */
+static bool converge(BatchFlow *flow, BatchSlot *stack, BatchSlot **top)
+{
+    int index = 0;
+    while (flow->pending[index].target != flow->next)
+        index++;
+    PendingMerge *merge = &flow->pending[index];
+
+    if (!flow->live)
+    {
+        memcpy(stack, merge->slots, sizeof(BatchSlot) * merge->depth);
+        *top = stack + merge->depth;
+        memcpy(flow->active, merge->taken, sizeof(merge->taken));
+        flow->live = true;
+    }
+    else
+    {
+        if (!mergeSlots(stack, merge->slots, merge->taken, merge->depth))
+            return false;
+        for (int i = 0; i < BATCH_BLOCK; i++)
+            flow->active[i] |= merge->taken[i];
+    }
+
+    /* Swapped rather than copied, so each entry keeps its own slots */
+    PendingMerge done = *merge;
+    *merge = flow->pending[--flow->pendingCount];
+    flow->pending[flow->pendingCount] = done;
+
+    flow->next = -1;
+    for (int i = 0; i < flow->pendingCount; i++)
+    {
+        if (flow->next == -1 || flow->pending[i].target < flow->next)
+            flow->next = flow->pending[i].target;
+    }
+    return true;
+}
+
+/* Copies the taken lanes of from into the matching slots of into; false if
+   a slot holds a different kind of value on the two paths */
+static bool mergeSlots(BatchSlot *into, const BatchSlot *from, const bool *taken, int depth)
+{
+    for (int slot = 0; slot < depth; slot++)
+    {
+        if (into[slot].kind != from[slot].kind)
+            return false;
+
+        double *restrict a = into[slot].lanes;
+        const double *restrict b = from[slot].lanes;
+        for (int i = 0; i < BATCH_BLOCK; i++)
+            a[i] = taken[i] ? b[i] : a[i];
+    }
+    return true;
+}
+
+/* Broadcasts a constant to every lane; false if it has no lane form */
+static bool fillConstant(BatchSlot *slot, Value value)
+{
+    double lane;
+    if (IS_NUMBER(value))
+    {
+        slot->kind = LANE_NUMBER;
+        lane = AS_NUMBER(value);
+    }
+    else if (IS_BOOL(value))
+    {
+        slot->kind = LANE_BOOL;
+        lane = AS_BOOL(value) ? 1.0 : 0.0;
+    }
+    else if (IS_NIL(value))
+    {
+        slot->kind = LANE_NIL;
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+
+    for (int i = 0; i < BATCH_BLOCK; i++)
+        slot->lanes[i] = lane;
+    return true;
+}
+
+static void batchError(Chunk *chunk, uint8_t *ip, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    int offset = (int)(ip - chunk->code - 1);
+    int line = getLine(&chunk->lines, &offset);
+    fprintf(stderr, "[line %d] in script\n", line);
+}
@@ -0,0 +1,18 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "vm.h"
+
+/* Rows evaluated by each pass over the bytecode */
+#define BATCH_BLOCK 256
+
+/* Evaluates a prepared expression once for each of the given rows. The
+   i-th column holds the values of the i-th input the expression was
+   prepared with. Numeric results are written to output as they are,
+   booleans as 1 or 0 and nil as NaN. An and/or whose operands have
+   different types is a runtime error once rows take different sides, and
+   so is a Prepared with no verified bytecode, such as one loaded from the
+   native cache. */
+InterpretResult executeBatch(Prepared *prepared, const double *const *columns, int rows, double *output);
+
+#endif
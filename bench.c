@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#define DEFAULT_RUNS 1000000
+
+/* A script timed over many executions of one prepared handle, with its
+   inputs bound to the same values every time so nothing is folded away.
+   A compile workload is prepared and released around every execution. */
+typedef struct
+{
+    const char *name;
+    const char *src;
+    const char *const *inputNames;
+    const Value *inputs;
+    int inputCount;
+    bool compile;
+} Workload;
+
+static const char *const numberNames[] = {"x", "y"};
+static Value numbers[2];
+static Value strings[2];
+
+static const Workload workloads[] = {
+    {"arithmetic", "(x + y) * (x - y) / (x * 0.5 + 1) - (y + 3) * (x - 2) + x * y * 0.25",
+     numberNames, numbers, 2, false},
+    {"comparison", "(x < y) == !(x >= y) and (x + 1 > y or y - 1 <= x) and !(x == y)",
+     numberNames, numbers, 2, false},
+    {"globals", "total = total + x * y - (total - x) / (y + 1); total",
+     numberNames, numbers, 2, false},
+    {"locals", "{ var a = x * 2; var b = a + y; { var c = a * b - x; total = c - a * b; } } total",
+     numberNames, numbers, 2, false},
+    {"block", "{ var a = 3.25; var b = a * 2 - a; var c = (a + b) * (a - b) / (b + 1); a = c * b - a; }",
+     NULL, NULL, 0, false},
+    {"short", "x + \"-\" == y + \"-\" or (x + \":\") + (y + \":\") == y",
+     numberNames, strings, 2, false},
+    {"concat", "(x + y) + (y + x) + (x + \" \" + y)", numberNames, strings, 2, false},
+    {"compile", "{ var a = x * 2; var b = a + y; total = a * b - (x + y) / 2; } total",
+     numberNames, numbers, 2, true},
+};
+
+static Backend parseBackend(const char *arg);
+static void printConfiguration(Backend backend);
+static double timeWorkload(VM *vm, const Workload *workload, Backend backend, long runs);
+static double seconds(void);
+
+/* Prints the time per execution of each workload under this build's
+   configuration, so that two builds can be compared line by line (see the
+   bench-* targets in the Makefile) */
+int main(int argc, const char *argv[])
+{
+    int arg = 1;
+    Backend backend = BACKEND_STACK;
+    if (arg < argc && strncmp(argv[arg], "--", 2) == 0)
+        backend = parseBackend(argv[arg++]);
+
+    long runs = arg < argc ? atol(argv[arg++]) : DEFAULT_RUNS;
+    if (arg != argc || runs <= 0)
+    {
+        fprintf(stderr, "Usage: bench [--register | --jit | --native] [runs]\n");
+        exit(64);
+    }
+
+    numbers[0] = NUMBER_VAL(3.25);
+    numbers[1] = NUMBER_VAL(-1.5);
+    strings[0] = OBJ_VAL(copyString("the quick brown fox", 19));
+    strings[1] = OBJ_VAL(copyString("jumps over the lazy dog", 23));
+
+    VM vm;
+    vmInit(&vm);
+    printConfiguration(backend);
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        double elapsed = timeWorkload(&vm, &workloads[i], backend, runs);
+        if (elapsed < 0)
+            return 70;
+        printf("%-12s %8.1f ns/run\n", workloads[i].name, elapsed * 1e9 / runs);
+    }
+
+    vmFree(&vm);
+    releaseValue(strings[0]);
+    releaseValue(strings[1]);
+    return 0;
+}
+
+static Backend parseBackend(const char *arg)
+{
+    if (strcmp(arg, "--register") == 0)
+        return BACKEND_REGISTER;
+    if (strcmp(arg, "--jit") == 0)
+        return BACKEND_JIT;
+    if (strcmp(arg, "--native") == 0)
+        return BACKEND_NATIVE;
+
+    fprintf(stderr, "Unknown backend '%s'.\n", arg);
+    exit(64);
+}
+
+static void printConfiguration(Backend backend)
+{
+    static const char *backends[] = {"stack", "register", "jit", "native"};
+#ifdef COMPUTED_GOTO
+    const char *dispatch = "goto";
+#else
+    const char *dispatch = "switch";
+#endif
+#ifdef NAN_BOXING
+    const char *layout = "nanbox";
+#else
+    const char *layout = "tagged";
+#endif
+#ifdef SYSTEM_ALLOCATOR
+    const char *allocator = "system";
+#else
+    const char *allocator = "pool";
+#endif
+    printf("backend=%s dispatch=%s value=%s allocator=%s\n", backends[backend], dispatch,
+           layout, allocator);
+}
+
+/* Returns the seconds taken by runs executions, or -1 after reporting a
+   script that fails */
+static double timeWorkload(VM *vm, const Workload *workload, Backend backend, long runs)
+{
+    Prepared *prepared = prepareInputs(workload->src, backend, workload->inputNames,
+                                       workload->inputCount);
+    if (prepared == NULL)
+        return -1;
+
+    vmBindInputs(vm, workload->inputs);
+    vmSetGlobal(vm, "total", NUMBER_VAL(0));
+
+    Value result;
+    double start = seconds();
+    for (long i = 0; i < runs; i++)
+    {
+        if (workload->compile && i > 0)
+        {
+            release(prepared);
+            prepared = prepareInputs(workload->src, backend, workload->inputNames,
+                                     workload->inputCount);
+        }
+        if (vmExecute(vm, prepared, &result) != INTERPRET_OK)
+        {
+            fprintf(stderr, "Workload '%s' failed.\n", workload->name);
+            release(prepared);
+            return -1;
+        }
+    }
+    double elapsed = seconds() - start;
+
+    release(prepared);
+    return elapsed;
+}
+
+static double seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -1,11 +1,19 @@
+#include <sys/mman.h>
+
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 
 void initChunk(Chunk *chunk)
 {
     chunk->code = NULL;
     chunk->capacity = 0;
     chunk->count = 0;
+    chunk->maxStack = 0;
+    chunk->globalLimit = 0;
+    chunk->mapping = NULL;
+    chunk->mappingSize = 0;
+    chunk->verified = false;
 
     initLineArray(&chunk->lines);
     initValueArray(&chunk->constants);
@@ -28,16 +36,137 @@ void writeChunk(Chunk *chunk, uint8_t instruction, int line)
 
 void freeChunk(Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->mapping != NULL)
+    {
+        munmap(chunk->mapping, chunk->mappingSize);
+    }
+    else
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        freeLineArray(&chunk->lines);
+    }
 
+    for (int i = 0; i < chunk->constants.count; i++)
+        releaseValue(chunk->constants.values[i]);
     freeValueArray(&chunk->constants);
-    freeLineArray(&chunk->lines);
 
     initChunk(chunk);
 }
 
 int addConstant(Chunk *chunk, Value value)
 {
+    retainValue(value);
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
 }
+
+/* Size in bytes of an instruction, including its operands */
+int opcodeLength(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_CONSTANT:
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+    case OP_ADD_CONSTANT_NN:
+    case OP_GET_INPUT:
+    case OP_PICK:
+    case OP_SLIDE:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_POPN:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+/* Net number of values the instruction at ip pushes (negative when it
+   pops). Only OP_SLIDE and OP_POPN depend on their operand. */
+int stackEffect(const uint8_t *ip)
+{
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_INPUT:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_PICK:
+        return 1;
+
+    case OP_SLIDE:
+    case OP_POPN:
+        return -ip[1];
+
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+    case OP_NEGATE_N:
+    case OP_ADD_CONSTANT_NN:
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/* True for the unchecked forms, whose stack operands (and constant, for
+   OP_ADD_CONSTANT_NN) must be numbers */
+bool assumesNumbers(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_NEGATE_N:
+    case OP_ADD_CONSTANT_NN:
+    case OP_ADD_NN:
+    case OP_SUBTRACT_NN:
+    case OP_MULTIPLY_NN:
+    case OP_DIVIDE_NN:
+    case OP_GREATER_NN:
+    case OP_LESS_NN:
+    case OP_GREATER_EQUAL_NN:
+    case OP_LESS_EQUAL_NN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isJump(uint8_t opcode)
+{
+    return opcode == OP_JUMP || opcode == OP_JUMP_LONG ||
+           opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG;
+}
+
+/* Offset of the instruction the jump at offset lands on */
+int jumpTarget(const uint8_t *code, int offset)
+{
+    const uint8_t *ip = &code[offset];
+    int distance = ip[1] | (ip[2] << 8);
+    if (ip[0] == OP_JUMP_LONG || ip[0] == OP_JUMP_IF_FALSE_LONG)
+        distance |= ip[3] << 16;
+
+    return offset + opcodeLength(ip[0]) + distance;
+}
@@ -5,10 +5,51 @@
 #include "value.h"
 #include "line.h"
 
+/* OP_CONSTANT_LONG takes a 24-bit little-endian pool index */
+#define CONSTANT_LONG_MAX 0xffffff
+
+/* Jump distances: 16 bits for the short forms, 24 for the long ones */
+#define JUMP_MAX UINT16_MAX
+#define JUMP_LONG_MAX 0xffffff
+
 typedef enum
 {
 
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
+
+    /* Pushes the value bound to a named input of a prepared expression */
+    OP_GET_INPUT,
+
+    /* Globals are addressed by the slot the compiler resolved their name
+       to, a 16-bit little-endian operand. GET and SET fail on a global
+       that has no value yet; DEFINE gives it one and pops it. */
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
+    OP_DEFINE_GLOBAL,
+
+    /* Locals live in the stack slot their declaration left them in; the
+       operand is that slot, counted from the bottom of the script's
+       stack. POPN n drops the n locals of a scope that ends. */
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_POPN,
+
+    /* PICK n pushes a copy of the value n slots below the top; SLIDE n
+       drops the n values beneath the top one. Together they let a common
+       subexpression be computed once and reused. */
+    OP_PICK,
+    OP_SLIDE,
+    OP_POP,
+
+    /* Jumps only go forward, by the little-endian distance from the end of
+       the instruction. JUMP_IF_FALSE leaves the condition on the stack.
+       The compiler emits the long forms; the peephole optimizer shortens
+       those whose distance fits. */
+    OP_JUMP,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
 
     OP_NIL,
     OP_NOT,
@@ -19,6 +60,37 @@ typedef enum
     OP_GREATER,
     OP_LESS,
 
+    /* Fused by the peephole optimizer */
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_ADD_CONSTANT,
+
+    /* Quickened by the VM once their operands have been seen to be numbers */
+    OP_NEGATE_NUM,
+    OP_ADD_CONSTANT_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_EQUAL_NUM,
+
+    /* Emitted only where the compiler has proven every operand is a number;
+       they neither check nor deoptimize */
+    OP_NEGATE_N,
+    OP_ADD_CONSTANT_NN,
+    OP_ADD_NN,
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
+    OP_GREATER_NN,
+    OP_LESS_NN,
+    OP_GREATER_EQUAL_NN,
+    OP_LESS_EQUAL_NN,
+
     OP_RETURN,
 
     /* Unary Operations */
@@ -40,12 +112,32 @@ typedef struct
 
     LineArray lines;
 
+    /* Holds a reference to each interned string in it */
     ValueArray constants;
+
+    /* Deepest the value stack can get while running this chunk */
+    int maxStack;
+
+    /* One past the highest global slot the code refers to */
+    int globalLimit;
+
+    /* Set when code and lines point into a mapped image file instead of
+       arrays the chunk owns */
+    void *mapping;
+    size_t mappingSize;
+
+    /* Set by verifyChunk(); the VM only runs verified chunks */
+    bool verified;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t instruction, int line);
 void freeChunk(Chunk *chunk);
 int addConstant(Chunk *chunk, Value value);
+int opcodeLength(uint8_t opcode);
+int stackEffect(const uint8_t *ip);
+bool assumesNumbers(uint8_t opcode);
+bool isJump(uint8_t opcode);
+int jumpTarget(const uint8_t *code, int offset);
 
 #endif
@@ -6,7 +6,28 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef NDEBUG
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
+#endif
 
-#endif
\ No newline at end of file
+/* Defining DEBUG_STRESS_GC makes every safepoint after an allocation
+   collect, and major collections start from a few kilobytes, to flush out
+   values the collector cannot see */
+
+/* Values are NaN-boxed into 8 bytes unless the tagged union is requested. */
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+/* Threaded dispatch needs labels-as-values; other compilers use the switch. */
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+/* The JIT emits x86-64 into mmap'd pages; elsewhere it translates nothing. */
+#if defined(__x86_64__) && defined(__unix__) && !defined(NO_JIT)
+#define JIT_X86_64
+#endif
+
+#endif
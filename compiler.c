@@ -1,46 +1,86 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
 #include "token.h"
 #include "scanner.h"
 #include "object.h"
+#include "optimizer.h"
+#include "verifier.h"
+#include "memory.h"
+#include "globals.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-Parser parser;
-Chunk *currChunk;
-
 /* Error Utils */
-static void error(const char *errorMessage);
-static void errorAt(Token *token, const char *errorMessage);
-static void errorCurrent(const char *errorMessage);
+static void error(Compiler *compiler, const char *errorMessage);
+static void errorAt(Compiler *compiler, Token *token, const char *errorMessage);
+static void errorCurrent(Compiler *compiler, const char *errorMessage);
 
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Compiler *compiler, Precedence precedence);
 static ParseRule *getRule(TokenType tokenType);
 
-static void expression();
-static void number();
-static void string();
-static void grouping();
-static void unary();
-static void binary();
-static void literal();
+static void script(Compiler *compiler);
+static void declaration(Compiler *compiler);
+static void varDeclaration(Compiler *compiler);
+static void localDeclaration(Compiler *compiler, Token name);
+static void statement(Compiler *compiler);
+static void block(Compiler *compiler);
+static void expressionStatement(Compiler *compiler);
+static void beginScope(Compiler *compiler);
+static void endScope(Compiler *compiler);
+static void synchronize(Compiler *compiler);
+
+static void expression(Compiler *compiler);
+static void number(Compiler *compiler, bool canAssign);
+static void string(Compiler *compiler, bool canAssign);
+static void grouping(Compiler *compiler, bool canAssign);
+static void unary(Compiler *compiler, bool canAssign);
+static void binary(Compiler *compiler, bool canAssign);
+static void literal(Compiler *compiler, bool canAssign);
+static void and_(Compiler *compiler, bool canAssign);
+static void or_(Compiler *compiler, bool canAssign);
+static void shortCircuit(Compiler *compiler, IrOp op, Precedence precedence);
+static void variable(Compiler *compiler, bool canAssign);
+static int resolveLocal(Compiler *compiler, Token *name);
+static int findInput(Compiler *compiler, Token *name);
+static int globalSlot(Compiler *compiler, Token *name);
+
+static void emitByte(Compiler *compiler, uint8_t byte);
+static void emitOp(Compiler *compiler, uint8_t opcode);
+static void emitOpWithOperand(Compiler *compiler, uint8_t opcode, uint8_t operand);
+static void endInstruction(Compiler *compiler, int offset);
+static void emitGlobal(Compiler *compiler, uint8_t opcode, int slot);
+static int emitJump(Compiler *compiler, uint8_t opcode);
+static void patchJump(Compiler *compiler, int offset);
+static void emitReturn(Compiler *compiler);
 
-static void emitByte(uint8_t instruction);
-static void emitBytes(uint8_t a, uint8_t b);
-static void emitReturn();
+static void emitConstant(Compiler *compiler, Value value);
+static int makeConstant(Compiler *compiler, Value value);
 
-static void emitConstant(Value value);
-static uint8_t makeConstant(Value value);
+/* Lowering */
+static StaticType lowerExpression(Compiler *compiler);
+static void lowerIr(Compiler *compiler);
+static void emitNode(Compiler *compiler, int index);
+static void emitShortCircuit(Compiler *compiler, IrNode *node);
+static uint8_t nodeOpcode(IrGraph *ir, IrNode *node);
 
-static void consume(TokenType type, const char *errorMessage);
-static Chunk *getChunk();
+/* Constant deduplication */
+static void initConstantIndex(ConstantIndex *index);
+static void freeConstantIndex(ConstantIndex *index);
+static int findConstant(ConstantIndex *index, Value value);
+static void recordConstant(ConstantIndex *index, Value value, int slot);
 
-static void endCompiler();
-static void advance();
+static void consume(Compiler *compiler, TokenType type, const char *errorMessage);
+static bool check(Compiler *compiler, TokenType type);
+static bool match(Compiler *compiler, TokenType type);
+static Chunk *getChunk(Compiler *compiler);
+
+static void endCompiler(Compiler *compiler);
+static void advance(Compiler *compiler);
 
 /* Parsing Rules */
 
@@ -64,10 +104,10 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
@@ -75,7 +115,7 @@ ParseRule rules[] = {
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
     [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
@@ -87,94 +127,225 @@ ParseRule rules[] = {
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
+
 bool compile(const char *src, Chunk *chunk)
 {
-    initScanner(src);
-    currChunk = chunk;
+    Compiler compiler;
+    return compileWith(&compiler, src, chunk);
+}
+
+bool compileWith(Compiler *compiler, const char *src, Chunk *chunk)
+{
+    return compileInputs(compiler, src, chunk, NULL, 0);
+}
+
+bool compileInputs(Compiler *compiler, const char *src, Chunk *chunk,
+                   const char *const *inputs, int inputCount)
+{
+    initScanner(&compiler->scanner, src);
+    compiler->chunk = chunk;
+    compiler->inputs = inputs;
+    compiler->inputCount = inputCount;
+
+    compiler->parser.hadError = false;
+    compiler->parser.panicMode = false;
+    initIrGraph(&compiler->ir);
+    compiler->expr = -1;
+    initConstantIndex(&compiler->constantIndex);
+    compiler->stackDepth = 0;
+    compiler->line = 0;
+    compiler->localCount = 0;
+    compiler->scopeDepth = 0;
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    advance(compiler);
+    script(compiler);
+    endCompiler(compiler);
 
-    advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
-    endCompiler();
-    return !parser.hadError;
+    freeConstantIndex(&compiler->constantIndex);
+    freeIrGraph(&compiler->ir);
+    return !compiler->parser.hadError;
 }
 
-static void advance()
+static void advance(Compiler *compiler)
 {
-    parser.prev = parser.curr;
+    compiler->parser.prev = compiler->parser.curr;
 
     for (;;)
     {
-        parser.curr = scanToken();
-        if (parser.curr.type != TOKEN_ERROR)
+        compiler->parser.curr = scanToken(&compiler->scanner);
+        if (compiler->parser.curr.type != TOKEN_ERROR)
             break;
 
-        errorCurrent(parser.curr.start);
+        errorCurrent(compiler, compiler->parser.curr.start);
     }
 }
 
-static void consume(TokenType type, const char *errorMessage)
+static void consume(Compiler *compiler, TokenType type, const char *errorMessage)
 {
-    if (parser.curr.type != type)
+    if (compiler->parser.curr.type != type)
     {
-        errorCurrent(errorMessage);
+        errorCurrent(compiler, errorMessage);
         return;
     }
 
-    advance();
+    advance(compiler);
+}
+
+static bool check(Compiler *compiler, TokenType type)
+{
+    return compiler->parser.curr.type == type;
+}
+
+static bool match(Compiler *compiler, TokenType type)
+{
+    if (!check(compiler, type))
+        return false;
+
+    advance(compiler);
+    return true;
+}
+
+static void emitByte(Compiler *compiler, uint8_t byte)
+{
+    writeChunk(getChunk(compiler), byte, compiler->line);
+}
+
+/* Runs once the whole instruction starting at offset is written, since
+   the effect of some depends on their operands */
+static void endInstruction(Compiler *compiler, int offset)
+{
+    Chunk *chunk = getChunk(compiler);
+    compiler->stackDepth += stackEffect(&chunk->code[offset]);
+    if (compiler->stackDepth > chunk->maxStack)
+        chunk->maxStack = compiler->stackDepth;
+}
+
+static void emitOp(Compiler *compiler, uint8_t opcode)
+{
+    int offset = getChunk(compiler)->count;
+    emitByte(compiler, opcode);
+    endInstruction(compiler, offset);
 }
 
-static void emitByte(uint8_t instruction)
+static void emitOpWithOperand(Compiler *compiler, uint8_t opcode, uint8_t operand)
 {
-    writeChunk(getChunk(), instruction, parser.prev.line);
+    int offset = getChunk(compiler)->count;
+    emitByte(compiler, opcode);
+    emitByte(compiler, operand);
+    endInstruction(compiler, offset);
 }
 
-static void emitBytes(uint8_t a, uint8_t b)
+/* Global slots are 16 bits, written little-endian */
+static void emitGlobal(Compiler *compiler, uint8_t opcode, int slot)
 {
-    emitByte(a);
-    emitByte(b);
+    Chunk *chunk = getChunk(compiler);
+    int offset = chunk->count;
+    emitByte(compiler, opcode);
+    emitByte(compiler, (uint8_t)(slot & 0xff));
+    emitByte(compiler, (uint8_t)((slot >> 8) & 0xff));
+    endInstruction(compiler, offset);
+
+    if (slot >= chunk->globalLimit)
+        chunk->globalLimit = slot + 1;
 }
 
-static void emitReturn()
+/* Jumps are written in their long form, aimed nowhere until patched; the
+   peephole optimizer shortens them afterwards */
+static int emitJump(Compiler *compiler, uint8_t opcode)
 {
-    emitByte(OP_RETURN);
+    int offset = getChunk(compiler)->count;
+    emitByte(compiler, opcode);
+    emitByte(compiler, 0xff);
+    emitByte(compiler, 0xff);
+    emitByte(compiler, 0xff);
+    endInstruction(compiler, offset);
+    return offset;
 }
 
-static uint8_t makeConstant(Value value)
+/* Aims the jump at offset to the next instruction to be emitted */
+static void patchJump(Compiler *compiler, int offset)
 {
-    int constant = addConstant(getChunk(), value);
-    if (constant > UINT8_MAX)
+    Chunk *chunk = getChunk(compiler);
+    int distance = chunk->count - offset - opcodeLength(chunk->code[offset]);
+    if (distance > JUMP_LONG_MAX)
     {
-        error("Too many constants in one chunk.");
+        error(compiler, "Too much code to jump over.");
+        return;
+    }
+
+    chunk->code[offset + 1] = (uint8_t)(distance & 0xff);
+    chunk->code[offset + 2] = (uint8_t)((distance >> 8) & 0xff);
+    chunk->code[offset + 3] = (uint8_t)((distance >> 16) & 0xff);
+}
+
+static void emitReturn(Compiler *compiler)
+{
+    emitOp(compiler, OP_RETURN);
+}
+
+static int makeConstant(Compiler *compiler, Value value)
+{
+    Chunk *chunk = getChunk(compiler);
+    int constant = findConstant(&compiler->constantIndex, value);
+    if (constant != -1)
+        return constant;
+
+    constant = addConstant(chunk, value);
+    if (constant > CONSTANT_LONG_MAX)
+    {
+        error(compiler, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    recordConstant(&compiler->constantIndex, value, constant);
+    return constant;
 }
 
-static void emitConstant(Value value)
+static void emitConstant(Compiler *compiler, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    if (IS_NIL(value))
+    {
+        emitOp(compiler, OP_NIL);
+        return;
+    }
+
+    if (IS_BOOL(value))
+    {
+        emitOp(compiler, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+        return;
+    }
+
+    int constant = makeConstant(compiler, value);
+    if (constant <= UINT8_MAX)
+    {
+        emitOpWithOperand(compiler, OP_CONSTANT, (uint8_t)constant);
+        return;
+    }
+
+    int offset = getChunk(compiler)->count;
+    emitByte(compiler, OP_CONSTANT_LONG);
+    emitByte(compiler, (uint8_t)(constant & 0xff));
+    emitByte(compiler, (uint8_t)((constant >> 8) & 0xff));
+    emitByte(compiler, (uint8_t)((constant >> 16) & 0xff));
+    endInstruction(compiler, offset);
 }
 
-static void unary()
+static void unary(Compiler *compiler, bool canAssign)
 {
-    TokenType opType = parser.prev.type;
+    (void)canAssign;
+    Token opToken = compiler->parser.prev;
 
     /* Compile operand. */
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(compiler, PREC_UNARY);
 
-    switch (opType)
+    switch (opToken.type)
     {
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        compiler->expr = irUnary(&compiler->ir, IR_NEGATE, compiler->expr, opToken);
         break;
 
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        compiler->expr = irUnary(&compiler->ir, IR_NOT, compiler->expr, opToken);
         break;
 
     default:
@@ -182,123 +353,721 @@ static void unary()
     }
 }
 
-static void binary()
+static void binary(Compiler *compiler, bool canAssign)
 {
-    TokenType operator= parser.prev.type;
-    ParseRule *rule = getRule(operator);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    (void)canAssign;
+    Token opToken = compiler->parser.prev;
+    ParseRule *rule = getRule(opToken.type);
+    int left = compiler->expr;
 
-    switch (operator)
+    parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
+
+    IrOp op;
+    switch (opToken.type)
     {
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        op = IR_ADD;
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        op = IR_SUBTRACT;
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        op = IR_MULTIPLY;
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        op = IR_DIVIDE;
         break;
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        op = IR_NOT_EQUAL;
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        op = IR_EQUAL;
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        op = IR_GREATER;
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        op = IR_GREATER_EQUAL;
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        op = IR_LESS;
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        op = IR_LESS_EQUAL;
         break;
     default:
-        break;
+        return;
     }
+
+    compiler->expr = irBinary(&compiler->ir, op, left, compiler->expr, opToken);
 }
 
-static void literal()
+static void literal(Compiler *compiler, bool canAssign)
 {
-    switch (parser.prev.type)
+    (void)canAssign;
+    Token token = compiler->parser.prev;
+    switch (token.type)
     {
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        compiler->expr = irConstant(&compiler->ir, NIL_VAL, token);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        compiler->expr = irConstant(&compiler->ir, BOOL_VAL(true), token);
         break;
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        compiler->expr = irConstant(&compiler->ir, BOOL_VAL(false), token);
         break;
     default:
         return;
     }
 }
 
-static void parsePrecedence(Precedence precedence)
+static void and_(Compiler *compiler, bool canAssign)
+{
+    (void)canAssign;
+    shortCircuit(compiler, IR_AND, PREC_AND);
+}
+
+static void or_(Compiler *compiler, bool canAssign)
+{
+    (void)canAssign;
+    shortCircuit(compiler, IR_OR, PREC_OR);
+}
+
+/* A local assigned on the right may or may not have been by the time the
+   and/or is done, so later reads no longer know what it holds */
+static void shortCircuit(Compiler *compiler, IrOp op, Precedence precedence)
+{
+    Token opToken = compiler->parser.prev;
+    int left = compiler->expr;
+
+    int writers[LOCALS_MAX];
+    for (int i = 0; i < compiler->localCount; i++)
+        writers[i] = compiler->locals[i].writer;
+
+    parsePrecedence(compiler, (Precedence)(precedence + 1));
+
+    for (int i = 0; i < compiler->localCount; i++)
+    {
+        Local *local = &compiler->locals[i];
+        if (local->writer != writers[i])
+        {
+            local->writer = -1;
+            local->type = TYPE_UNKNOWN;
+        }
+    }
+
+    compiler->expr = irBinary(&compiler->ir, op, left, compiler->expr, opToken);
+}
+
+/* Locals shadow inputs, and inputs shadow globals. Any other name is a
+   global, resolved to its slot now even if nothing defines it until run
+   time. */
+static void variable(Compiler *compiler, bool canAssign)
+{
+    Token name = compiler->parser.prev;
+    int local = resolveLocal(compiler, &name);
+    if (local != -1)
+    {
+        if (canAssign && match(compiler, TOKEN_EQUAL))
+        {
+            expression(compiler);
+            compiler->expr = irSetLocal(&compiler->ir, local, compiler->expr, name);
+            compiler->locals[local].writer = compiler->expr;
+            return;
+        }
+
+        Local *variable = &compiler->locals[local];
+        compiler->expr = irLocal(&compiler->ir, local, variable->writer, variable->type, name);
+        return;
+    }
+
+    int input = findInput(compiler, &name);
+    if (input != -1)
+    {
+        compiler->expr = irInput(&compiler->ir, input, name);
+        return;
+    }
+
+    int slot = globalSlot(compiler, &name);
+    if (canAssign && match(compiler, TOKEN_EQUAL))
+    {
+        expression(compiler);
+        compiler->expr = irSetGlobal(&compiler->ir, slot, compiler->expr, name);
+        return;
+    }
+
+    compiler->expr = irGlobal(&compiler->ir, slot, name);
+}
+
+static bool identifiersEqual(Token *a, Token *b)
+{
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+static int resolveLocal(Compiler *compiler, Token *name)
+{
+    for (int i = compiler->localCount - 1; i >= 0; i--)
+    {
+        if (identifiersEqual(name, &compiler->locals[i].name))
+            return i;
+    }
+
+    return -1;
+}
+
+static int findInput(Compiler *compiler, Token *name)
+{
+    for (int i = 0; i < compiler->inputCount; i++)
+    {
+        const char *input = compiler->inputs[i];
+        if ((int)strlen(input) != name->length || memcmp(input, name->start, name->length) != 0)
+            continue;
+
+        if (i > UINT8_MAX)
+        {
+            error(compiler, "Too many inputs in one expression.");
+            return 0;
+        }
+
+        return i;
+    }
+
+    return -1;
+}
+
+static int globalSlot(Compiler *compiler, Token *name)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.prev.type)->prefix;
+    int slot = resolveGlobal(name->start, name->length);
+    if (slot == -1)
+    {
+        error(compiler, "Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
+static void parsePrecedence(Compiler *compiler, Precedence precedence)
+{
+    advance(compiler);
+    ParseFn prefixRule = getRule(compiler->parser.prev.type)->prefix;
     if (prefixRule == NULL)
     {
-        error("Expect expression.");
+        error(compiler, "Expect expression.");
         return;
     }
 
-    prefixRule();
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    prefixRule(compiler, canAssign);
 
-    while (precedence <= getRule(parser.curr.type)->precedence)
+    while (precedence <= getRule(compiler->parser.curr.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.prev.type)->infix;
-        infixRule();
+        advance(compiler);
+        ParseFn infixRule = getRule(compiler->parser.prev.type)->infix;
+        infixRule(compiler, canAssign);
     }
+
+    if (canAssign && match(compiler, TOKEN_EQUAL))
+        error(compiler, "Invalid assignment target.");
 }
 
-static void endCompiler()
+static void endCompiler(Compiler *compiler)
 {
+    compiler->line = compiler->parser.prev.line;
+    emitReturn(compiler);
+
+    if (!compiler->parser.hadError)
+    {
+        optimizeChunk(getChunk(compiler));
+
+        /* Cheap enough to run on every compile, and it catches codegen bugs
+           before the VM trusts the result */
+        if (!verifyChunk(getChunk(compiler), compiler->inputCount))
+            error(compiler, "Generated code failed verification.");
+    }
+
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
-        disassembleChunk(getChunk(), "code");
+    if (!compiler->parser.hadError)
+        disassembleChunk(getChunk(compiler), "code");
 #endif
-    emitReturn();
 }
 
-static Chunk *getChunk()
+static Chunk *getChunk(Compiler *compiler)
+{
+    return compiler->chunk;
+}
+
+/* Statements */
+
+/* A script is a run of declarations and statements. It may end in an
+   expression without a semicolon, whose value is the result; the result
+   is nil otherwise. */
+static void script(Compiler *compiler)
+{
+    while (!match(compiler, TOKEN_EOF))
+    {
+        if (check(compiler, TOKEN_VAR) || check(compiler, TOKEN_LEFT_BRACE))
+        {
+            declaration(compiler);
+            continue;
+        }
+
+        expression(compiler);
+        if (!match(compiler, TOKEN_SEMICOLON))
+        {
+            consume(compiler, TOKEN_EOF, "Expect ';' after expression.");
+            lowerExpression(compiler);
+            return;
+        }
+
+        lowerExpression(compiler);
+        compiler->line = compiler->parser.prev.line;
+        emitOp(compiler, OP_POP);
+
+        if (compiler->parser.panicMode)
+            synchronize(compiler);
+    }
+
+    compiler->line = compiler->parser.prev.line;
+    emitOp(compiler, OP_NIL);
+}
+
+static void declaration(Compiler *compiler)
+{
+    if (match(compiler, TOKEN_VAR))
+        varDeclaration(compiler);
+    else
+        statement(compiler);
+
+    if (compiler->parser.panicMode)
+        synchronize(compiler);
+}
+
+static void varDeclaration(Compiler *compiler)
+{
+    consume(compiler, TOKEN_IDENTIFIER, "Expect variable name.");
+    Token name = compiler->parser.prev;
+    if (compiler->scopeDepth > 0)
+    {
+        localDeclaration(compiler, name);
+        return;
+    }
+
+    int slot = globalSlot(compiler, &name);
+
+    if (match(compiler, TOKEN_EQUAL))
+    {
+        expression(compiler);
+        lowerExpression(compiler);
+    }
+    else
+    {
+        compiler->line = name.line;
+        emitOp(compiler, OP_NIL);
+    }
+
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    compiler->line = name.line;
+    emitGlobal(compiler, OP_DEFINE_GLOBAL, slot);
+}
+
+/* The initializer's value stays where it was computed, on top of the
+   locals already declared, and that slot becomes the new local's. The name
+   only comes into scope afterwards, so `var a = a;` reads an outer a. */
+static void localDeclaration(Compiler *compiler, Token name)
+{
+    for (int i = compiler->localCount - 1; i >= 0; i--)
+    {
+        Local *local = &compiler->locals[i];
+        if (local->depth < compiler->scopeDepth)
+            break;
+
+        if (identifiersEqual(&name, &local->name))
+            error(compiler, "Already a variable with this name in this scope.");
+    }
+
+    StaticType type = TYPE_NIL;
+    if (match(compiler, TOKEN_EQUAL))
+    {
+        expression(compiler);
+        type = lowerExpression(compiler);
+    }
+    else
+    {
+        compiler->line = name.line;
+        emitOp(compiler, OP_NIL);
+    }
+
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    if (compiler->localCount == LOCALS_MAX)
+    {
+        errorAt(compiler, &name, "Too many local variables.");
+        return;
+    }
+
+    Local *local = &compiler->locals[compiler->localCount++];
+    local->name = name;
+    local->depth = compiler->scopeDepth;
+    local->type = type;
+    local->writer = -1;
+}
+
+static void statement(Compiler *compiler)
+{
+    if (match(compiler, TOKEN_LEFT_BRACE))
+    {
+        beginScope(compiler);
+        block(compiler);
+        endScope(compiler);
+    }
+    else
+    {
+        expressionStatement(compiler);
+    }
+}
+
+static void block(Compiler *compiler)
+{
+    while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF))
+        declaration(compiler);
+
+    consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void expressionStatement(Compiler *compiler)
+{
+    expression(compiler);
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    lowerExpression(compiler);
+    compiler->line = compiler->parser.prev.line;
+    emitOp(compiler, OP_POP);
+}
+
+static void beginScope(Compiler *compiler)
+{
+    compiler->scopeDepth++;
+}
+
+/* The scope's locals are the topmost stack slots, so one instruction drops
+   them all */
+static void endScope(Compiler *compiler)
+{
+    compiler->scopeDepth--;
+
+    int dropped = 0;
+    while (compiler->localCount > 0 &&
+           compiler->locals[compiler->localCount - 1].depth > compiler->scopeDepth)
+    {
+        compiler->localCount--;
+        dropped++;
+    }
+
+    compiler->line = compiler->parser.prev.line;
+    if (dropped == 1)
+        emitOp(compiler, OP_POP);
+    else if (dropped > 1)
+        emitOpWithOperand(compiler, OP_POPN, (uint8_t)dropped);
+}
+
+/* Skips to the next statement boundary after an error, so one mistake
+   is reported once rather than as a cascade */
+static void synchronize(Compiler *compiler)
+{
+    compiler->parser.panicMode = false;
+
+    while (!check(compiler, TOKEN_EOF))
+    {
+        if (compiler->parser.prev.type == TOKEN_SEMICOLON || check(compiler, TOKEN_VAR))
+            return;
+
+        advance(compiler);
+    }
+}
+
+/* Expressions */
+
+static void expression(Compiler *compiler)
+{
+    parsePrecedence(compiler, PREC_ASSIGNMENT);
+}
+
+static void number(Compiler *compiler, bool canAssign)
+{
+    (void)canAssign;
+    double value = strtod(compiler->parser.prev.start, NULL);
+    compiler->expr = irConstant(&compiler->ir, NUMBER_VAL(value), compiler->parser.prev);
+}
+
+static void string(Compiler *compiler, bool canAssign)
+{
+    (void)canAssign;
+    Value value = OBJ_VAL(copyString(compiler->parser.prev.start + 1, compiler->parser.prev.length - 2)); // + 1 to skip " and -2 to subtract both ""
+    compiler->expr = irConstant(&compiler->ir, value, compiler->parser.prev);
+}
+
+static void grouping(Compiler *compiler, bool canAssign)
+{
+    (void)canAssign;
+    expression(compiler);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+/* Lowering */
+
+/* Optimizes the expression just parsed as a whole and lowers it, leaving
+   its value on the stack, and returns the value's type. Every expression
+   gets a graph of its own, so nothing is shared or moved across
+   statements. */
+static StaticType lowerExpression(Compiler *compiler)
+{
+    IrGraph *ir = &compiler->ir;
+    StaticType type = TYPE_UNKNOWN;
+
+    if (!compiler->parser.hadError)
+    {
+        ir->root = compiler->expr;
+        if (optimizeIr(ir))
+        {
+            lowerIr(compiler);
+            type = ir->nodes[ir->root].type;
+
+            /* A local's writer is the last assignment made to it on every
+               path */
+            for (int i = 0; i < compiler->localCount; i++)
+            {
+                Local *local = &compiler->locals[i];
+                if (local->writer != -1)
+                    local->type = ir->nodes[local->writer].type;
+            }
+        }
+        else
+        {
+            errorAt(compiler, &ir->nodes[ir->errorNode].token, ir->errorMessage);
+        }
+    }
+
+    for (int i = 0; i < compiler->localCount; i++)
+        compiler->locals[i].writer = -1;
+
+    freeIrGraph(ir);
+    compiler->expr = -1;
+    return type;
+}
+
+/* Leaves are as cheap to emit again as to copy. A value only needed on
+   the right of an and/or is computed again at each use instead, since
+   computing it up front would defeat the short circuit. */
+static bool isShared(IrNode *node)
 {
-    return currChunk;
+    return node->uses > 1 && !node->conditional && node->op != IR_CONSTANT &&
+           node->op != IR_INPUT && node->op != IR_GLOBAL && node->op != IR_LOCAL;
 }
 
-/*  */
+/* Values used more than once are computed first, in evaluation order, and
+   stay on the stack; each use copies one up with OP_PICK, and OP_SLIDE
+   drops them from beneath the result at the end. Nothing is hoisted above
+   an assignment: should the hoisted value raise a runtime error, the
+   assignment would no longer have happened first. */
+static void lowerIr(Compiler *compiler)
+{
+    IrGraph *ir = &compiler->ir;
+
+    int barrier = ir->count;
+    for (int i = 0; i < ir->count; i++)
+    {
+        if (ir->nodes[i].uses > 0 && isAssignment(ir->nodes[i].op))
+        {
+            barrier = i;
+            break;
+        }
+    }
+
+    int shared = 0;
+    for (int i = 0; i < barrier && shared < UINT8_MAX; i++)
+    {
+        IrNode *node = &ir->nodes[i];
+        if (!isShared(node))
+            continue;
 
-static void expression()
+        emitNode(compiler, i);
+        node->slot = compiler->stackDepth - 1;
+        shared++;
+    }
+
+    emitNode(compiler, ir->root);
+    if (shared > 0)
+        emitOpWithOperand(compiler, OP_SLIDE, (uint8_t)shared);
+}
+
+static void emitNode(Compiler *compiler, int index)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    IrNode *node = &compiler->ir.nodes[index];
+    compiler->line = node->token.line;
+
+    /* A copy too deep for PICK's operand is simply computed again */
+    if (node->slot != -1 && compiler->stackDepth - 1 - node->slot <= UINT8_MAX)
+    {
+        emitOpWithOperand(compiler, OP_PICK, (uint8_t)(compiler->stackDepth - 1 - node->slot));
+        return;
+    }
+
+    switch (node->op)
+    {
+    case IR_CONSTANT:
+        emitConstant(compiler, node->value);
+        return;
+    case IR_INPUT:
+        emitOpWithOperand(compiler, OP_GET_INPUT, (uint8_t)node->index);
+        return;
+    case IR_GLOBAL:
+        emitGlobal(compiler, OP_GET_GLOBAL, node->index);
+        return;
+    case IR_LOCAL:
+        emitOpWithOperand(compiler, OP_GET_LOCAL, (uint8_t)node->index);
+        return;
+    case IR_AND:
+    case IR_OR:
+        emitShortCircuit(compiler, node);
+        return;
+    default:
+        break;
+    }
+
+    emitNode(compiler, node->operands[0]);
+    if (node->operands[1] != -1)
+        emitNode(compiler, node->operands[1]);
+
+    compiler->line = node->token.line;
+    if (node->op == IR_SET_GLOBAL)
+        emitGlobal(compiler, OP_SET_GLOBAL, node->index);
+    else if (node->op == IR_SET_LOCAL)
+        emitOpWithOperand(compiler, OP_SET_LOCAL, (uint8_t)node->index);
+    else
+        emitOp(compiler, nodeOpcode(&compiler->ir, node));
 }
 
-static void number()
+/* The left value stays on the stack as the result when it decides the
+   outcome, and is popped to make way for the right one otherwise:
+
+     and:  left, JUMP_IF_FALSE end, POP, right, end:
+     or:   left, JUMP_IF_FALSE else, JUMP end, else: POP, right, end: */
+static void emitShortCircuit(Compiler *compiler, IrNode *node)
 {
-    double value = strtod(parser.prev.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    int right = node->operands[1];
+    Token token = node->token;
+
+    emitNode(compiler, node->operands[0]);
+    compiler->line = token.line;
+
+    int end = emitJump(compiler, OP_JUMP_IF_FALSE_LONG);
+    if (node->op == IR_OR)
+    {
+        int skip = end;
+        end = emitJump(compiler, OP_JUMP_LONG);
+        patchJump(compiler, skip);
+    }
+
+    emitOp(compiler, OP_POP);
+    emitNode(compiler, right);
+    patchJump(compiler, end);
+}
+
+/* Picks the unchecked form wherever every operand is proven a number */
+static uint8_t nodeOpcode(IrGraph *ir, IrNode *node)
+{
+    bool numeric = ir->nodes[node->operands[0]].type == TYPE_NUMBER &&
+                   (node->operands[1] == -1 || ir->nodes[node->operands[1]].type == TYPE_NUMBER);
+
+    switch (node->op)
+    {
+    case IR_NEGATE: return numeric ? OP_NEGATE_N : OP_NEGATE;
+    case IR_NOT: return OP_NOT;
+    case IR_ADD: return numeric ? OP_ADD_NN : OP_ADD;
+    case IR_SUBTRACT: return numeric ? OP_SUBTRACT_NN : OP_SUBTRACT;
+    case IR_MULTIPLY: return numeric ? OP_MULTIPLY_NN : OP_MULTIPLY;
+    case IR_DIVIDE: return numeric ? OP_DIVIDE_NN : OP_DIVIDE;
+    case IR_EQUAL: return OP_EQUAL;
+    case IR_NOT_EQUAL: return OP_NOT_EQUAL;
+    case IR_GREATER: return numeric ? OP_GREATER_NN : OP_GREATER;
+    case IR_GREATER_EQUAL: return numeric ? OP_GREATER_EQUAL_NN : OP_GREATER_EQUAL;
+    case IR_LESS: return numeric ? OP_LESS_NN : OP_LESS;
+    case IR_LESS_EQUAL: return numeric ? OP_LESS_EQUAL_NN : OP_LESS_EQUAL;
+    default: return OP_RETURN;
+    }
 }
 
-static void string() 
+/* Constant Deduplication */
+
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+static void initConstantIndex(ConstantIndex *index)
+{
+    index->count = 0;
+    index->capacity = 0;
+    index->entries = NULL;
+}
+
+static void freeConstantIndex(ConstantIndex *index)
 {
-    emitConstant(OBJ_VAL(copyString(parser.prev.start + 1, parser.prev.length - 2))); // + 1 to skip " and -2 to subtract both ""
+    FREE_ARRAY(ConstantEntry, index->entries, index->capacity);
+    initConstantIndex(index);
 }
 
-static void grouping()
+static ConstantEntry *findEntry(ConstantEntry *entries, int capacity, Value value)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t slot = hashValue(value) & mask;
+
+    for (;;)
+    {
+        ConstantEntry *entry = &entries[slot];
+        if (entry->index == -1 || valuesIdentical(entry->key, value))
+            return entry;
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+static int findConstant(ConstantIndex *index, Value value)
+{
+    if (index->count == 0)
+        return -1;
+
+    return findEntry(index->entries, index->capacity, value)->index;
+}
+
+static void growConstantIndex(ConstantIndex *index)
+{
+    int capacity = GROW_CAPACITY(index->capacity);
+    ConstantEntry *entries = ALLOCATE(ConstantEntry, capacity);
+    for (int i = 0; i < capacity; i++)
+        entries[i].index = -1;
+
+    for (int i = 0; i < index->capacity; i++)
+    {
+        ConstantEntry *entry = &index->entries[i];
+        if (entry->index != -1)
+            *findEntry(entries, capacity, entry->key) = *entry;
+    }
+
+    FREE_ARRAY(ConstantEntry, index->entries, index->capacity);
+    index->entries = entries;
+    index->capacity = capacity;
+}
+
+static void recordConstant(ConstantIndex *index, Value value, int slot)
+{
+    if (index->count + 1 > index->capacity * CONSTANT_INDEX_MAX_LOAD)
+        growConstantIndex(index);
+
+    ConstantEntry *entry = findEntry(index->entries, index->capacity, value);
+    if (entry->index == -1)
+        index->count++;
+
+    entry->key = value;
+    entry->index = slot;
 }
 
 static ParseRule *getRule(TokenType tokenType)
@@ -306,17 +1075,17 @@ static ParseRule *getRule(TokenType tokenType)
     return &rules[tokenType];
 }
 
-static void errorCurrent(const char *errorMessage)
+static void errorCurrent(Compiler *compiler, const char *errorMessage)
 {
-    errorAt(&parser.curr, errorMessage);
+    errorAt(compiler, &compiler->parser.curr, errorMessage);
 }
 
-static void errorAt(Token *token, const char *errorMessage)
+static void errorAt(Compiler *compiler, Token *token, const char *errorMessage)
 {
-    if (parser.panicMode)
+    if (compiler->parser.panicMode)
         return;
 
-    parser.panicMode = true;
+    compiler->parser.panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -329,10 +1098,10 @@ static void errorAt(Token *token, const char *errorMessage)
     }
 
     fprintf(stderr, ": %s\n", errorMessage);
-    parser.hadError = true;
+    compiler->parser.hadError = true;
 }
 
-static void error(const char *errorMessage)
+static void error(Compiler *compiler, const char *errorMessage)
 {
-    errorAt(&parser.prev, errorMessage);
+    errorAt(compiler, &compiler->parser.prev, errorMessage);
 }
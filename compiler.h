@@ -2,7 +2,9 @@
 #define COMPILER_H
 
 #include "vm.h"
+#include "scanner.h"
 #include "token.h"
+#include "ir.h"
 
 typedef struct
 {
@@ -12,6 +14,36 @@ typedef struct
     bool hadError;
 } Parser;
 
+/* Open-addressing index from constant values to their slot in the pool */
+typedef struct
+{
+    Value key;
+    int index;
+} ConstantEntry;
+
+typedef struct
+{
+    int count;
+    int capacity;
+    ConstantEntry *entries;
+} ConstantIndex;
+
+/* Locals are addressed by a one-byte slot */
+#define LOCALS_MAX UINT8_MAX
+
+typedef struct
+{
+    Token name;
+    int depth;
+
+    /* What the local held after the last statement; exact, since code is
+       straight-line */
+    StaticType type;
+
+    /* Last assignment to it in the expression being built, or -1 */
+    int writer;
+} Local;
+
 typedef enum
 {
     PREC_NONE,
@@ -27,7 +59,42 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)();
+/* All state of one compilation. Nothing is shared between compilers, so
+   separate threads may each compile with their own. */
+typedef struct
+{
+    Parser parser;
+    Scanner scanner;
+    Chunk *chunk;
+
+    /* The parser builds the expression as a graph, which is optimized as a
+       whole and only then lowered to bytecode */
+    IrGraph ir;
+
+    /* Node of the expression the last parse function built */
+    int expr;
+
+    /* Constants already in the pool, so repeated literals share one slot */
+    ConstantIndex constantIndex;
+
+    /* Depth of the value stack at the current point of the emitted code */
+    int stackDepth;
+
+    /* Line the instructions being emitted are attributed to */
+    int line;
+
+    /* Locals in scope, innermost last; a local's index is its stack slot */
+    Local locals[LOCALS_MAX];
+    int localCount;
+    int scopeDepth;
+
+    /* Names an identifier may refer to before it is taken for a global;
+       each compiles to OP_GET_INPUT with its position in this list */
+    const char *const *inputs;
+    int inputCount;
+} Compiler;
+
+typedef void (*ParseFn)(Compiler *compiler, bool canAssign);
 
 typedef struct 
 {
@@ -37,5 +104,8 @@ typedef struct
 } ParseRule;
 
 bool compile(const char *src, Chunk *chunk);
+bool compileWith(Compiler *compiler, const char *src, Chunk *chunk);
+bool compileInputs(Compiler *compiler, const char *src, Chunk *chunk,
+                   const char *const *inputs, int inputCount);
 
 #endif
\ No newline at end of file
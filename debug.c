@@ -2,9 +2,15 @@
 
 #include "chunk.h"
 #include "debug.h"
+#include "globals.h"
 
 static void simpleInstruction(const char *name, int *offset);
 static void constantInstruction(const char *name, Chunk *chunk, int *offset);
+static void constantLongInstruction(const char *name, Chunk *chunk, int *offset);
+static void byteInstruction(const char *name, Chunk *chunk, int *offset);
+static void globalInstruction(const char *name, Chunk *chunk, int *offset);
+static void jumpInstruction(const char *name, Chunk *chunk, int *offset);
+static void printOperand(RegChunk *chunk, uint8_t operand);
 
 void disassembleChunk(Chunk *chunk, const char *name)
 {
@@ -77,10 +83,131 @@ void disassembleInstruction(Chunk *chunk, int *offset)
     case OP_LESS:
         simpleInstruction("OP_LESS", offset);
         return;
+    case OP_NOT_EQUAL:
+        simpleInstruction("OP_NOT_EQUAL", offset);
+        return;
+    case OP_GREATER_EQUAL:
+        simpleInstruction("OP_GREATER_EQUAL", offset);
+        return;
+    case OP_LESS_EQUAL:
+        simpleInstruction("OP_LESS_EQUAL", offset);
+        return;
+    case OP_ADD_CONSTANT:
+        constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+        return;
+
+    /* Quickened */
+    case OP_ADD_CONSTANT_NUM:
+        constantInstruction("OP_ADD_CONSTANT_NUM", chunk, offset);
+        return;
+    case OP_NEGATE_NUM:
+        simpleInstruction("OP_NEGATE_NUM", offset);
+        return;
+    case OP_ADD_NUM:
+        simpleInstruction("OP_ADD_NUM", offset);
+        return;
+    case OP_SUBTRACT_NUM:
+        simpleInstruction("OP_SUBTRACT_NUM", offset);
+        return;
+    case OP_MULTIPLY_NUM:
+        simpleInstruction("OP_MULTIPLY_NUM", offset);
+        return;
+    case OP_DIVIDE_NUM:
+        simpleInstruction("OP_DIVIDE_NUM", offset);
+        return;
+    case OP_GREATER_NUM:
+        simpleInstruction("OP_GREATER_NUM", offset);
+        return;
+    case OP_LESS_NUM:
+        simpleInstruction("OP_LESS_NUM", offset);
+        return;
+    case OP_GREATER_EQUAL_NUM:
+        simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+        return;
+    case OP_LESS_EQUAL_NUM:
+        simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+        return;
+
+    /* Statically typed */
+    case OP_NEGATE_N:
+        simpleInstruction("OP_NEGATE_N", offset);
+        return;
+    case OP_ADD_CONSTANT_NN:
+        constantInstruction("OP_ADD_CONSTANT_NN", chunk, offset);
+        return;
+    case OP_ADD_NN:
+        simpleInstruction("OP_ADD_NN", offset);
+        return;
+    case OP_SUBTRACT_NN:
+        simpleInstruction("OP_SUBTRACT_NN", offset);
+        return;
+    case OP_MULTIPLY_NN:
+        simpleInstruction("OP_MULTIPLY_NN", offset);
+        return;
+    case OP_DIVIDE_NN:
+        simpleInstruction("OP_DIVIDE_NN", offset);
+        return;
+    case OP_GREATER_NN:
+        simpleInstruction("OP_GREATER_NN", offset);
+        return;
+    case OP_LESS_NN:
+        simpleInstruction("OP_LESS_NN", offset);
+        return;
+    case OP_GREATER_EQUAL_NN:
+        simpleInstruction("OP_GREATER_EQUAL_NN", offset);
+        return;
+    case OP_LESS_EQUAL_NN:
+        simpleInstruction("OP_LESS_EQUAL_NN", offset);
+        return;
 
     case OP_CONSTANT:
         constantInstruction("CONSTANT", chunk, offset);
         return;
+    case OP_CONSTANT_LONG:
+        constantLongInstruction("CONSTANT_LONG", chunk, offset);
+        return;
+    case OP_GET_INPUT:
+        byteInstruction("OP_GET_INPUT", chunk, offset);
+        return;
+    case OP_PICK:
+        byteInstruction("OP_PICK", chunk, offset);
+        return;
+    case OP_SLIDE:
+        byteInstruction("OP_SLIDE", chunk, offset);
+        return;
+    case OP_POP:
+        simpleInstruction("OP_POP", offset);
+        return;
+    case OP_POPN:
+        byteInstruction("OP_POPN", chunk, offset);
+        return;
+    case OP_GET_LOCAL:
+        byteInstruction("OP_GET_LOCAL", chunk, offset);
+        return;
+    case OP_SET_LOCAL:
+        byteInstruction("OP_SET_LOCAL", chunk, offset);
+        return;
+    case OP_GET_GLOBAL:
+        globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        return;
+    case OP_SET_GLOBAL:
+        globalInstruction("OP_SET_GLOBAL", chunk, offset);
+        return;
+    case OP_DEFINE_GLOBAL:
+        globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return;
+    case OP_JUMP:
+        jumpInstruction("OP_JUMP", chunk, offset);
+        return;
+    case OP_JUMP_LONG:
+        jumpInstruction("OP_JUMP_LONG", chunk, offset);
+        return;
+    case OP_JUMP_IF_FALSE:
+        jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
+        return;
+    case OP_JUMP_IF_FALSE_LONG:
+        jumpInstruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
+        return;
 
     default:
         printf("Unknown instruction %d\n", instruction);
@@ -102,4 +229,141 @@ static void constantInstruction(const char *name, Chunk *chunk, int *offset)
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     (*offset) += 2;
+}
+
+static void constantLongInstruction(const char *name, Chunk *chunk, int *offset)
+{
+    uint8_t *operand = &chunk->code[*offset + 1];
+    int constant = operand[0] | (operand[1] << 8) | (operand[2] << 16);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    (*offset) += 4;
+}
+
+static void byteInstruction(const char *name, Chunk *chunk, int *offset)
+{
+    uint8_t slot = chunk->code[*offset + 1];
+    printf("%-16s %4d\n", name, slot);
+    (*offset) += 2;
+}
+
+static void globalInstruction(const char *name, Chunk *chunk, int *offset)
+{
+    uint8_t *operand = &chunk->code[*offset + 1];
+    int slot = operand[0] | (operand[1] << 8);
+    printf("%-16s %4d '%s'\n", name, slot, globalName(slot));
+    (*offset) += 3;
+}
+
+static void jumpInstruction(const char *name, Chunk *chunk, int *offset)
+{
+    printf("%-16s %4d -> %d\n", name, *offset, jumpTarget(chunk->code, *offset));
+    (*offset) += opcodeLength(chunk->code[*offset]);
+}
+
+void disassembleRegChunk(RegChunk *chunk, const char *name)
+{
+    printf("\n=== Registers: %s (%d) ===\n\n", name, chunk->registerCount);
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        disassembleRegInstruction(chunk, &offset);
+    }
+}
+
+static const char *regOpcodeName(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case ROP_LOADK: return "LOADK";
+    case ROP_MOVE: return "MOVE";
+    case ROP_NEGATE: return "NEGATE";
+    case ROP_NOT: return "NOT";
+    case ROP_ADD: return "ADD";
+    case ROP_SUBTRACT: return "SUBTRACT";
+    case ROP_MULTIPLY: return "MULTIPLY";
+    case ROP_DIVIDE: return "DIVIDE";
+    case ROP_EQUAL: return "EQUAL";
+    case ROP_NOT_EQUAL: return "NOT_EQUAL";
+    case ROP_GREATER: return "GREATER";
+    case ROP_GREATER_EQUAL: return "GREATER_EQUAL";
+    case ROP_LESS: return "LESS";
+    case ROP_LESS_EQUAL: return "LESS_EQUAL";
+    case ROP_JUMP: return "JUMP";
+    case ROP_JUMP_IF_FALSE: return "JUMP_IF_FALSE";
+    case ROP_RETURN: return "RETURN";
+    default: return NULL;
+    }
+}
+
+void disassembleRegInstruction(RegChunk *chunk, int *offset)
+{
+    printf("%04d ", *offset);
+
+    int line = getLine(&chunk->lines, offset);
+    printf("%4d ", line);
+
+    uint8_t *code = &chunk->code[*offset];
+    const char *name = regOpcodeName(code[0]);
+    if (name == NULL)
+    {
+        printf("Unknown instruction %d\n", code[0]);
+        (*offset)++;
+        return;
+    }
+
+    printf("%-16s", name);
+    switch (code[0])
+    {
+    case ROP_LOADK:
+    {
+        int constant = code[2] | (code[3] << 8) | (code[4] << 16);
+        printf(" r%d, k%d '", code[1], constant);
+        printValue(chunk->constants.values[constant]);
+        printf("'");
+        break;
+    }
+    case ROP_RETURN:
+        printf(" ");
+        printOperand(chunk, code[1]);
+        break;
+    case ROP_JUMP:
+        printf(" -> %d", *offset + 4 + (code[1] | (code[2] << 8) | (code[3] << 16)));
+        break;
+    case ROP_JUMP_IF_FALSE:
+        printf(" ");
+        printOperand(chunk, code[1]);
+        printf(" -> %d", *offset + 5 + (code[2] | (code[3] << 8) | (code[4] << 16)));
+        break;
+    case ROP_MOVE:
+    case ROP_NEGATE:
+    case ROP_NOT:
+        printf(" r%d, ", code[1]);
+        printOperand(chunk, code[2]);
+        break;
+    default:
+        printf(" r%d, ", code[1]);
+        printOperand(chunk, code[2]);
+        printf(", ");
+        printOperand(chunk, code[3]);
+        break;
+    }
+    printf("\n");
+
+    (*offset) += regOpcodeLength(code[0]);
+}
+
+static void printOperand(RegChunk *chunk, uint8_t operand)
+{
+    if (!(operand & RK_CONSTANT))
+    {
+        printf("r%d", operand);
+        return;
+    }
+
+    printf("k%d '", operand & RK_MAX);
+    printValue(chunk->constants.values[operand & RK_MAX]);
+    printf("'");
 }
\ No newline at end of file
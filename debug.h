@@ -1,7 +1,12 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include "chunk.h"
+#include "register.h"
+
 void disassembleChunk(Chunk *chunk, const char *name);
 void disassembleInstruction(Chunk *chunk, int *offset);
+void disassembleRegChunk(RegChunk *chunk, const char *name);
+void disassembleRegInstruction(RegChunk *chunk, int *offset);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "globals.h"
+#include "memory.h"
+
+#define GLOBAL_TABLE_MAX_LOAD 0.75
+
+/* Names live as long as the process, since code compiled against them
+   may be run at any time; nothing here is ever freed. */
+typedef struct
+{
+    char **names;
+    int count;
+    int capacity;
+
+    /* Open-addressing table of slots, keyed by the names they belong to */
+    int *table;
+    int tableCapacity;
+} GlobalNames;
+
+static GlobalNames globals = {NULL, 0, 0, NULL, 0};
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int *findEntry(int *table, int capacity, const char *name, int length);
+static void growTable(void);
+static uint32_t hashName(const char *name, int length);
+
+int resolveGlobal(const char *name, int length)
+{
+    pthread_mutex_lock(&lock);
+
+    int slot = -1;
+    if (globals.count + 1 > globals.tableCapacity * GLOBAL_TABLE_MAX_LOAD)
+        growTable();
+
+    int *entry = findEntry(globals.table, globals.tableCapacity, name, length);
+    if (*entry != -1)
+    {
+        slot = *entry;
+    }
+    else if (globals.count < GLOBAL_MAX)
+    {
+        if (globals.count + 1 > globals.capacity)
+        {
+            int oldCapacity = globals.capacity;
+            globals.capacity = GROW_CAPACITY(oldCapacity);
+            globals.names = GROW_ARRAY(char *, globals.names, oldCapacity, globals.capacity);
+        }
+
+        char *copy = ALLOCATE(char, length + 1);
+        memcpy(copy, name, length);
+        copy[length] = '\0';
+
+        slot = globals.count++;
+        globals.names[slot] = copy;
+        *entry = slot;
+    }
+
+    pthread_mutex_unlock(&lock);
+    return slot;
+}
+
+int findGlobal(const char *name, int length)
+{
+    pthread_mutex_lock(&lock);
+    int slot = globals.count == 0 ? -1 : *findEntry(globals.table, globals.tableCapacity, name, length);
+    pthread_mutex_unlock(&lock);
+    return slot;
+}
+
+const char *globalName(int slot)
+{
+    pthread_mutex_lock(&lock);
+    const char *name = slot >= 0 && slot < globals.count ? globals.names[slot] : "?";
+    pthread_mutex_unlock(&lock);
+    return name;
+}
+
+static int *findEntry(int *table, int capacity, const char *name, int length)
+{
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = hashName(name, length) & mask;
+
+    for (;;)
+    {
+        int *entry = &table[index];
+        if (*entry == -1)
+            return entry;
+
+        const char *candidate = globals.names[*entry];
+        if ((int)strlen(candidate) == length && memcmp(candidate, name, length) == 0)
+            return entry;
+
+        index = (index + 1) & mask;
+    }
+}
+
+static void growTable(void)
+{
+    int capacity = GROW_CAPACITY(globals.tableCapacity);
+    int *table = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++)
+        table[i] = -1;
+
+    for (int slot = 0; slot < globals.count; slot++)
+    {
+        const char *name = globals.names[slot];
+        *findEntry(table, capacity, name, (int)strlen(name)) = slot;
+    }
+
+    FREE_ARRAY(int, globals.table, globals.tableCapacity);
+    globals.table = table;
+    globals.tableCapacity = capacity;
+}
+
+/* FNV-1a */
+static uint32_t hashName(const char *name, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
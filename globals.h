@@ -0,0 +1,23 @@
+#ifndef GLOBALS_H
+#define GLOBALS_H
+
+#include "common.h"
+
+/* The global instructions take a 16-bit slot */
+#define GLOBAL_MAX (UINT16_MAX + 1)
+
+/* Names of global variables are shared by the whole process. A name keeps
+   the slot it is first given, so compiled code addresses a global by its
+   index alone and may run on any VM; each VM holds its own values. These
+   functions may be called from several threads at once. */
+
+/* The name's slot, handing out the next free one if it has none yet;
+   -1 once all GLOBAL_MAX slots are taken */
+int resolveGlobal(const char *name, int length);
+
+/* The name's slot, or -1 if it was never resolved */
+int findGlobal(const char *name, int length);
+
+const char *globalName(int slot);
+
+#endif
@@ -0,0 +1,318 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "globals.h"
+#include "memory.h"
+#include "object.h"
+
+#define IMAGE_BYTE_ORDER 0x01020304
+
+/* The quiet NaN arithmetic produces, without its sign bit */
+#define IMAGE_NAN_BITS 0x7ff8000000000000
+
+typedef enum
+{
+    CONSTANT_NUMBER,
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_STRING
+} ConstantTag;
+
+static bool writeConstant(FILE *file, Value value);
+static bool writeGlobal(FILE *file, uint16_t slot);
+static int collectGlobals(Chunk *chunk, uint16_t *slots);
+static bool readConstants(Chunk *chunk, const uint8_t **cursor, const uint8_t *end, uint32_t count);
+static bool relinkGlobals(Chunk *chunk, const uint8_t *cursor, const uint8_t *end, uint32_t count);
+static bool isGlobalInstruction(uint8_t opcode);
+static bool canonicalNumber(double number);
+
+bool writeImage(Chunk *chunk, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+
+    uint16_t *globals = ALLOCATE(uint16_t, chunk->globalLimit);
+    int globalCount = collectGlobals(chunk, globals);
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.lineCount = (uint32_t)chunk->lines.count;
+    header.codeCount = (uint32_t)chunk->count;
+    header.constantCount = (uint32_t)chunk->constants.count;
+    header.globalCount = (uint32_t)globalCount;
+    header.maxStack = (uint32_t)chunk->maxStack;
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(chunk->lines.lines, sizeof(int), chunk->lines.count, file) == (size_t)chunk->lines.count &&
+                   fwrite(chunk->code, 1, chunk->count, file) == (size_t)chunk->count;
+
+    for (int i = 0; written && i < chunk->constants.count; i++)
+        written = writeConstant(file, chunk->constants.values[i]);
+    for (int i = 0; written && i < globalCount; i++)
+        written = writeGlobal(file, globals[i]);
+
+    FREE_ARRAY(uint16_t, globals, chunk->globalLimit);
+    return fclose(file) == 0 && written;
+}
+
+bool loadImage(Chunk *chunk, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ImageHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    /* Private and writable: quickening rewrites opcodes in place, and those
+       writes must never reach the file */
+    size_t size = (size_t)info.st_size;
+    uint8_t *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    ImageHeader *header = (ImageHeader *)mapping;
+    size_t linesEnd = sizeof(ImageHeader) + (size_t)header->lineCount * sizeof(int);
+    size_t codeEnd = linesEnd + header->codeCount;
+
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IMAGE_VERSION || header->byteOrder != IMAGE_BYTE_ORDER ||
+        header->lineCount % 2 != 0 || codeEnd > size)
+    {
+        munmap(mapping, size);
+        return false;
+    }
+
+    initChunk(chunk);
+    chunk->mapping = mapping;
+    chunk->mappingSize = size;
+    chunk->lines.lines = (int *)(mapping + sizeof(ImageHeader));
+    chunk->lines.count = (int)header->lineCount;
+    chunk->code = mapping + linesEnd;
+    chunk->count = (int)header->codeCount;
+    chunk->maxStack = (int)header->maxStack;
+
+    const uint8_t *cursor = mapping + codeEnd;
+    if (!readConstants(chunk, &cursor, mapping + size, header->constantCount) ||
+        !relinkGlobals(chunk, cursor, mapping + size, header->globalCount))
+    {
+        freeChunk(chunk);
+        return false;
+    }
+
+    return true;
+}
+
+static bool writeConstant(FILE *file, Value value)
+{
+    uint8_t tag;
+    if (IS_NUMBER(value))
+        tag = CONSTANT_NUMBER;
+    else if (IS_NIL(value))
+        tag = CONSTANT_NIL;
+    else if (IS_BOOL(value))
+        tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+    else if (IS_STRING(value))
+        tag = CONSTANT_STRING;
+    else
+        return false;
+
+    if (fwrite(&tag, 1, 1, file) != 1)
+        return false;
+
+    if (tag == CONSTANT_NUMBER)
+    {
+        double number = AS_NUMBER(value);
+        return fwrite(&number, sizeof(double), 1, file) == 1;
+    }
+
+    if (tag == CONSTANT_STRING)
+    {
+        ObjString *string = AS_STRING(value);
+        uint32_t length = (uint32_t)string->length;
+        return fwrite(&length, sizeof(length), 1, file) == 1 &&
+               fwrite(string->chars, 1, length, file) == length;
+    }
+
+    return true;
+}
+
+static bool writeGlobal(FILE *file, uint16_t slot)
+{
+    const char *name = globalName(slot);
+    uint32_t length = (uint32_t)strlen(name);
+    return fwrite(&slot, sizeof(slot), 1, file) == 1 &&
+           fwrite(&length, sizeof(length), 1, file) == 1 &&
+           fwrite(name, 1, length, file) == length;
+}
+
+/* The distinct global slots the code refers to, in order of first use */
+static int collectGlobals(Chunk *chunk, uint16_t *slots)
+{
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        uint8_t *ip = &chunk->code[offset];
+        if (!isGlobalInstruction(ip[0]))
+            continue;
+
+        uint16_t slot = (uint16_t)(ip[1] | (ip[2] << 8));
+        int i = 0;
+        while (i < count && slots[i] != slot)
+            i++;
+        if (i == count)
+            slots[count++] = slot;
+    }
+
+    return count;
+}
+
+/* Payloads are unaligned, so they are copied out rather than dereferenced */
+static bool readConstants(Chunk *chunk, const uint8_t **start, const uint8_t *end, uint32_t count)
+{
+    const uint8_t *cursor = *start;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (cursor >= end)
+            return false;
+
+        switch (*cursor++)
+        {
+        case CONSTANT_NUMBER:
+        {
+            double number;
+            if (end - cursor < (ptrdiff_t)sizeof(double))
+                return false;
+            memcpy(&number, cursor, sizeof(double));
+            cursor += sizeof(double);
+            if (!canonicalNumber(number))
+                return false;
+            writeValueArray(&chunk->constants, NUMBER_VAL(number));
+            break;
+        }
+        case CONSTANT_NIL:
+            writeValueArray(&chunk->constants, NIL_VAL);
+            break;
+        case CONSTANT_FALSE:
+            writeValueArray(&chunk->constants, BOOL_VAL(false));
+            break;
+        case CONSTANT_TRUE:
+            writeValueArray(&chunk->constants, BOOL_VAL(true));
+            break;
+        case CONSTANT_STRING:
+        {
+            uint32_t length;
+            if (end - cursor < (ptrdiff_t)sizeof(length))
+                return false;
+            memcpy(&length, cursor, sizeof(length));
+            cursor += sizeof(length);
+            if ((size_t)(end - cursor) < length)
+                return false;
+            /* The chunk takes over the new reference */
+            writeValueArray(&chunk->constants, OBJ_VAL(copyString((const char *)cursor, (int)length)));
+            cursor += length;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+
+    *start = cursor;
+    return true;
+}
+
+/* Resolves each name the image lists, then rewrites every global operand
+   from the slot it was written with to the slot the name has now */
+static bool relinkGlobals(Chunk *chunk, const uint8_t *cursor, const uint8_t *end, uint32_t count)
+{
+    if (count > GLOBAL_MAX)
+        return false;
+
+    uint16_t *written = ALLOCATE(uint16_t, count);
+    int *resolved = ALLOCATE(int, count);
+    bool linked = true;
+
+    for (uint32_t i = 0; linked && i < count; i++)
+    {
+        uint32_t length;
+        if ((size_t)(end - cursor) < sizeof(uint16_t) + sizeof(length))
+        {
+            linked = false;
+            break;
+        }
+
+        memcpy(&written[i], cursor, sizeof(uint16_t));
+        memcpy(&length, cursor + sizeof(uint16_t), sizeof(length));
+        cursor += sizeof(uint16_t) + sizeof(length);
+        if ((size_t)(end - cursor) < length)
+        {
+            linked = false;
+            break;
+        }
+
+        resolved[i] = resolveGlobal((const char *)cursor, (int)length);
+        linked = resolved[i] != -1;
+        cursor += length;
+    }
+
+    for (int offset = 0; linked && offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        uint8_t *ip = &chunk->code[offset];
+        if (!isGlobalInstruction(ip[0]))
+            continue;
+
+        /* Anything malformed is left for the verifier to reject */
+        if (offset + opcodeLength(ip[0]) > chunk->count)
+            break;
+
+        uint16_t slot = (uint16_t)(ip[1] | (ip[2] << 8));
+        uint32_t i = 0;
+        while (i < count && written[i] != slot)
+            i++;
+        if (i == count)
+        {
+            linked = false;
+            break;
+        }
+
+        ip[1] = (uint8_t)(resolved[i] & 0xff);
+        ip[2] = (uint8_t)((resolved[i] >> 8) & 0xff);
+        if (resolved[i] >= chunk->globalLimit)
+            chunk->globalLimit = resolved[i] + 1;
+    }
+
+    FREE_ARRAY(uint16_t, written, count);
+    FREE_ARRAY(int, resolved, count);
+    return linked;
+}
+
+static bool isGlobalInstruction(uint8_t opcode)
+{
+    return opcode == OP_GET_GLOBAL || opcode == OP_SET_GLOBAL || opcode == OP_DEFINE_GLOBAL;
+}
+
+/* Under NaN boxing any other NaN could box a value that is not a number,
+   such as a pointer the file chose. Both layouts refuse the same images. */
+static bool canonicalNumber(double number)
+{
+    if (number == number)
+        return true;
+
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return (bits & ~((uint64_t)1 << 63)) == IMAGE_NAN_BITS;
+}
@@ -0,0 +1,45 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "common.h"
+#include "chunk.h"
+
+#define IMAGE_MAGIC "FAVC"
+
+/* Bumped whenever the layout below or the OpCode numbering changes */
+#define IMAGE_VERSION 6
+
+/* A compiled chunk as stored on disk:
+
+     header
+     int32 line runs          (lineCount of them, as in LineArray)
+     code bytes               (codeCount of them)
+     constants                (a tag byte each, then the payload: 8 bytes
+                               of double for numbers, where a NaN must be
+                               the default quiet NaN, a uint32 length and
+                               the characters for strings)
+     globals                  (globalCount of them: the uint16 slot the
+                               code uses, a uint32 length and the name)
+
+   Global slots are handed out per process, so the loader resolves each
+   name again and rewrites the code's operands to the slots it gets.
+   Everything is in host byte order; byteOrder rejects foreign images. */
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t lineCount;
+    uint32_t codeCount;
+    uint32_t constantCount;
+    uint32_t globalCount;
+    uint32_t maxStack;
+} ImageHeader;
+
+bool writeImage(Chunk *chunk, const char *path);
+
+/* Maps an image privately and points the chunk's code and lines into the
+   mapping; only the constant pool is rebuilt. */
+bool loadImage(Chunk *chunk, const char *path);
+
+#endif
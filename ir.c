@@ -0,0 +1,634 @@
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+
+#define NUMBERING_MAX_LOAD 0.75
+
+/* Open-addressing set of the canonical node for each distinct computation */
+typedef struct
+{
+    int *slots;
+    int count;
+    int capacity;
+} ValueNumbering;
+
+static int addNode(IrGraph *graph, IrOp op, int a, int b, Token token);
+static int operandCount(IrOp op);
+
+/* Passes, applied node by node in evaluation order */
+static bool inferType(IrGraph *graph, IrNode *node);
+static bool foldConstants(IrGraph *graph, IrNode *node);
+static void simplify(IrGraph *graph, IrNode *node);
+static void numberValue(ValueNumbering *numbering, IrGraph *graph, int index);
+static void countUses(IrGraph *graph);
+
+static bool foldUnary(IrOp op, Value operand, Value *result);
+static bool foldBinary(IrOp op, Value a, Value b, Value *result);
+
+static void initValueNumbering(ValueNumbering *numbering);
+static void freeValueNumbering(ValueNumbering *numbering);
+
+void initIrGraph(IrGraph *graph)
+{
+    graph->nodes = NULL;
+    graph->count = 0;
+    graph->capacity = 0;
+    graph->root = -1;
+    graph->assignments = 0;
+    graph->errorNode = -1;
+    graph->errorMessage = NULL;
+}
+
+void freeIrGraph(IrGraph *graph)
+{
+    for (int i = 0; i < graph->count; i++)
+    {
+        if (graph->nodes[i].op == IR_CONSTANT)
+            releaseValue(graph->nodes[i].value);
+    }
+    FREE_ARRAY(IrNode, graph->nodes, graph->capacity);
+    initIrGraph(graph);
+}
+
+int irConstant(IrGraph *graph, Value value, Token token)
+{
+    int index = addNode(graph, IR_CONSTANT, -1, -1, token);
+    graph->nodes[index].value = value;
+    return index;
+}
+
+int irInput(IrGraph *graph, int input, Token token)
+{
+    int index = addNode(graph, IR_INPUT, -1, -1, token);
+    graph->nodes[index].index = input;
+    return index;
+}
+
+int irGlobal(IrGraph *graph, int slot, Token token)
+{
+    int index = addNode(graph, IR_GLOBAL, -1, -1, token);
+    graph->nodes[index].index = slot;
+    graph->nodes[index].version = graph->assignments;
+    return index;
+}
+
+int irSetGlobal(IrGraph *graph, int slot, int operand, Token token)
+{
+    int index = addNode(graph, IR_SET_GLOBAL, operand, -1, token);
+    graph->nodes[index].index = slot;
+    graph->assignments++;
+    return index;
+}
+
+int irLocal(IrGraph *graph, int slot, int writer, StaticType type, Token token)
+{
+    int index = addNode(graph, IR_LOCAL, -1, -1, token);
+    IrNode *node = &graph->nodes[index];
+    node->index = slot;
+    node->version = graph->assignments;
+    node->writer = writer;
+    node->type = type;
+    return index;
+}
+
+int irSetLocal(IrGraph *graph, int slot, int operand, Token token)
+{
+    int index = addNode(graph, IR_SET_LOCAL, operand, -1, token);
+    graph->nodes[index].index = slot;
+    graph->assignments++;
+    return index;
+}
+
+int irUnary(IrGraph *graph, IrOp op, int operand, Token token)
+{
+    return addNode(graph, op, operand, -1, token);
+}
+
+int irBinary(IrGraph *graph, IrOp op, int a, int b, Token token)
+{
+    return addNode(graph, op, a, b, token);
+}
+
+bool optimizeIr(IrGraph *graph)
+{
+    ValueNumbering numbering;
+    initValueNumbering(&numbering);
+
+    bool typed = true;
+    for (int i = 0; i < graph->count; i++)
+    {
+        IrNode *node = &graph->nodes[i];
+        for (int j = 0; j < operandCount(node->op); j++)
+            node->operands[j] = graph->nodes[node->operands[j]].replacement;
+
+        if (!inferType(graph, node))
+        {
+            graph->errorNode = i;
+            typed = false;
+            break;
+        }
+
+        if (!foldConstants(graph, node))
+            simplify(graph, node);
+
+        if (node->replacement == i && !isAssignment(node->op))
+            numberValue(&numbering, graph, i);
+    }
+
+    freeValueNumbering(&numbering);
+    if (!typed)
+        return false;
+
+    graph->root = graph->nodes[graph->root].replacement;
+    countUses(graph);
+    return true;
+}
+
+static int addNode(IrGraph *graph, IrOp op, int a, int b, Token token)
+{
+    if (graph->count + 1 > graph->capacity)
+    {
+        int oldCapacity = graph->capacity;
+        graph->capacity = GROW_CAPACITY(oldCapacity);
+        graph->nodes = GROW_ARRAY(IrNode, graph->nodes, oldCapacity, graph->capacity);
+    }
+
+    IrNode *node = &graph->nodes[graph->count];
+    node->op = op;
+    node->operands[0] = a;
+    node->operands[1] = b;
+    node->value = NIL_VAL;
+    node->index = -1;
+    node->version = 0;
+    node->writer = -1;
+    node->type = TYPE_UNKNOWN;
+    node->token = token;
+    node->replacement = graph->count;
+    node->uses = 0;
+    node->conditional = false;
+    node->slot = -1;
+
+    return graph->count++;
+}
+
+static int operandCount(IrOp op)
+{
+    switch (op)
+    {
+    case IR_CONSTANT:
+    case IR_INPUT:
+    case IR_GLOBAL:
+    case IR_LOCAL:
+        return 0;
+    case IR_NEGATE:
+    case IR_NOT:
+    case IR_SET_GLOBAL:
+    case IR_SET_LOCAL:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+static StaticType operandType(IrGraph *graph, IrNode *node, int operand)
+{
+    return graph->nodes[node->operands[operand]].type;
+}
+
+static bool mayBeNumber(StaticType type)
+{
+    return type == TYPE_UNKNOWN || type == TYPE_NUMBER;
+}
+
+static bool mayBeString(StaticType type)
+{
+    return type == TYPE_UNKNOWN || type == TYPE_STRING;
+}
+
+/* Checked arithmetic yields a number whatever its operands were typed,
+   since any other operand stops the VM, and + a string once either side is
+   known to be one. Otherwise only leaves can be unknown, and an assignment
+   has its operand's type. A local starts out with the type the compiler
+   tracked for it. */
+static bool inferType(IrGraph *graph, IrNode *node)
+{
+    switch (node->op)
+    {
+    case IR_CONSTANT:
+        node->type = staticTypeOf(node->value);
+        return true;
+    case IR_INPUT:
+    case IR_GLOBAL:
+        node->type = TYPE_UNKNOWN;
+        return true;
+    case IR_LOCAL:
+        /* Code is straight-line, so a local holds whatever was stored last */
+        if (node->writer != -1)
+            node->type = graph->nodes[node->writer].type;
+        return true;
+    case IR_SET_GLOBAL:
+    case IR_SET_LOCAL:
+        node->type = operandType(graph, node, 0);
+        return true;
+
+    case IR_NOT:
+    case IR_EQUAL:
+    case IR_NOT_EQUAL:
+        node->type = TYPE_BOOL;
+        return true;
+
+    /* Either side may be the result, unless the left one's type already
+       says which */
+    case IR_AND:
+    case IR_OR:
+    {
+        StaticType left = operandType(graph, node, 0);
+        StaticType right = operandType(graph, node, 1);
+        if (left == TYPE_NUMBER || left == TYPE_STRING)
+            node->type = node->op == IR_AND ? right : left;
+        else if (left == TYPE_NIL)
+            node->type = node->op == IR_AND ? left : right;
+        else
+            node->type = left == right ? left : TYPE_UNKNOWN;
+        return true;
+    }
+
+    case IR_NEGATE:
+        node->type = TYPE_NUMBER;
+        if (mayBeNumber(operandType(graph, node, 0)))
+            return true;
+        graph->errorMessage = "Operand must be a number.";
+        return false;
+
+    case IR_ADD:
+    {
+        StaticType left = operandType(graph, node, 0);
+        StaticType right = operandType(graph, node, 1);
+        node->type = additionType(left, right);
+        if ((mayBeNumber(left) && mayBeNumber(right)) || (mayBeString(left) && mayBeString(right)))
+            return true;
+        graph->errorMessage = "Operands must be two numbers or two strings.";
+        return false;
+    }
+    case IR_SUBTRACT:
+    case IR_MULTIPLY:
+    case IR_DIVIDE:
+        node->type = TYPE_NUMBER;
+        break;
+    default:
+        node->type = TYPE_BOOL;
+        break;
+    }
+
+    if (mayBeNumber(operandType(graph, node, 0)) && mayBeNumber(operandType(graph, node, 1)))
+        return true;
+    graph->errorMessage = "Operands must be numbers.";
+    return false;
+}
+
+/* Constant Folding */
+
+static bool foldConstants(IrGraph *graph, IrNode *node)
+{
+    int count = operandCount(node->op);
+    if (count == 0)
+        return false;
+
+    Value operands[2];
+    for (int i = 0; i < count; i++)
+    {
+        IrNode *operand = &graph->nodes[node->operands[i]];
+        if (operand->op != IR_CONSTANT)
+            return false;
+        operands[i] = operand->value;
+    }
+
+    Value folded;
+    bool foldable = count == 1 ? foldUnary(node->op, operands[0], &folded)
+                               : foldBinary(node->op, operands[0], operands[1], &folded);
+    if (!foldable)
+        return false;
+
+    node->op = IR_CONSTANT;
+    node->value = folded;
+    node->type = staticTypeOf(folded);
+    return true;
+}
+
+static bool isFalseyConstant(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/* Both folders mirror run() exactly and refuse anything that would raise a
+   runtime error there, so the error still happens at the same place. */
+static bool foldUnary(IrOp op, Value operand, Value *result)
+{
+    switch (op)
+    {
+    case IR_NEGATE:
+        if (!IS_NUMBER(operand))
+            return false;
+        *result = NUMBER_VAL(-AS_NUMBER(operand));
+        return true;
+    case IR_NOT:
+        *result = BOOL_VAL(isFalseyConstant(operand));
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool foldBinary(IrOp op, Value a, Value b, Value *result)
+{
+    switch (op)
+    {
+    case IR_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case IR_NOT_EQUAL:
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    /* Constants stay flat strings, however long */
+    case IR_ADD:
+        if (IS_STRING(a) && IS_STRING(b))
+        {
+            if (concatenate(NULL, &a, b) != NULL)
+                return false;
+            *result = a;
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op)
+    {
+    case IR_ADD:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case IR_SUBTRACT:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case IR_MULTIPLY:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case IR_DIVIDE:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    case IR_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case IR_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+    case IR_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case IR_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Algebraic Simplification */
+
+static bool isNumberConstant(IrGraph *graph, int index, double number)
+{
+    IrNode *node = &graph->nodes[index];
+    return node->op == IR_CONSTANT && valuesIdentical(node->value, NUMBER_VAL(number));
+}
+
+/* The negation of each comparison, as the VM defines them: a >= b is
+   !(a < b) and a <= b is !(a > b), so every pair is exact even for NaN. */
+static IrOp negatedComparison(IrOp op)
+{
+    switch (op)
+    {
+    case IR_EQUAL: return IR_NOT_EQUAL;
+    case IR_NOT_EQUAL: return IR_EQUAL;
+    case IR_GREATER: return IR_LESS_EQUAL;
+    case IR_GREATER_EQUAL: return IR_LESS;
+    case IR_LESS: return IR_GREATER_EQUAL;
+    case IR_LESS_EQUAL: return IR_GREATER;
+    default: return op;
+    }
+}
+
+/* Only identities that hold bit for bit, and only where the operand's type
+   is proven, so no type check the original would have made is dropped.
+   x + 0 is not among them: -0 + 0 is +0. */
+static void simplify(IrGraph *graph, IrNode *node)
+{
+    int a = node->operands[0];
+    int b = node->operands[1];
+
+    switch (node->op)
+    {
+    case IR_NEGATE:
+    {
+        IrNode *inner = &graph->nodes[a];
+        if (inner->op == IR_NEGATE && operandType(graph, inner, 0) == TYPE_NUMBER)
+            node->replacement = inner->operands[0];
+        break;
+    }
+
+    case IR_NOT:
+    {
+        IrNode *inner = &graph->nodes[a];
+        if (inner->op == IR_NOT && operandType(graph, inner, 0) == TYPE_BOOL)
+        {
+            node->replacement = inner->operands[0];
+        }
+        else if (negatedComparison(inner->op) != inner->op)
+        {
+            node->op = negatedComparison(inner->op);
+            node->operands[0] = inner->operands[0];
+            node->operands[1] = inner->operands[1];
+        }
+        break;
+    }
+
+    case IR_MULTIPLY:
+        if (isNumberConstant(graph, b, 1) && operandType(graph, node, 0) == TYPE_NUMBER)
+            node->replacement = a;
+        else if (isNumberConstant(graph, a, 1) && operandType(graph, node, 1) == TYPE_NUMBER)
+            node->replacement = b;
+        break;
+    case IR_DIVIDE:
+        if (isNumberConstant(graph, b, 1) && operandType(graph, node, 0) == TYPE_NUMBER)
+            node->replacement = a;
+        break;
+    case IR_SUBTRACT:
+        if (isNumberConstant(graph, b, 0) && operandType(graph, node, 0) == TYPE_NUMBER)
+            node->replacement = a;
+        break;
+    case IR_ADD:
+        if (isNumberConstant(graph, b, -0.0) && operandType(graph, node, 0) == TYPE_NUMBER)
+            node->replacement = a;
+        else if (isNumberConstant(graph, a, -0.0) && operandType(graph, node, 1) == TYPE_NUMBER)
+            node->replacement = b;
+        break;
+
+    /* A constant condition decides the branch now; the right side is
+       simply never reached if it is not picked */
+    case IR_AND:
+    case IR_OR:
+    {
+        IrNode *left = &graph->nodes[a];
+        if (left->op != IR_CONSTANT)
+            break;
+
+        bool falsey = isFalseyConstant(left->value);
+        node->replacement = falsey == (node->op == IR_AND) ? a : b;
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/* Common Subexpressions */
+
+static void initValueNumbering(ValueNumbering *numbering)
+{
+    numbering->slots = NULL;
+    numbering->count = 0;
+    numbering->capacity = 0;
+}
+
+static void freeValueNumbering(ValueNumbering *numbering)
+{
+    FREE_ARRAY(int, numbering->slots, numbering->capacity);
+    initValueNumbering(numbering);
+}
+
+static uint32_t hashNode(IrNode *node)
+{
+    uint32_t hash = (uint32_t)node->op * 16777619u;
+    switch (node->op)
+    {
+    case IR_CONSTANT:
+        return hash ^ hashValue(node->value);
+    case IR_INPUT:
+        return hash ^ (uint32_t)node->index;
+    case IR_GLOBAL:
+    case IR_LOCAL:
+        return (hash ^ (uint32_t)node->index) * 16777619u ^ (uint32_t)node->version;
+    default:
+        hash = (hash ^ (uint32_t)node->operands[0]) * 16777619u;
+        return (hash ^ (uint32_t)node->operands[1]) * 16777619u;
+    }
+}
+
+/* Operands are canonical by the time a node is numbered, so comparing
+   their indices compares the values they compute. */
+static bool sameComputation(IrNode *a, IrNode *b)
+{
+    if (a->op != b->op)
+        return false;
+
+    switch (a->op)
+    {
+    case IR_CONSTANT:
+        return valuesIdentical(a->value, b->value);
+    case IR_INPUT:
+        return a->index == b->index;
+    case IR_GLOBAL:
+    case IR_LOCAL:
+        return a->index == b->index && a->version == b->version;
+    default:
+        return a->operands[0] == b->operands[0] && a->operands[1] == b->operands[1];
+    }
+}
+
+static int *findSlot(int *slots, int capacity, IrGraph *graph, IrNode *node)
+{
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t slot = hashNode(node) & mask;
+
+    for (;;)
+    {
+        if (slots[slot] == -1 || sameComputation(&graph->nodes[slots[slot]], node))
+            return &slots[slot];
+        slot = (slot + 1) & mask;
+    }
+}
+
+static void growValueNumbering(ValueNumbering *numbering, IrGraph *graph)
+{
+    int capacity = GROW_CAPACITY(numbering->capacity);
+    int *slots = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++)
+        slots[i] = -1;
+
+    for (int i = 0; i < numbering->capacity; i++)
+    {
+        int index = numbering->slots[i];
+        if (index != -1)
+            *findSlot(slots, capacity, graph, &graph->nodes[index]) = index;
+    }
+
+    FREE_ARRAY(int, numbering->slots, numbering->capacity);
+    numbering->slots = slots;
+    numbering->capacity = capacity;
+}
+
+static void numberValue(ValueNumbering *numbering, IrGraph *graph, int index)
+{
+    if (numbering->count + 1 > numbering->capacity * NUMBERING_MAX_LOAD)
+        growValueNumbering(numbering, graph);
+
+    int *slot = findSlot(numbering->slots, numbering->capacity, graph, &graph->nodes[index]);
+    if (*slot != -1)
+    {
+        graph->nodes[index].replacement = *slot;
+        return;
+    }
+
+    *slot = index;
+    numbering->count++;
+}
+
+/* Dead Code */
+
+/* Users always come after the nodes they use, so one backwards sweep sees
+   every use of a node before the node itself. Whatever the root does not
+   reach keeps zero uses and is never lowered. A node stays conditional
+   only while every use found so far is. */
+static void countUses(IrGraph *graph)
+{
+    for (int i = 0; i < graph->count; i++)
+    {
+        graph->nodes[i].uses = 0;
+        graph->nodes[i].conditional = true;
+    }
+    graph->nodes[graph->root].uses = 1;
+    graph->nodes[graph->root].conditional = false;
+
+    for (int i = graph->count - 1; i >= 0; i--)
+    {
+        IrNode *node = &graph->nodes[i];
+        if (node->uses == 0)
+            continue;
+
+        for (int j = 0; j < operandCount(node->op); j++)
+        {
+            IrNode *operand = &graph->nodes[node->operands[j]];
+            operand->uses++;
+
+            bool shortCircuited = j == 1 && (node->op == IR_AND || node->op == IR_OR);
+            if (!node->conditional && !shortCircuited)
+                operand->conditional = false;
+        }
+    }
+}
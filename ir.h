@@ -0,0 +1,127 @@
+#ifndef IR_H
+#define IR_H
+
+#include "common.h"
+#include "value.h"
+#include "token.h"
+
+typedef enum
+{
+    IR_CONSTANT,
+    IR_INPUT,
+    IR_GLOBAL,
+    IR_LOCAL,
+
+    /* Unary: operands[0] */
+    IR_NEGATE,
+    IR_NOT,
+    /* Store operands[0] into a variable and yield it */
+    IR_SET_GLOBAL,
+    IR_SET_LOCAL,
+
+    /* Binary: operands[0] op operands[1] */
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_EQUAL,
+    IR_NOT_EQUAL,
+    IR_GREATER,
+    IR_GREATER_EQUAL,
+    IR_LESS,
+    IR_LESS_EQUAL,
+
+    /* Short-circuiting: operands[1] is only evaluated when operands[0] is
+       truthy (AND) or falsey (OR); the result is the last operand
+       evaluated */
+    IR_AND,
+    IR_OR
+} IrOp;
+
+/* One SSA value. Operands always have lower indices than the nodes using
+   them, so the node array is itself a valid evaluation order. */
+typedef struct
+{
+    IrOp op;
+    int operands[2];
+
+    /* IR_CONSTANT: the value, holding a reference if it is an interned
+       string; IR_INPUT: the input's position; the variable nodes: the
+       variable's slot */
+    Value value;
+    int index;
+
+    /* IR_GLOBAL, IR_LOCAL: assignments built before it, so that two reads
+       of a variable are only merged when none comes between them */
+    int version;
+
+    /* IR_LOCAL: the assignment earlier in the graph whose value it reads,
+       or -1 to read what the local held before the expression */
+    int writer;
+
+    StaticType type;
+
+    /* The operator or literal the node was built from, for error messages
+       and the line its instructions are attributed to */
+    Token token;
+
+    /* Index of the node this one is equivalent to; itself if none */
+    int replacement;
+
+    /* Live nodes using this one (plus one for the root); zero means dead */
+    int uses;
+
+    /* Set when every live use lies on the right of an and/or, so the node
+       is not evaluated on every path */
+    bool conditional;
+
+    /* Stack slot a shared value is kept in while lowering, or -1 */
+    int slot;
+} IrNode;
+
+/* The expression graph of one compilation */
+typedef struct
+{
+    IrNode *nodes;
+    int count;
+    int capacity;
+
+    int root;
+
+    /* Assignments built so far */
+    int assignments;
+
+    /* Set when optimizeIr() finds a definite type error */
+    int errorNode;
+    const char *errorMessage;
+} IrGraph;
+
+void initIrGraph(IrGraph *graph);
+void freeIrGraph(IrGraph *graph);
+
+/* Takes over the caller's reference to an interned string */
+int irConstant(IrGraph *graph, Value value, Token token);
+int irInput(IrGraph *graph, int input, Token token);
+int irGlobal(IrGraph *graph, int slot, Token token);
+int irSetGlobal(IrGraph *graph, int slot, int operand, Token token);
+/* type is what the local is known to hold when writer is -1 */
+int irLocal(IrGraph *graph, int slot, int writer, StaticType type, Token token);
+int irSetLocal(IrGraph *graph, int slot, int operand, Token token);
+
+static inline bool isAssignment(IrOp op)
+{
+    return op == IR_SET_GLOBAL || op == IR_SET_LOCAL;
+}
+int irUnary(IrGraph *graph, IrOp op, int operand, Token token);
+int irBinary(IrGraph *graph, IrOp op, int a, int b, Token token);
+
+/* Infers static types, then folds constants, simplifies algebra and merges
+   common subexpressions in one sweep over the nodes, and finally counts the
+   uses of whatever the new root still reaches. Assignments are never
+   merged, and neither are reads of a variable with one in between. An
+   and/or whose left side is a constant is replaced by the side it picks.
+   Returns false on a definite type error, leaving errorNode and
+   errorMessage set. */
+bool optimizeIr(IrGraph *graph);
+
+#endif
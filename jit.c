@@ -0,0 +1,616 @@
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+void initJitCode(JitCode *jit)
+{
+    jit->function = NULL;
+    jit->size = 0;
+    jit->returnsBool = false;
+}
+
+#ifdef JIT_X86_64
+
+/* Stack slot n lives in xmm n for the whole function; xmm15 is scratch.
+   Every xmm register is caller-saved in the System V ABI, so the code needs
+   no prologue, and the result is returned in xmm0. */
+#define JIT_SLOTS 15
+#define SCRATCH 15
+
+#define ONE_BITS 0x3ff0000000000000ull
+#define SIGN_BITS 0x8000000000000000ull
+
+/* cmpsd predicates */
+#define CMP_EQ 0
+#define CMP_LT 1
+#define CMP_NEQ 4
+#define CMP_NLT 5
+
+/* SSE2 opcodes following the 0x0f escape */
+#define SSE_MOVSD 0x10
+#define SSE_ANDPD 0x54
+#define SSE_XORPD 0x57
+#define SSE_ADDSD 0x58
+#define SSE_MULSD 0x59
+#define SSE_SUBSD 0x5c
+#define SSE_DIVSD 0x5e
+#define SSE_CMPSD 0xc2
+#define SSE_UCOMISD 0x2e
+
+#ifdef NAN_BOXING
+#define INPUT_OFFSET 0
+#else
+#define INPUT_OFFSET offsetof(Value, as.number)
+#endif
+
+typedef enum
+{
+    KIND_NUMBER,
+    KIND_BOOL
+} SlotKind;
+
+/* A jump whose target has not been translated yet: where its rel32 goes,
+   and the stack it arrives with */
+typedef struct
+{
+    int site;
+    int target;
+    SlotKind kinds[JIT_SLOTS];
+    int depth;
+} PendingJump;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    /* Static type of each live slot, mirroring the interpreter's stack */
+    SlotKind kinds[JIT_SLOTS];
+    int depth;
+    bool failed;
+
+    PendingJump *jumps;
+    int jumpCount;
+    int jumpCapacity;
+    /* False after an unconditional jump, until a jump lands */
+    bool reachable;
+    /* Kind of the slot every OP_RETURN so far hands back */
+    SlotKind returned;
+    bool returns;
+} Assembler;
+
+static void translate(Assembler *as, Chunk *chunk, int offset);
+static void jump(Assembler *as, Chunk *chunk, int offset);
+static void landJumps(Assembler *as, int offset);
+static bool install(JitCode *jit, Assembler *as);
+
+static void emit(Assembler *as, uint8_t byte);
+static void emitSse(Assembler *as, uint8_t prefix, uint8_t opcode, int reg, int rm);
+static void emitLoadBits(Assembler *as, int xmm, uint64_t bits);
+static void emitLoadInput(Assembler *as, int xmm, int input);
+
+static int push(Assembler *as, SlotKind kind);
+static void pushConstant(Assembler *as, Value value);
+static void arithmetic(Assembler *as, uint8_t opcode);
+static void comparison(Assembler *as, int predicate, bool swapped);
+static void equality(Assembler *as, bool negate);
+static void booleanMask(Assembler *as, int xmm);
+
+bool jitCompile(Chunk *chunk, JitCode *jit)
+{
+    Assembler as;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.depth = 0;
+    as.failed = false;
+    as.jumps = NULL;
+    as.jumpCount = 0;
+    as.jumpCapacity = 0;
+    as.reachable = true;
+    as.returns = false;
+
+    int offset = 0;
+    while (offset < chunk->count && !as.failed)
+    {
+        landJumps(&as, offset);
+        translate(&as, chunk, offset);
+        offset += opcodeLength(chunk->code[offset]);
+    }
+    FREE_ARRAY(PendingJump, as.jumps, as.jumpCapacity);
+
+    bool installed = !as.failed && install(jit, &as);
+
+#ifdef DEBUG_PRINT_CODE
+    if (installed)
+    {
+        printf("\n=== JIT: %d bytes ===\n\n", as.count);
+        for (int i = 0; i < as.count; i++)
+            printf("%02x%s", as.code[i], (i + 1) % 16 == 0 || i + 1 == as.count ? "\n" : " ");
+    }
+#endif
+
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    return installed;
+}
+
+void freeJitCode(JitCode *jit)
+{
+    if (jit->function != NULL)
+        munmap((void *)jit->function, jit->size);
+    initJitCode(jit);
+}
+
+static void translate(Assembler *as, Chunk *chunk, int offset)
+{
+    uint8_t *ip = &chunk->code[offset];
+    int top = as->depth - 1;
+
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+        pushConstant(as, chunk->constants.values[ip[1]]);
+        break;
+    case OP_CONSTANT_LONG:
+        pushConstant(as, chunk->constants.values[ip[1] | (ip[2] << 8) | (ip[3] << 16)]);
+        break;
+    case OP_TRUE:
+        pushConstant(as, BOOL_VAL(true));
+        break;
+    case OP_FALSE:
+        pushConstant(as, BOOL_VAL(false));
+        break;
+
+    case OP_GET_INPUT:
+    {
+        int slot = push(as, KIND_NUMBER);
+        if (slot != -1)
+            emitLoadInput(as, slot, ip[1]);
+        break;
+    }
+
+    case OP_PICK:
+    {
+        int source = top - ip[1];
+        int slot = push(as, as->kinds[source]);
+        if (slot != -1)
+            emitSse(as, 0xf2, SSE_MOVSD, slot, source);
+        break;
+    }
+    case OP_SLIDE:
+        if (ip[1] > 0)
+        {
+            emitSse(as, 0xf2, SSE_MOVSD, top - ip[1], top);
+            as->kinds[top - ip[1]] = as->kinds[top];
+            as->depth -= ip[1];
+        }
+        break;
+    case OP_POP:
+        as->depth--;
+        break;
+    case OP_POPN:
+        as->depth -= ip[1];
+        break;
+
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+        jump(as, chunk, offset);
+        break;
+
+    case OP_GET_LOCAL:
+    {
+        int source = ip[1];
+        int slot = push(as, as->kinds[source]);
+        if (slot != -1)
+            emitSse(as, 0xf2, SSE_MOVSD, slot, source);
+        break;
+    }
+    case OP_SET_LOCAL:
+        emitSse(as, 0xf2, SSE_MOVSD, ip[1], top);
+        as->kinds[ip[1]] = as->kinds[top];
+        break;
+
+    case OP_NOT:
+        if (as->kinds[top] == KIND_NUMBER)
+        {
+            /* Numbers are never falsey */
+            emitLoadBits(as, top, 0);
+            as->kinds[top] = KIND_BOOL;
+            break;
+        }
+
+        emitLoadBits(as, SCRATCH, ONE_BITS);
+        emitSse(as, 0xf2, SSE_SUBSD, SCRATCH, top);
+        emitSse(as, 0xf2, SSE_MOVSD, top, SCRATCH);
+        break;
+
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    case OP_NEGATE_N:
+        if (as->kinds[top] != KIND_NUMBER)
+        {
+            as->failed = true;
+            break;
+        }
+
+        emitLoadBits(as, SCRATCH, SIGN_BITS);
+        emitSse(as, 0x66, SSE_XORPD, top, SCRATCH);
+        break;
+
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+    case OP_ADD_CONSTANT_NN:
+    {
+        Value constant = chunk->constants.values[ip[1]];
+        if (as->kinds[top] != KIND_NUMBER || !IS_NUMBER(constant))
+        {
+            as->failed = true;
+            break;
+        }
+
+        double addend = AS_NUMBER(constant);
+        uint64_t bits;
+        memcpy(&bits, &addend, sizeof(double));
+        emitLoadBits(as, SCRATCH, bits);
+        emitSse(as, 0xf2, SSE_ADDSD, top, SCRATCH);
+        break;
+    }
+
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_NN:
+        arithmetic(as, SSE_ADDSD);
+        break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_SUBTRACT_NN:
+        arithmetic(as, SSE_SUBSD);
+        break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_MULTIPLY_NN:
+        arithmetic(as, SSE_MULSD);
+        break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+    case OP_DIVIDE_NN:
+        arithmetic(as, SSE_DIVSD);
+        break;
+
+    /* Each predicate is the one run() evaluates, so unordered operands
+       (NaN) give the same answer: a > b is b < a, and a >= b is !(a < b). */
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_GREATER_NN:
+        comparison(as, CMP_LT, true);
+        break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_LESS_NN:
+        comparison(as, CMP_LT, false);
+        break;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_GREATER_EQUAL_NN:
+        comparison(as, CMP_NLT, false);
+        break;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NUM:
+    case OP_LESS_EQUAL_NN:
+        comparison(as, CMP_NLT, true);
+        break;
+
+    case OP_EQUAL:
+        equality(as, false);
+        break;
+    case OP_NOT_EQUAL:
+        equality(as, true);
+        break;
+
+    /* jitCall() boxes the result by one kind for the whole chunk */
+    case OP_RETURN:
+        if (as->returns && as->returned != as->kinds[top])
+        {
+            as->failed = true;
+            break;
+        }
+        as->returned = as->kinds[top];
+        as->returns = true;
+
+        if (top != 0)
+            emitSse(as, 0xf2, SSE_MOVSD, 0, top);
+        emit(as, 0xc3);
+        as->depth--;
+        break;
+
+    default:
+        as->failed = true;
+        break;
+    }
+}
+
+/* jmp rel32, or for a boolean condition ucomisd against 0.0 and je rel32.
+   A number is never falsey, so a conditional jump on one is dropped. The
+   rel32 is patched once the target is translated. */
+static void jump(Assembler *as, Chunk *chunk, int offset)
+{
+    uint8_t opcode = chunk->code[offset];
+    int top = as->depth - 1;
+
+    if (opcode == OP_JUMP || opcode == OP_JUMP_LONG)
+    {
+        emit(as, 0xe9);
+        as->reachable = false;
+    }
+    else if (as->kinds[top] == KIND_NUMBER)
+    {
+        return;
+    }
+    else
+    {
+        emitLoadBits(as, SCRATCH, 0);
+        emitSse(as, 0x66, SSE_UCOMISD, top, SCRATCH);
+        emit(as, 0x0f);
+        emit(as, 0x84);
+    }
+
+    if (as->jumpCount + 1 > as->jumpCapacity)
+    {
+        int oldCapacity = as->jumpCapacity;
+        as->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        as->jumps = GROW_ARRAY(PendingJump, as->jumps, oldCapacity, as->jumpCapacity);
+    }
+
+    PendingJump *pending = &as->jumps[as->jumpCount++];
+    pending->site = as->count;
+    pending->target = jumpTarget(chunk->code, offset);
+    pending->depth = as->depth;
+    memcpy(pending->kinds, as->kinds, sizeof(as->kinds));
+
+    for (int i = 0; i < 4; i++)
+        emit(as, 0);
+}
+
+/* Slots hold raw doubles, so every path into an instruction must agree on
+   what kind each one is; the chunk is left to the interpreter otherwise */
+static void landJumps(Assembler *as, int offset)
+{
+    for (int i = 0; i < as->jumpCount; i++)
+    {
+        PendingJump *pending = &as->jumps[i];
+        if (pending->target != offset)
+            continue;
+
+        if (!as->reachable)
+        {
+            as->depth = pending->depth;
+            memcpy(as->kinds, pending->kinds, sizeof(as->kinds));
+            as->reachable = true;
+        }
+        else if (pending->depth != as->depth ||
+                 memcmp(pending->kinds, as->kinds, sizeof(SlotKind) * as->depth) != 0)
+        {
+            as->failed = true;
+            return;
+        }
+
+        int32_t displacement = as->count - (pending->site + 4);
+        for (int byte = 0; byte < 4; byte++)
+            as->code[pending->site + byte] = (uint8_t)((uint32_t)displacement >> (byte * 8));
+
+        as->jumps[i--] = as->jumps[--as->jumpCount];
+    }
+}
+
+/* Copies the finished code into its own mapping. The pages are writable
+   while the code is copied in and executable afterwards, never both. */
+static bool install(JitCode *jit, Assembler *as)
+{
+    void *memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, as->count);
+        return false;
+    }
+
+    jit->function = (JitFunction)memory;
+    jit->size = as->count;
+    jit->returnsBool = as->returned == KIND_BOOL;
+    return true;
+}
+
+static void emit(Assembler *as, uint8_t byte)
+{
+    if (as->count + 1 > as->capacity)
+    {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+
+    as->code[as->count++] = byte;
+}
+
+/* prefix [REX] 0f opcode modrm, for a register-to-register operation */
+static void emitSse(Assembler *as, uint8_t prefix, uint8_t opcode, int reg, int rm)
+{
+    emit(as, prefix);
+    if (reg >= 8 || rm >= 8)
+        emit(as, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+    emit(as, 0x0f);
+    emit(as, opcode);
+    emit(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emitLoadBits(Assembler *as, int xmm, uint64_t bits)
+{
+    if (bits == 0)
+    {
+        emitSse(as, 0x66, SSE_XORPD, xmm, xmm);
+        return;
+    }
+
+    /* mov rax, imm64 */
+    emit(as, 0x48);
+    emit(as, 0xb8);
+    for (int i = 0; i < 8; i++)
+        emit(as, (uint8_t)(bits >> (i * 8)));
+
+    /* movq xmm, rax */
+    emit(as, 0x66);
+    emit(as, 0x48 | ((xmm >> 3) << 2));
+    emit(as, 0x0f);
+    emit(as, 0x6e);
+    emit(as, 0xc0 | ((xmm & 7) << 3));
+}
+
+/* movsd xmm, [rdi + disp32]; rdi holds the inputs array */
+static void emitLoadInput(Assembler *as, int xmm, int input)
+{
+    uint32_t displacement = (uint32_t)(input * sizeof(Value) + INPUT_OFFSET);
+
+    emit(as, 0xf2);
+    if (xmm >= 8)
+        emit(as, 0x44);
+    emit(as, 0x0f);
+    emit(as, SSE_MOVSD);
+    emit(as, 0x80 | ((xmm & 7) << 3) | 7);
+    for (int i = 0; i < 4; i++)
+        emit(as, (uint8_t)(displacement >> (i * 8)));
+}
+
+static int push(Assembler *as, SlotKind kind)
+{
+    if (as->depth == JIT_SLOTS)
+    {
+        as->failed = true;
+        return -1;
+    }
+
+    as->kinds[as->depth] = kind;
+    return as->depth++;
+}
+
+static void pushConstant(Assembler *as, Value value)
+{
+    uint64_t bits;
+    SlotKind kind;
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        memcpy(&bits, &number, sizeof(double));
+        kind = KIND_NUMBER;
+    }
+    else if (IS_BOOL(value))
+    {
+        bits = AS_BOOL(value) ? ONE_BITS : 0;
+        kind = KIND_BOOL;
+    }
+    else
+    {
+        as->failed = true;
+        return;
+    }
+
+    int slot = push(as, kind);
+    if (slot != -1)
+        emitLoadBits(as, slot, bits);
+}
+
+static void arithmetic(Assembler *as, uint8_t opcode)
+{
+    int b = as->depth - 1;
+    int a = as->depth - 2;
+    if (as->kinds[a] != KIND_NUMBER || as->kinds[b] != KIND_NUMBER)
+    {
+        as->failed = true;
+        return;
+    }
+
+    emitSse(as, 0xf2, opcode, a, b);
+    as->depth--;
+}
+
+/* Leaves 1.0 or 0.0 in a's slot. A swapped comparison tests b against a,
+   which needs the scratch register since cmpsd overwrites its first operand. */
+static void comparison(Assembler *as, int predicate, bool swapped)
+{
+    int b = as->depth - 1;
+    int a = as->depth - 2;
+    if (as->kinds[a] != KIND_NUMBER || as->kinds[b] != KIND_NUMBER)
+    {
+        as->failed = true;
+        return;
+    }
+
+    if (swapped)
+    {
+        emitSse(as, 0xf2, SSE_MOVSD, SCRATCH, b);
+        emitSse(as, 0xf2, SSE_CMPSD, SCRATCH, a);
+        emit(as, (uint8_t)predicate);
+        emitSse(as, 0xf2, SSE_MOVSD, a, SCRATCH);
+    }
+    else
+    {
+        emitSse(as, 0xf2, SSE_CMPSD, a, b);
+        emit(as, (uint8_t)predicate);
+    }
+
+    booleanMask(as, a);
+    as->kinds[a] = KIND_BOOL;
+    as->depth--;
+}
+
+/* Values of different types are never equal; booleans compare as 1.0/0.0 */
+static void equality(Assembler *as, bool negate)
+{
+    int b = as->depth - 1;
+    int a = as->depth - 2;
+
+    if (as->kinds[a] != as->kinds[b])
+        emitLoadBits(as, a, negate ? ONE_BITS : 0);
+    else
+    {
+        emitSse(as, 0xf2, SSE_CMPSD, a, b);
+        emit(as, negate ? CMP_NEQ : CMP_EQ);
+        booleanMask(as, a);
+    }
+
+    as->kinds[a] = KIND_BOOL;
+    as->depth--;
+}
+
+/* Turns an all-ones or all-zeros cmpsd mask into 1.0 or 0.0 */
+static void booleanMask(Assembler *as, int xmm)
+{
+    emitLoadBits(as, SCRATCH, ONE_BITS);
+    emitSse(as, 0x66, SSE_ANDPD, xmm, SCRATCH);
+}
+
+#else
+
+bool jitCompile(Chunk *chunk, JitCode *jit)
+{
+    (void)chunk;
+    (void)jit;
+    return false;
+}
+
+void freeJitCode(JitCode *jit)
+{
+    initJitCode(jit);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "common.h"
+#include "chunk.h"
+
+/* Native translation of a chunk. Booleans travel as 1.0 and 0.0 and are
+   turned back into values by jitCall(). */
+typedef double (*JitFunction)(const Value *inputs);
+
+typedef struct
+{
+    /* NULL when the chunk could not be translated */
+    JitFunction function;
+    size_t size;
+    bool returnsBool;
+} JitCode;
+
+void initJitCode(JitCode *jit);
+void freeJitCode(JitCode *jit);
+
+/* Translates chunks whose operand types are all known statically: numeric
+   inputs, number and boolean constants, arithmetic, comparison, negation,
+   not, and the jumps of and/or where every path agrees on those types.
+   Anything else, including any operation that would raise a runtime error,
+   is left to the interpreter. */
+bool jitCompile(Chunk *chunk, JitCode *jit);
+
+static inline Value jitCall(JitCode *jit, const Value *inputs)
+{
+    double result = jit->function(inputs);
+    return jit->returnsBool ? BOOL_VAL(result != 0.0) : NUMBER_VAL(result);
+}
+
+#endif
@@ -5,25 +5,96 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "image.h"
 #include "vm.h"
 
 static void repl();
 static void runFile(const char *path);
+static void translateFile(const char *path);
+static void compileFile(const char *path, const char *output);
+static void runImage(const char *path);
+static bool isImage(const char *path);
+
+/* What is done with a script file: run it, translate it to C, or write
+   its bytecode image */
+typedef enum
+{
+    ACTION_RUN,
+    ACTION_EMIT_C,
+    ACTION_BUILD_NATIVE,
+    ACTION_COMPILE
+} Action;
+
+/* Bytecode design used for every script this process runs */
+static Backend backend = BACKEND_STACK;
+static Action action = ACTION_RUN;
 
 int main(int argc, const char *argv[])
 {
 
     initVM();
-    if (argc != 1 && argc != 2)
+
+    /* FAVE_GC_BUDGET=<nursery bytes>,<objects per step> makes the
+       collector run far more often, for testing it */
+    const char *budget = getenv("FAVE_GC_BUDGET");
+    size_t nurseryBytes;
+    int stepObjects;
+    if (budget != NULL && sscanf(budget, "%zu,%d", &nurseryBytes, &stepObjects) == 2)
+        setGcBudget(nurseryBytes, stepObjects);
+
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "--register") == 0)
+    {
+        backend = BACKEND_REGISTER;
+        arg++;
+    }
+    else if (arg < argc && strcmp(argv[arg], "--jit") == 0)
+    {
+        backend = BACKEND_JIT;
+        arg++;
+    }
+    else if (arg < argc && strcmp(argv[arg], "--native") == 0)
     {
-        fprintf(stderr, "Usage: fave [path]\n");
+        backend = BACKEND_NATIVE;
+        arg++;
+    }
+    else if (arg < argc && strcmp(argv[arg], "--emit-c") == 0)
+    {
+        action = ACTION_EMIT_C;
+        arg++;
+    }
+    else if (arg < argc && strcmp(argv[arg], "--build-native") == 0)
+    {
+        action = ACTION_BUILD_NATIVE;
+        arg++;
+    }
+    else if (arg < argc && strcmp(argv[arg], "--compile") == 0)
+    {
+        action = ACTION_COMPILE;
+        arg++;
+    }
+
+    bool usable = action == ACTION_COMPILE
+                      ? argc - arg == 3 && strcmp(argv[arg + 1], "-o") == 0
+                      : argc - arg <= 1 && (action == ACTION_RUN || arg < argc);
+    if (!usable)
+    {
+        fprintf(stderr, "Usage: fave [--register | --jit | --native] [path]\n"
+                        "       fave --emit-c | --build-native path\n"
+                        "       fave --compile path -o image.favec\n");
         exit(64);
     }
 
-    if (argc == 1)
+    if (arg == argc)
         repl();
+    else if (action == ACTION_COMPILE)
+        compileFile(argv[arg], argv[arg + 2]);
+    else if (action != ACTION_RUN)
+        translateFile(argv[arg]);
+    else if (isImage(argv[arg]))
+        runImage(argv[arg]);
     else
-        runFile(argv[1]);
+        runFile(argv[arg]);
 
     freeVM();
 
@@ -42,7 +113,7 @@ static void repl()
             break;
         }
 
-        interpret(buffer);
+        interpretWith(buffer, backend);
     }
 }
 
@@ -83,11 +154,90 @@ static char *readFile(const char *path)
 static void runFile(const char *path)
 {
     char *src = readFile(path);
-    InterpretResult res = interpret(src);
+    InterpretResult res = interpretWith(src, backend);
     free(src);
 
     if (res == INTERPRET_COMPILE_ERROR)
         exit(65);
     if (res == INTERPRET_RUNTIME_ERROR)
         exit(70);
-}
\ No newline at end of file
+}
+
+/* --emit-c writes the C to stdout; --build-native compiles it into the
+   native cache, where --native runs pick it up */
+static void translateFile(const char *path)
+{
+    char *src = readFile(path);
+    Prepared *prepared = prepare(src, BACKEND_STACK);
+    if (prepared == NULL)
+    {
+        free(src);
+        exit(65);
+    }
+
+    bool translated = action == ACTION_EMIT_C
+                          ? emitC(&prepared->chunk, stdout)
+                          : buildNative(&prepared->chunk, src, NULL, 0);
+    release(prepared);
+    free(src);
+
+    if (!translated)
+    {
+        fprintf(stderr, "Could not translate \"%s\" to native code.\n", path);
+        exit(70);
+    }
+}
+
+static void compileFile(const char *path, const char *output)
+{
+    char *src = readFile(path);
+    Prepared *prepared = prepare(src, BACKEND_STACK);
+    free(src);
+    if (prepared == NULL)
+        exit(65);
+
+    bool written = writeImage(&prepared->chunk, output);
+    release(prepared);
+
+    if (!written)
+    {
+        fprintf(stderr, "Could not write image \"%s\".\n", output);
+        exit(74);
+    }
+}
+
+/* Runs a compiled image without touching the scanner or compiler */
+static void runImage(const char *path)
+{
+    Chunk chunk;
+    if (!loadImage(&chunk, path))
+    {
+        fprintf(stderr, "Could not load image \"%s\".\n", path);
+        exit(74);
+    }
+
+    Prepared *prepared = prepareChunk(&chunk, backend);
+    if (prepared == NULL)
+    {
+        fprintf(stderr, "Image \"%s\" failed verification.\n", path);
+        exit(65);
+    }
+
+    Value result;
+    InterpretResult res = execute(prepared, &result);
+    if (res == INTERPRET_OK)
+    {
+        printValue(result);
+        printf("\n");
+    }
+    release(prepared);
+
+    if (res == INTERPRET_RUNTIME_ERROR)
+        exit(70);
+}
+
+static bool isImage(const char *path)
+{
+    size_t length = strlen(path);
+    return length > 6 && strcmp(path + length - 6, ".favec") == 0;
+}
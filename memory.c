@@ -1,9 +1,279 @@
+#include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+
 #include "memory.h"
+#include "object.h"
+
+/* A major collection starts once the old generation has grown by this
+   factor since the last one finished, and never below GC_MIN_OLD_BYTES */
+#define GC_HEAP_GROW_FACTOR 2
+#ifdef DEBUG_STRESS_GC
+#define GC_MIN_OLD_BYTES 4096
+#else
+#define GC_MIN_OLD_BYTES (1024 * 1024)
+#endif
+
+/* Old objects visited per object promoted while a major collection is
+   under way. Anything above 2 bounds the old generation; more keeps it
+   closer to what is live. */
+#define GC_WORK_FACTOR 4
+
+#define ALIGN_OBJECT(size) (((size) + 7) & ~(size_t)7)
+
+#define STRING_SET_MAX_LOAD 0.75
+
+/* Marks a bucket of a heap's strings whose string has died */
+static Obj tombstone;
+
+#define TOMBSTONE ((ObjString *)&tombstone)
+
+struct PoolCell
+{
+    PoolCell *next;
+};
+
+struct PoolSlab
+{
+    PoolSlab *next;
+    unsigned char cells[];
+};
+
+struct NurseryBlock
+{
+    /* The block filled before this one */
+    NurseryBlock *next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+#ifndef SYSTEM_ALLOCATOR
+/* Past this many more frees than allocations in a class, a thread hands
+   its free cells of that class over to the spare lists */
+#define POOL_THREAD_CELLS 1024
+
+/* Cells reallocate() hands out come from the pool of the thread asking.
+   Slabs are never returned to the system, so any thread may free a cell;
+   cells one thread keeps freeing pass to the spare lists, and so do all of
+   a thread's free cells when it exits, for other threads to take. */
+static _Thread_local Pool threadPool;
+static _Thread_local int threadFrees[POOL_CLASSES];
+static _Thread_local bool threadPoolUsed;
+static PoolCell *spareCells[POOL_CLASSES];
+static pthread_mutex_t spareLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t poolKey;
+static pthread_once_t poolKeyOnce = PTHREAD_ONCE_INIT;
+#ifndef NDEBUG
+/* Every slab carved for reallocate() and the class it was carved for, so
+   that a caller's oldSize can be checked against where the block really
+   came from */
+typedef struct
+{
+    PoolSlab *slab;
+    int sizeClass;
+} CellSlab;
+
+static CellSlab *cellSlabs;
+static int cellSlabCount;
+static int cellSlabCapacity;
+#endif
+
+static Pool *ownPool(void);
+static void *cellAllocate(size_t size);
+static void cellFree(void *pointer, size_t size);
+static void spareList(Pool *pool, int sizeClass);
+static void makePoolKey(void);
+static void retirePool(void *pool);
+#ifndef NDEBUG
+static void addCellSlab(PoolSlab *slab, int sizeClass);
+static int cellClass(void *pointer);
+#endif
+static int sizeClassOf(size_t size);
+#endif
+static NurseryBlock *newBlock(size_t size, NurseryBlock *next);
+static void freeBlocks(NurseryBlock *block);
+static void *poolAllocate(Pool *pool, size_t size);
+static void poolFree(Pool *pool, void *pointer, size_t size);
+static void freePool(Pool *pool);
+static size_t objectSize(Obj *object);
+static void adoptObject(Heap *heap, Obj *object, size_t size);
+static Obj *promote(Heap *heap, Obj *object, size_t *promoted);
+static size_t minorCollection(Heap *heap, const Roots *roots, int rootCount);
+static void markRoots(Heap *heap, const Roots *roots, int rootCount);
+static void markObject(Heap *heap, Obj *object);
+static void traceObject(Heap *heap, Obj *object);
+static size_t markStep(Heap *heap, size_t work);
+static void sweepStep(Heap *heap, size_t work);
+static bool isDeadString(Heap *heap, ObjString *string);
+static ObjString **stringEntry(StringSet *set, ObjString *string);
+static void rebuildStrings(Heap *heap);
+static void updateYoungStrings(Heap *heap);
+
+#ifndef SYSTEM_ALLOCATOR
+void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+{
+    assert(pointer == NULL || oldSize > 0);
+    assert(pointer == NULL ||
+           cellClass(pointer) == (oldSize <= POOL_MAX_SIZE ? sizeClassOf(oldSize) : -1));
+
+    bool pooled = pointer != NULL && oldSize <= POOL_MAX_SIZE;
+    if (newSize == 0)
+    {
+        if (pooled)
+            cellFree(pointer, oldSize);
+        else
+            free(pointer);
+        return NULL;
+    }
+
+    if (pooled && newSize <= POOL_MAX_SIZE && sizeClassOf(oldSize) == sizeClassOf(newSize))
+        return pointer;
+    if (pointer != NULL && !pooled && newSize > POOL_MAX_SIZE)
+    {
+        void *res = realloc(pointer, newSize);
+        if (res == NULL)
+            exit(1);
+        return res;
+    }
+
+    /* Moving between a cell and malloc, or between size classes */
+    void *res = newSize <= POOL_MAX_SIZE ? cellAllocate(newSize) : malloc(newSize);
+    if (res == NULL)
+        exit(1);
+    if (pointer != NULL)
+    {
+        memcpy(res, pointer, oldSize < newSize ? oldSize : newSize);
+        reallocate(pointer, oldSize, 0);
+    }
+    return res;
+}
+
+/* The calling thread's pool, arranging on first use for its free cells to
+   be handed over when the thread exits */
+static Pool *ownPool(void)
+{
+    if (!threadPoolUsed)
+    {
+        pthread_once(&poolKeyOnce, makePoolKey);
+        pthread_setspecific(poolKey, &threadPool);
+        threadPoolUsed = true;
+    }
+    return &threadPool;
+}
+
+static void *cellAllocate(size_t size)
+{
+    Pool *pool = ownPool();
+    int sizeClass = sizeClassOf(size);
+    if (pool->free[sizeClass] == NULL)
+    {
+        pthread_mutex_lock(&spareLock);
+        pool->free[sizeClass] = spareCells[sizeClass];
+        spareCells[sizeClass] = NULL;
+        pthread_mutex_unlock(&spareLock);
+    }
+    if (threadFrees[sizeClass] > 0)
+        threadFrees[sizeClass]--;
+
+#ifndef NDEBUG
+    PoolSlab *slabs = pool->slabs;
+    void *cell = poolAllocate(pool, size);
+    if (pool->slabs != slabs)
+        addCellSlab(pool->slabs, sizeClass);
+    return cell;
+#else
+    return poolAllocate(pool, size);
+#endif
+}
+
+static void cellFree(void *pointer, size_t size)
+{
+    Pool *pool = ownPool();
+    int sizeClass = sizeClassOf(size);
+    poolFree(pool, pointer, size);
+    if (++threadFrees[sizeClass] > POOL_THREAD_CELLS)
+    {
+        spareList(pool, sizeClass);
+        threadFrees[sizeClass] = 0;
+    }
+}
+
+/* Moves a pool's free cells of one class to the front of the spare list */
+static void spareList(Pool *pool, int sizeClass)
+{
+    PoolCell *first = pool->free[sizeClass];
+    if (first == NULL)
+        return;
+
+    PoolCell *last = first;
+    while (last->next != NULL)
+        last = last->next;
 
+    pthread_mutex_lock(&spareLock);
+    last->next = spareCells[sizeClass];
+    spareCells[sizeClass] = first;
+    pthread_mutex_unlock(&spareLock);
+    pool->free[sizeClass] = NULL;
+}
+
+static void makePoolKey(void)
+{
+    pthread_key_create(&poolKey, retirePool);
+}
+
+/* Runs as a thread exits. Its slabs stay where they are: the cells in use
+   may still be freed, and the free ones now belong to the spare lists. */
+static void retirePool(void *pool)
+{
+    for (int i = 0; i < POOL_CLASSES; i++)
+        spareList((Pool *)pool, i);
+}
+
+#ifndef NDEBUG
+static void addCellSlab(PoolSlab *slab, int sizeClass)
+{
+    pthread_mutex_lock(&spareLock);
+    if (cellSlabCount + 1 > cellSlabCapacity)
+    {
+        /* Straight from malloc: a cell here would recurse into the pool */
+        cellSlabCapacity = GROW_CAPACITY(cellSlabCapacity);
+        cellSlabs = (CellSlab *)realloc(cellSlabs, sizeof(CellSlab) * cellSlabCapacity);
+        if (cellSlabs == NULL)
+            exit(1);
+    }
+    cellSlabs[cellSlabCount].slab = slab;
+    cellSlabs[cellSlabCount].sizeClass = sizeClass;
+    cellSlabCount++;
+    pthread_mutex_unlock(&spareLock);
+}
+
+/* The class of the cell starting at pointer, -1 for anything else */
+static int cellClass(void *pointer)
+{
+    unsigned char *address = (unsigned char *)pointer;
+    int sizeClass = -1;
+    pthread_mutex_lock(&spareLock);
+    for (int i = 0; i < cellSlabCount; i++)
+    {
+        unsigned char *cells = cellSlabs[i].slab->cells;
+        size_t cellSize = (size_t)(cellSlabs[i].sizeClass + 1) * POOL_GRANULE;
+        if (address >= cells && address < cells + POOL_SLAB_SIZE)
+        {
+            if ((size_t)(address - cells) % cellSize == 0)
+                sizeClass = cellSlabs[i].sizeClass;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spareLock);
+    return sizeClass;
+}
+#endif
+#else
 void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
-    (void)oldSize; // for now ignore the oldSize = not used
+    (void)oldSize;
     if (newSize == 0)
     {
         free(pointer);
@@ -14,4 +284,550 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
     if (res == NULL)
         exit(1);
     return res;
-}
\ No newline at end of file
+}
+#endif
+
+void initHeap(Heap *heap)
+{
+    heap->nursery = NULL;
+    heap->nurserySize = GC_NURSERY_SIZE;
+    heap->full = false;
+    heap->objects = NULL;
+    for (int i = 0; i < POOL_CLASSES; i++)
+        heap->pool.free[i] = NULL;
+    heap->pool.slabs = NULL;
+    heap->oldBytes = 0;
+    heap->nextMajor = GC_MIN_OLD_BYTES;
+    heap->phase = GC_IDLE;
+    heap->stepObjects = GC_STEP_OBJECTS;
+    heap->mark = false;
+    heap->gray = NULL;
+    heap->grayCount = 0;
+    heap->grayCapacity = 0;
+    heap->sweep = NULL;
+    heap->strings.entries = NULL;
+    heap->strings.count = 0;
+    heap->strings.capacity = 0;
+    heap->youngStrings = NULL;
+    heap->youngStringCount = 0;
+    heap->youngStringCapacity = 0;
+    heap->clearIndex = 0;
+}
+
+void freeHeap(Heap *heap)
+{
+    freeBlocks(heap->nursery);
+
+    Obj *object = heap->objects;
+    while (object != NULL)
+    {
+        Obj *next = object->next;
+        poolFree(&heap->pool, object, objectSize(object));
+        object = next;
+    }
+    freePool(&heap->pool);
+
+    FREE_ARRAY(Obj *, heap->gray, heap->grayCapacity);
+    FREE_ARRAY(ObjString *, heap->strings.entries, heap->strings.capacity);
+    FREE_ARRAY(ObjString *, heap->youngStrings, heap->youngStringCapacity);
+    size_t nurserySize = heap->nurserySize;
+    int stepObjects = heap->stepObjects;
+    initHeap(heap);
+    setHeapBudget(heap, nurserySize, stepObjects);
+}
+
+/* A new nursery size takes effect at the next minor collection */
+void setHeapBudget(Heap *heap, size_t nurseryBytes, int stepObjects)
+{
+    heap->nurserySize = nurseryBytes < GC_MIN_NURSERY_SIZE ? GC_MIN_NURSERY_SIZE : nurseryBytes;
+    heap->stepObjects = stepObjects < 1 ? 1 : stepObjects;
+}
+
+/* Objects too big to be worth copying go straight to the old generation;
+   only strings get that large, and they refer to nothing young. */
+Obj *allocateHeap(Heap *heap, size_t size)
+{
+    Obj *object;
+    if (heap == NULL)
+    {
+        object = (Obj *)reallocate(NULL, 0, size);
+        object->space = SPACE_INTERNED;
+        object->next = NULL;
+    }
+    else if (size > heap->nurserySize / 4)
+    {
+        object = (Obj *)poolAllocate(&heap->pool, size);
+        adoptObject(heap, object, size);
+        if (heap->oldBytes > heap->nextMajor)
+            heap->full = true;
+    }
+    else
+    {
+        size = ALIGN_OBJECT(size);
+        NurseryBlock *block = heap->nursery;
+        if (block == NULL || block->size - block->used < size)
+        {
+            /* Allocation never collects: the nursery grows by a block and
+               the next safepoint empties it */
+            if (block != NULL)
+                heap->full = true;
+            block = heap->nursery = newBlock(heap->nurserySize, block);
+        }
+
+        object = (Obj *)(block->data + block->used);
+        block->used += size;
+        object->space = SPACE_YOUNG;
+        object->next = NULL;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    if (heap != NULL)
+        heap->full = true;
+#endif
+    return object;
+}
+
+ObjString *findHeapString(Heap *heap, const char *chars, int length, uint32_t hash)
+{
+    if (heap->strings.capacity == 0)
+        return NULL;
+
+    uint32_t mask = (uint32_t)heap->strings.capacity - 1;
+    for (uint32_t index = hash & mask; ; index = (index + 1) & mask)
+    {
+        ObjString *candidate = heap->strings.entries[index];
+        if (candidate == NULL)
+            return NULL;
+
+        if (candidate != TOMBSTONE && candidate->hash == hash && candidate->length == length &&
+            memcmp(candidate->chars, chars, length) == 0)
+            return isDeadString(heap, candidate) ? NULL : candidate;
+    }
+}
+
+/* A dead string with the same characters gives up its bucket */
+void addHeapString(Heap *heap, ObjString *string)
+{
+    if (heap->strings.count + 1 > heap->strings.capacity * STRING_SET_MAX_LOAD)
+        rebuildStrings(heap);
+
+    uint32_t mask = (uint32_t)heap->strings.capacity - 1;
+    ObjString **vacant = NULL;
+    for (uint32_t index = string->hash & mask; ; index = (index + 1) & mask)
+    {
+        ObjString **entry = &heap->strings.entries[index];
+        if (*entry == NULL)
+        {
+            if (vacant == NULL)
+            {
+                vacant = entry;
+                heap->strings.count++;
+            }
+            break;
+        }
+
+        if (*entry == TOMBSTONE)
+        {
+            if (vacant == NULL)
+                vacant = entry;
+        }
+        else if ((*entry)->hash == string->hash && (*entry)->length == string->length &&
+                 memcmp((*entry)->chars, string->chars, string->length) == 0)
+        {
+            vacant = entry;
+            break;
+        }
+    }
+    *vacant = string;
+
+    if (string->obj.space != SPACE_YOUNG)
+        return;
+
+    if (heap->youngStringCount + 1 > heap->youngStringCapacity)
+    {
+        int oldCapacity = heap->youngStringCapacity;
+        heap->youngStringCapacity = GROW_CAPACITY(oldCapacity);
+        heap->youngStrings = GROW_ARRAY(ObjString *, heap->youngStrings, oldCapacity,
+                                        heap->youngStringCapacity);
+    }
+    heap->youngStrings[heap->youngStringCount++] = string;
+}
+
+void collectGarbage(Heap *heap, const Roots *roots, int rootCount)
+{
+    size_t promoted = minorCollection(heap, roots, rootCount);
+    heap->full = false;
+
+    if (heap->phase == GC_IDLE && heap->oldBytes > heap->nextMajor)
+    {
+        heap->mark = !heap->mark;
+        heap->phase = GC_MARK;
+        markRoots(heap, roots, rootCount);
+    }
+
+    /* Each increment keeps ahead of promotion, so a major collection
+       finishes before the old generation has grown far */
+    size_t work = (size_t)heap->stepObjects;
+    if (work < GC_WORK_FACTOR * promoted)
+        work = GC_WORK_FACTOR * promoted;
+
+    if (heap->phase == GC_MARK)
+    {
+        /* The roots have changed since marking began, so they are scanned
+           again whenever the gray objects run out, and whatever that turns
+           up is traced by later increments like the rest. Marking is done
+           once a rescan finds nothing new: no old object is ever modified,
+           and the nursery is empty. Each rescan costs the roots alone, and
+           only so many objects can still be unmarked. */
+        work = markStep(heap, work);
+        if (heap->grayCount == 0)
+            markRoots(heap, roots, rootCount);
+        if (heap->grayCount > 0)
+            return;
+
+        heap->phase = GC_SWEEP;
+        heap->sweep = &heap->objects;
+        heap->clearIndex = 0;
+    }
+
+    if (heap->phase == GC_SWEEP)
+        sweepStep(heap, work);
+}
+
+static NurseryBlock *newBlock(size_t size, NurseryBlock *next)
+{
+    NurseryBlock *block = (NurseryBlock *)reallocate(NULL, 0, sizeof(NurseryBlock) + size);
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void freeBlocks(NurseryBlock *block)
+{
+    while (block != NULL)
+    {
+        NurseryBlock *next = block->next;
+        reallocate(block, sizeof(NurseryBlock) + block->size, 0);
+        block = next;
+    }
+}
+
+#ifndef SYSTEM_ALLOCATOR
+/* Cells carry no header: whoever frees one passes its size, as objects
+   always know theirs */
+static void *poolAllocate(Pool *pool, size_t size)
+{
+    if (size > POOL_MAX_SIZE)
+        return reallocate(NULL, 0, size);
+
+    int sizeClass = sizeClassOf(size);
+    if (pool->free[sizeClass] == NULL)
+    {
+        PoolSlab *slab = (PoolSlab *)reallocate(NULL, 0, sizeof(PoolSlab) + POOL_SLAB_SIZE);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+
+        size_t cellSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+        for (size_t offset = 0; offset + cellSize <= POOL_SLAB_SIZE; offset += cellSize)
+        {
+            PoolCell *cell = (PoolCell *)(slab->cells + offset);
+            cell->next = pool->free[sizeClass];
+            pool->free[sizeClass] = cell;
+        }
+    }
+
+    PoolCell *cell = pool->free[sizeClass];
+    pool->free[sizeClass] = cell->next;
+    return cell;
+}
+
+static void poolFree(Pool *pool, void *pointer, size_t size)
+{
+    if (size > POOL_MAX_SIZE)
+    {
+        reallocate(pointer, size, 0);
+        return;
+    }
+
+    int sizeClass = sizeClassOf(size);
+    PoolCell *cell = (PoolCell *)pointer;
+    cell->next = pool->free[sizeClass];
+    pool->free[sizeClass] = cell;
+}
+
+static void freePool(Pool *pool)
+{
+    PoolSlab *slab = pool->slabs;
+    while (slab != NULL)
+    {
+        PoolSlab *next = slab->next;
+        reallocate(slab, sizeof(PoolSlab) + POOL_SLAB_SIZE, 0);
+        slab = next;
+    }
+
+    for (int i = 0; i < POOL_CLASSES; i++)
+        pool->free[i] = NULL;
+    pool->slabs = NULL;
+}
+
+static int sizeClassOf(size_t size)
+{
+    return (int)((size - 1) / POOL_GRANULE);
+}
+#else
+/* Built with ALLOCATOR=system, to compare against malloc */
+static void *poolAllocate(Pool *pool, size_t size)
+{
+    (void)pool;
+    return reallocate(NULL, 0, size);
+}
+
+static void poolFree(Pool *pool, void *pointer, size_t size)
+{
+    (void)pool;
+    reallocate(pointer, size, 0);
+}
+
+static void freePool(Pool *pool)
+{
+    (void)pool;
+}
+#endif
+
+static size_t objectSize(Obj *object)
+{
+    if (object->type == OBJ_STRING)
+        return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+    return sizeof(ObjRope);
+}
+
+/* Links an object into the old generation. It counts as marked, so a
+   collection already under way keeps it. */
+static void adoptObject(Heap *heap, Obj *object, size_t size)
+{
+    object->space = SPACE_OLD;
+    object->mark = heap->mark;
+    object->next = heap->objects;
+    heap->objects = object;
+    heap->oldBytes += size;
+}
+
+/* Copies a live young object out of the nursery, leaving the address of
+   the copy in the original for the other references to it. Recursion is
+   bounded by the height of a rope. */
+static Obj *promote(Heap *heap, Obj *object, size_t *promoted)
+{
+    if (object->space != SPACE_YOUNG)
+        return object;
+    if (object->next != NULL)
+        return object->next;
+
+    size_t size = objectSize(object);
+    Obj *copy = (Obj *)poolAllocate(&heap->pool, size);
+    memcpy(copy, object, size);
+    object->next = copy;
+    adoptObject(heap, copy, size);
+    (*promoted)++;
+
+    if (copy->type == OBJ_ROPE)
+    {
+        ObjRope *rope = (ObjRope *)copy;
+        rope->left = promote(heap, rope->left, promoted);
+        rope->right = promote(heap, rope->right, promoted);
+
+        /* Its children may be old objects marking has not reached */
+        if (heap->phase == GC_MARK)
+            traceObject(heap, copy);
+    }
+    return copy;
+}
+
+static size_t minorCollection(Heap *heap, const Roots *roots, int rootCount)
+{
+    if (heap->nursery == NULL)
+        return 0;
+
+    size_t promoted = 0;
+    for (int i = 0; i < rootCount; i++)
+    {
+        for (int j = 0; j < roots[i].count; j++)
+        {
+            Value *value = &roots[i].values[j];
+            if (IS_OBJ(*value))
+                *value = OBJ_VAL(promote(heap, AS_OBJ(*value), &promoted));
+        }
+    }
+    updateYoungStrings(heap);
+
+    /* Keep the newest block for the next round unless the budget changed */
+    NurseryBlock *block = heap->nursery;
+    freeBlocks(block->next);
+    block->next = NULL;
+    block->used = 0;
+    if (block->size != heap->nurserySize)
+    {
+        freeBlocks(block);
+        heap->nursery = NULL;
+    }
+    return promoted;
+}
+
+static void markRoots(Heap *heap, const Roots *roots, int rootCount)
+{
+    for (int i = 0; i < rootCount; i++)
+    {
+        for (int j = 0; j < roots[i].count; j++)
+        {
+            if (IS_OBJ(roots[i].values[j]))
+                markObject(heap, AS_OBJ(roots[i].values[j]));
+        }
+    }
+}
+
+static void markObject(Heap *heap, Obj *object)
+{
+    if (object->space != SPACE_OLD || object->mark == heap->mark)
+        return;
+
+    object->mark = heap->mark;
+    if (object->type == OBJ_STRING)
+        return;
+
+    if (heap->grayCount + 1 > heap->grayCapacity)
+    {
+        int oldCapacity = heap->grayCapacity;
+        heap->grayCapacity = GROW_CAPACITY(oldCapacity);
+        heap->gray = GROW_ARRAY(Obj *, heap->gray, oldCapacity, heap->grayCapacity);
+    }
+    heap->gray[heap->grayCount++] = object;
+}
+
+static void traceObject(Heap *heap, Obj *object)
+{
+    ObjRope *rope = (ObjRope *)object;
+    markObject(heap, rope->left);
+    markObject(heap, rope->right);
+}
+
+/* Returns the work left over */
+static size_t markStep(Heap *heap, size_t work)
+{
+    while (work > 0 && heap->grayCount > 0)
+    {
+        traceObject(heap, heap->gray[--heap->grayCount]);
+        work--;
+    }
+    return work;
+}
+
+/* Dead strings leave the table before any object is freed, since a lookup
+   still compares against their characters */
+static void sweepStep(Heap *heap, size_t work)
+{
+    while (work > 0 && heap->clearIndex < heap->strings.capacity)
+    {
+        ObjString **entry = &heap->strings.entries[heap->clearIndex++];
+        if (*entry != NULL && *entry != TOMBSTONE && isDeadString(heap, *entry))
+            *entry = TOMBSTONE;
+        work--;
+    }
+    if (heap->clearIndex < heap->strings.capacity)
+        return;
+
+    while (work > 0 && *heap->sweep != NULL)
+    {
+        Obj *object = *heap->sweep;
+        if (object->mark == heap->mark)
+        {
+            heap->sweep = &object->next;
+        }
+        else
+        {
+            size_t size = objectSize(object);
+            *heap->sweep = object->next;
+            heap->oldBytes -= size;
+            poolFree(&heap->pool, object, size);
+        }
+        work--;
+    }
+
+    if (*heap->sweep != NULL)
+        return;
+
+    heap->phase = GC_IDLE;
+    heap->sweep = NULL;
+    heap->nextMajor = heap->oldBytes * GC_HEAP_GROW_FACTOR;
+    if (heap->nextMajor < GC_MIN_OLD_BYTES)
+        heap->nextMajor = GC_MIN_OLD_BYTES;
+}
+
+/* Only once marking is over can an unmarked old string be known dead */
+static bool isDeadString(Heap *heap, ObjString *string)
+{
+    return heap->phase == GC_SWEEP && string->obj.space == SPACE_OLD && string->obj.mark != heap->mark;
+}
+
+static ObjString **stringEntry(StringSet *set, ObjString *string)
+{
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    uint32_t index = string->hash & mask;
+    while (set->entries[index] != string)
+        index = (index + 1) & mask;
+    return &set->entries[index];
+}
+
+/* Drops the tombstones and dead strings, growing the table only if the
+   strings left would still fill half of it */
+static void rebuildStrings(Heap *heap)
+{
+    StringSet *set = &heap->strings;
+    int live = 0;
+    for (int i = 0; i < set->capacity; i++)
+    {
+        ObjString *string = set->entries[i];
+        if (string != NULL && string != TOMBSTONE && isDeadString(heap, string))
+            set->entries[i] = TOMBSTONE;
+        else if (string != NULL && string != TOMBSTONE)
+            live++;
+    }
+
+    int capacity = set->capacity;
+    if (live + 1 > capacity * STRING_SET_MAX_LOAD / 2)
+        capacity = GROW_CAPACITY(capacity);
+
+    ObjString **entries = ALLOCATE(ObjString *, capacity);
+    for (int i = 0; i < capacity; i++)
+        entries[i] = NULL;
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (int i = 0; i < set->capacity; i++)
+    {
+        ObjString *string = set->entries[i];
+        if (string == NULL || string == TOMBSTONE)
+            continue;
+
+        uint32_t index = string->hash & mask;
+        while (entries[index] != NULL)
+            index = (index + 1) & mask;
+        entries[index] = string;
+    }
+
+    FREE_ARRAY(ObjString *, set->entries, set->capacity);
+    set->entries = entries;
+    set->count = live;
+    set->capacity = capacity;
+}
+
+/* The strings added since the last minor collection have each been copied
+   out by now or are dead */
+static void updateYoungStrings(Heap *heap)
+{
+    for (int i = 0; i < heap->youngStringCount; i++)
+    {
+        ObjString *string = heap->youngStrings[i];
+        ObjString **entry = stringEntry(&heap->strings, string);
+        *entry = string->obj.next != NULL ? (ObjString *)string->obj.next : TOMBSTONE;
+    }
+    heap->youngStringCount = 0;
+}
@@ -2,6 +2,7 @@
 #define MEMORY_H
 
 #include "common.h"
+#include "value.h"
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
@@ -10,11 +11,133 @@
     (type*)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * oldCount, 0)
+    reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
+#define FREE(type, pointer) \
+    reallocate(pointer, sizeof(type), 0)
+
+/* Default collector budget: bytes allocated between minor collections, and
+   old objects marked or swept per increment of a major one */
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_MIN_NURSERY_SIZE 4096
+#define GC_STEP_OBJECTS 1024
+
+/* Old objects and other blocks up to POOL_MAX_SIZE bytes are carved out of
+   slabs in size classes POOL_GRANULE bytes apart; larger ones come from
+   malloc */
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct NurseryBlock NurseryBlock;
+typedef struct PoolCell PoolCell;
+typedef struct PoolSlab PoolSlab;
+
+/* Fixed-size cells owned by one heap, or by one thread for reallocate(), so
+   no lock is taken and the cells of VMs running side by side never
+   interleave. Slabs are kept until the heap is freed, or for good; their
+   free cells are reused by the same size class. */
+typedef struct
+{
+    PoolCell *free[POOL_CLASSES];
+    PoolSlab *slabs;
+} Pool;
+
+typedef enum
+{
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP
+} GcPhase;
+
+/* Open-addressing set of strings keyed by content */
+typedef struct
+{
+    ObjString **entries;
+    /* Buckets not NULL, tombstones included */
+    int count;
+    int capacity;
+} StringSet;
+
+/* The objects a VM creates as it runs. New objects are bump-allocated in
+   the nursery and copied out to the old generation by the minor collection
+   that finds them alive. The old generation is collected by incremental
+   mark-sweep, a few objects at a time after each minor collection. Objects
+   never change once built, so no write barrier is needed: an old object
+   can only refer to objects older than itself. */
+typedef struct
+{
+    NurseryBlock *nursery;
+    size_t nurserySize;
+    /* Set once the nursery is used up or the old generation has grown
+       past nextMajor; the VM collects at its next safepoint */
+    bool full;
+
+    Obj *objects;
+    Pool pool;
+    size_t oldBytes;
+    size_t nextMajor;
+
+    GcPhase phase;
+    int stepObjects;
+    /* An old object is marked when its mark equals this; flipping it at the
+       start of a major collection unmarks everything at once */
+    bool mark;
+    Obj **gray;
+    int grayCount;
+    int grayCapacity;
+    /* The link holding the next object to sweep */
+    Obj **sweep;
+
+    /* The flat strings concatenation has built, so that equal ones are
+       one object and compare by identity. Entries are weak: a young
+       string's goes at the minor collection that finds it dead, an old
+       one's at the start of the sweep, a few buckets per increment. */
+    StringSet strings;
+    ObjString **youngStrings;
+    int youngStringCount;
+    int youngStringCapacity;
+    /* The next bucket of strings to clear of dead entries */
+    int clearIndex;
+} Heap;
+
+/* Every block outside a heap goes through here. oldSize must be the size
+   the block was allocated with: it tells a pooled block from a malloc'ed
+   one, and a block stays where it is while its size class does not
+   change; debug builds check it against the block. A block may be freed
+   by another thread than allocated it. */
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+void initHeap(Heap *heap);
+void freeHeap(Heap *heap);
+void setHeapBudget(Heap *heap, size_t nurseryBytes, int stepObjects);
+
+/* A run of values the collector starts from */
+typedef struct
+{
+    Value *values;
+    int count;
+} Roots;
+
+/* An object of size bytes with its collector fields set and its type left
+   to the caller. With heap NULL no collector ever frees it; that is how
+   interned strings are made. Never collects, so a caller may hold any number of
+   objects across allocations. */
+Obj *allocateHeap(Heap *heap, size_t size);
+
+/* The string in heap's table with these characters, or NULL */
+ObjString *findHeapString(Heap *heap, const char *chars, int length, uint32_t hash);
+/* Adds a flat string allocated in heap, which findHeapString() did not
+   find */
+void addHeapString(Heap *heap, ObjString *string);
+
+/* Promotes the nursery's survivors and advances any major collection.
+   Roots are updated in place for the objects that moved; everything they
+   do not reach may be freed. */
+void collectGarbage(Heap *heap, const Roots *roots, int rootCount);
+
 #endif
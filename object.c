@@ -1,3 +1,5 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -6,31 +8,510 @@
 #include "memory.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(heap, type, objectType) \
+    (type*)allocateObject(heap, sizeof(type), objectType)
 
-static ObjString *allocateString(char *chars, int length);
-static Obj *allocateObject(size_t size, ObjType type);
+#define STRING_TABLE_MAX_LOAD 0.75
+#define HASH_SEED 2166136261u
+
+/* Shared by the whole process rather than kept per VM: the compiler makes
+   string constants without a VM, and one compiled chunk may run on any of
+   them, so its strings must be the ones every VM compares against. */
+typedef struct
+{
+    /* Open-addressing set of strings keyed by content; NULL marks an
+       empty bucket and TOMBSTONE one whose string was freed */
+    ObjString **entries;
+    /* Buckets not NULL, tombstones included */
+    int count;
+    int capacity;
+} StringTable;
+
+/* The leaves of a string or rope still to visit, in reverse order */
+typedef struct
+{
+    Obj *pending[ROPE_MAX_HEIGHT + 1];
+    int count;
+} LeafWalk;
+
+static StringTable strings = {NULL, 0, 0};
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Obj tombstone;
+
+#define TOMBSTONE ((ObjString *)&tombstone)
+
+static ObjString *internString(const char *chars, int length, uint32_t hash);
+static ObjString **findString(ObjString **entries, int capacity, const char *chars, int length,
+                              uint32_t hash);
+static void growStrings(void);
+static uint32_t hashString(uint32_t hash, const char *chars, int length);
+static void startWalk(LeafWalk *walk, Obj *object);
+static ObjString *nextLeaf(LeafWalk *walk);
+static Obj *ownedBy(Heap *heap, Obj *object);
+static ObjString *shortString(Heap *heap, Obj *left, Obj *right, int length);
+static ObjString *joinStrings(Heap *heap, Obj *left, Obj *right);
+static Obj *join(Heap *heap, Obj *left, Obj *right);
+static Obj *joinRight(Heap *heap, Obj *left, Obj *right);
+static Obj *joinLeft(Heap *heap, Obj *left, Obj *right);
+static Obj *rotateLeft(Heap *heap, Obj *node);
+static Obj *rotateRight(Heap *heap, Obj *node);
+static Obj *makeNode(Heap *heap, Obj *left, Obj *right);
+static Obj *leftOf(Obj *node);
+static Obj *rightOf(Obj *node);
+static int lengthOf(Obj *object);
+static int heightOf(Obj *object);
+static void copyChars(Obj *object, char *out);
+static ObjString *allocateString(Heap *heap, int length);
+static Obj *allocateObject(Heap *heap, size_t size, ObjType type);
 
 ObjString *copyString(const char *chars, int length)
 {
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length);
+    return internString(chars, length, hashString(HASH_SEED, chars, length));
+}
+
+ObjString *takeString(char *chars, int length)
+{
+    ObjString *string = internString(chars, length, hashString(HASH_SEED, chars, length));
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
+}
+
+/* Taking a reference needs no lock, since the caller holds one already */
+void retainString(ObjString *string)
+{
+    atomic_fetch_add(&string->refs, 1);
+}
+
+/* Only the last reference is dropped under the lock, so that a string
+   leaves the table before copyString() can find it with no references */
+void releaseString(ObjString *string)
+{
+    int refs = atomic_load(&string->refs);
+    while (refs > 1)
+    {
+        if (atomic_compare_exchange_weak(&string->refs, &refs, refs - 1))
+            return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (atomic_fetch_sub(&string->refs, 1) == 1)
+    {
+        uint32_t mask = (uint32_t)strings.capacity - 1;
+        uint32_t index = string->hash & mask;
+        while (strings.entries[index] != string)
+            index = (index + 1) & mask;
+
+        strings.entries[index] = TOMBSTONE;
+        reallocate(string, sizeof(ObjString) + string->length + 1, 0);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static ObjString *internString(const char *chars, int length, uint32_t hash)
+{
+    pthread_mutex_lock(&lock);
+
+    if (strings.count + 1 > strings.capacity * STRING_TABLE_MAX_LOAD)
+        growStrings();
+
+    ObjString **entry = findString(strings.entries, strings.capacity, chars, length, hash);
+    if (*entry == NULL || *entry == TOMBSTONE)
+    {
+        if (*entry == NULL)
+            strings.count++;
+
+        *entry = allocateString(NULL, length);
+        memcpy((*entry)->chars, chars, length);
+        (*entry)->hash = hash;
+        atomic_init(&(*entry)->refs, 1);
+    }
+    else
+    {
+        atomic_fetch_add(&(*entry)->refs, 1);
+    }
+
+    ObjString *string = *entry;
+    pthread_mutex_unlock(&lock);
+    return string;
+}
+
+/* The bucket holding the string, or else the one to put it in: the first
+   tombstone passed, if any */
+static ObjString **findString(ObjString **entries, int capacity, const char *chars, int length,
+                              uint32_t hash)
+{
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = hash & mask;
+    ObjString **vacant = NULL;
+
+    for (;;)
+    {
+        ObjString **entry = &entries[index];
+        if (*entry == NULL)
+            return vacant != NULL ? vacant : entry;
+
+        ObjString *candidate = *entry;
+        if (candidate == TOMBSTONE)
+        {
+            if (vacant == NULL)
+                vacant = entry;
+        }
+        else if (candidate->hash == hash && candidate->length == length &&
+                 memcmp(candidate->chars, chars, length) == 0)
+        {
+            return entry;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+/* Also clears out the tombstones, so the table is rebuilt at the same
+   size when they are what fills it */
+static void growStrings(void)
+{
+    int live = 0;
+    for (int i = 0; i < strings.capacity; i++)
+    {
+        if (strings.entries[i] != NULL && strings.entries[i] != TOMBSTONE)
+            live++;
+    }
+
+    int capacity = strings.capacity;
+    if (live + 1 > capacity * STRING_TABLE_MAX_LOAD / 2)
+        capacity = GROW_CAPACITY(capacity);
+
+    ObjString **entries = ALLOCATE(ObjString *, capacity);
+    for (int i = 0; i < capacity; i++)
+        entries[i] = NULL;
+
+    for (int i = 0; i < strings.capacity; i++)
+    {
+        ObjString *string = strings.entries[i];
+        if (string != NULL && string != TOMBSTONE)
+            *findString(entries, capacity, string->chars, string->length, string->hash) = string;
+    }
+
+    FREE_ARRAY(ObjString *, strings.entries, strings.capacity);
+    strings.entries = entries;
+    strings.capacity = capacity;
+    strings.count = live;
+}
+
+/* FNV-1a, continued from hash so that pieces can be hashed in turn */
+static uint32_t hashString(uint32_t hash, const char *chars, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+const char *concatenate(Heap *heap, Value *a, Value b)
+{
+    if (!isStringValue(*a) || !isStringValue(b))
+        return "Operands must be two numbers or two strings.";
+
+    Obj *left = AS_OBJ(*a);
+    Obj *right = AS_OBJ(b);
+    int leftLength = lengthOf(left);
+    int rightLength = lengthOf(right);
+    if (leftLength > INT_MAX - rightLength)
+        return "String too long.";
+
+    if (leftLength == 0 || rightLength == 0)
+    {
+        if (leftLength == 0)
+            *a = b;
+        if (heap == NULL)
+            retainValue(*a);
+        return NULL;
+    }
+
+    int length = leftLength + rightLength;
+    if (heap == NULL)
+    {
+        char *chars = ALLOCATE(char, length + 1);
+        copyChars(left, chars);
+        copyChars(right, chars + leftLength);
+        *a = OBJ_VAL(takeString(chars, length));
+        return NULL;
+    }
+
+    if (length < ROPE_MIN_LENGTH)
+        *a = OBJ_VAL(shortString(heap, left, right, length));
+    else
+        *a = OBJ_VAL(join(heap, ownedBy(heap, left), ownedBy(heap, right)));
+    return NULL;
+}
+
+/* A flat string is unique in the process's table or in its VM's, and one
+   VM's strings never meet another's. The same characters may still be
+   held by an interned string and a runtime one, or by a rope. */
+bool stringsEqual(Obj *a, Obj *b)
+{
+    if (a == b)
+        return true;
+    if (lengthOf(a) != lengthOf(b))
+        return false;
+
+    if (a->type == OBJ_STRING && b->type == OBJ_STRING)
+    {
+        if ((a->space == SPACE_INTERNED) == (b->space == SPACE_INTERNED))
+            return false;
+
+        ObjString *x = (ObjString *)a;
+        ObjString *y = (ObjString *)b;
+        return x->hash == y->hash && memcmp(x->chars, y->chars, x->length) == 0;
+    }
+
+    LeafWalk left;
+    LeafWalk right;
+    startWalk(&left, a);
+    startWalk(&right, b);
+    ObjString *x = nextLeaf(&left);
+    ObjString *y = nextLeaf(&right);
+    int i = 0;
+    int j = 0;
+
+    /* The lengths match, so both walks run out together */
+    while (x != NULL && y != NULL)
+    {
+        int count = x->length - i < y->length - j ? x->length - i : y->length - j;
+        if (memcmp(x->chars + i, y->chars + j, count) != 0)
+            return false;
+
+        i += count;
+        j += count;
+        if (i == x->length)
+        {
+            x = nextLeaf(&left);
+            i = 0;
+        }
+        if (j == y->length)
+        {
+            y = nextLeaf(&right);
+            j = 0;
+        }
+    }
+    return true;
+}
+
+uint32_t hashObject(Obj *object)
+{
+    if (object->type == OBJ_STRING)
+        return ((ObjString *)object)->hash;
+
+    LeafWalk walk;
+    startWalk(&walk, object);
+    uint32_t hash = HASH_SEED;
+    for (ObjString *string = nextLeaf(&walk); string != NULL; string = nextLeaf(&walk))
+        hash = hashString(hash, string->chars, string->length);
+    return hash;
+}
+
+void printObject(Value value)
+{
+    LeafWalk walk;
+    startWalk(&walk, AS_OBJ(value));
+    for (ObjString *string = nextLeaf(&walk); string != NULL; string = nextLeaf(&walk))
+        fwrite(string->chars, 1, string->length, stdout);
+}
+
+static void startWalk(LeafWalk *walk, Obj *object)
+{
+    walk->pending[0] = object;
+    walk->count = 1;
+}
+
+/* Right subtrees are set aside on the way down to each leaf, at most one
+   per level */
+static ObjString *nextLeaf(LeafWalk *walk)
+{
+    if (walk->count == 0)
+        return NULL;
+
+    Obj *object = walk->pending[--walk->count];
+    while (object->type == OBJ_ROPE)
+    {
+        walk->pending[walk->count++] = rightOf(object);
+        object = leftOf(object);
+    }
+    return (ObjString *)object;
+}
+
+/* An interned string may be freed while a heap still refers to it, so a
+   rope takes a copy in its own heap instead */
+static Obj *ownedBy(Heap *heap, Obj *object)
+{
+    if (object->space != SPACE_INTERNED)
+        return object;
+
+    ObjString *string = (ObjString *)object;
+    ObjString *copy = allocateString(heap, string->length);
+    memcpy(copy->chars, string->chars, string->length);
+    copy->hash = string->hash;
+    return (Obj *)copy;
+}
+
+/* The heap's one string with the characters of left followed by those of
+   right */
+static ObjString *shortString(Heap *heap, Obj *left, Obj *right, int length)
+{
+    char chars[ROPE_MIN_LENGTH];
+    copyChars(left, chars);
+    copyChars(right, chars + lengthOf(left));
+    uint32_t hash = hashString(HASH_SEED, chars, length);
+
+    ObjString *string = findHeapString(heap, chars, length, hash);
+    if (string != NULL)
+        return string;
+
+    string = allocateString(heap, length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    addHeapString(heap, string);
+    return string;
+}
+
+/* A flat string with the characters of left followed by those of right */
+static ObjString *joinStrings(Heap *heap, Obj *left, Obj *right)
+{
+    int length = lengthOf(left) + lengthOf(right);
+    ObjString *string = allocateString(heap, length);
+    copyChars(left, string->chars);
+    copyChars(right, string->chars + lengthOf(left));
+    string->hash = hashString(HASH_SEED, string->chars, length);
+    return string;
+}
+
+/* Joins two balanced trees into one, in the manner of AVL trees: the
+   shorter is hung off the spine of the taller at the height where it
+   fits, and the nodes above are rotated back into balance. Only the nodes
+   along that spine are copied; everything else is shared. */
+static Obj *join(Heap *heap, Obj *left, Obj *right)
+{
+    if (heightOf(left) > heightOf(right) + 1)
+        return joinRight(heap, left, right);
+    if (heightOf(right) > heightOf(left) + 1)
+        return joinLeft(heap, left, right);
+    return makeNode(heap, left, right);
+}
+
+static Obj *joinRight(Heap *heap, Obj *left, Obj *right)
+{
+    Obj *outer = leftOf(left);
+    Obj *inner = rightOf(left);
+
+    if (heightOf(inner) <= heightOf(right) + 1)
+    {
+        Obj *joined = makeNode(heap, inner, right);
+        if (heightOf(joined) <= heightOf(outer) + 1)
+            return makeNode(heap, outer, joined);
+        return rotateLeft(heap, makeNode(heap, outer, rotateRight(heap, joined)));
+    }
+
+    Obj *joined = joinRight(heap, inner, right);
+    Obj *node = makeNode(heap, outer, joined);
+    return heightOf(joined) <= heightOf(outer) + 1 ? node : rotateLeft(heap, node);
 }
 
-static ObjString* allocateString(char* chars, int length)
+static Obj *joinLeft(Heap *heap, Obj *left, Obj *right)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    Obj *inner = leftOf(right);
+    Obj *outer = rightOf(right);
+
+    if (heightOf(inner) <= heightOf(left) + 1)
+    {
+        Obj *joined = makeNode(heap, left, inner);
+        if (heightOf(joined) <= heightOf(outer) + 1)
+            return makeNode(heap, joined, outer);
+        return rotateRight(heap, makeNode(heap, rotateLeft(heap, joined), outer));
+    }
+
+    Obj *joined = joinLeft(heap, left, inner);
+    Obj *node = makeNode(heap, joined, outer);
+    return heightOf(joined) <= heightOf(outer) + 1 ? node : rotateRight(heap, node);
+}
+
+static Obj *rotateLeft(Heap *heap, Obj *node)
+{
+    Obj *right = rightOf(node);
+    return makeNode(heap, makeNode(heap, leftOf(node), leftOf(right)), rightOf(right));
+}
+
+static Obj *rotateRight(Heap *heap, Obj *node)
+{
+    Obj *left = leftOf(node);
+    return makeNode(heap, leftOf(left), makeNode(heap, rightOf(left), rightOf(node)));
+}
+
+/* Two short leaves are merged into one, so the leaves of a rope built from
+   many small pieces still hold ROPE_MIN_LENGTH characters or so each. */
+static Obj *makeNode(Heap *heap, Obj *left, Obj *right)
+{
+    int length = lengthOf(left) + lengthOf(right);
+    if (left->type == OBJ_STRING && right->type == OBJ_STRING && length < ROPE_MIN_LENGTH)
+        return (Obj *)joinStrings(heap, left, right);
+
+    ObjRope *rope = ALLOCATE_OBJ(heap, ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->height = (heightOf(left) > heightOf(right) ? heightOf(left) : heightOf(right)) + 1;
+    rope->left = left;
+    rope->right = right;
+    return (Obj *)rope;
+}
+
+static Obj *leftOf(Obj *node)
+{
+    return ((ObjRope *)node)->left;
+}
+
+static Obj *rightOf(Obj *node)
+{
+    return ((ObjRope *)node)->right;
+}
+
+static int lengthOf(Obj *object)
+{
+    if (object->type == OBJ_STRING)
+        return ((ObjString *)object)->length;
+    return ((ObjRope *)object)->length;
+}
+
+static int heightOf(Obj *object)
+{
+    return object->type == OBJ_STRING ? 0 : ((ObjRope *)object)->height;
+}
+
+static void copyChars(Obj *object, char *out)
+{
+    if (object->type == OBJ_STRING)
+    {
+        ObjString *string = (ObjString *)object;
+        memcpy(out, string->chars, string->length);
+        return;
+    }
+
+    ObjRope *rope = (ObjRope *)object;
+    copyChars(rope->left, out);
+    copyChars(rope->right, out + lengthOf(rope->left));
+}
+
+/* Leaves the characters and hash to the caller */
+static ObjString *allocateString(Heap *heap, int length)
+{
+    ObjString *string = (ObjString *)allocateObject(heap, sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->chars[length] = '\0';
     return string;
 }
 
-static Obj* allocateObject(size_t size, ObjType type)
+static Obj *allocateObject(Heap *heap, size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = allocateHeap(heap, size);
     object->type = type;
     return object;
-}
\ No newline at end of file
+}
@@ -1,38 +1,134 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+#include <stdatomic.h>
+
 #include "common.h"
+#include "memory.h"
 #include "value.h"
 
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 
 #define IS_STRING(value)        checkObjType(value, OBJ_STRING)
+#define IS_ROPE(value)          checkObjType(value, OBJ_ROPE)
 
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
 
+/* Concatenations shorter than this are copied into a string straight
+   away; longer ones become ropes */
+#define ROPE_MIN_LENGTH 64
+
 typedef enum
 {
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
+/* Who owns an object: the process-wide string table, or a heap's young or
+   old generation */
+typedef enum
+{
+    SPACE_INTERNED,
+    SPACE_YOUNG,
+    SPACE_OLD,
+} ObjSpace;
+
 struct Obj 
 {
     ObjType type;
+    uint8_t space;
+    bool mark;
+    /* The next object in an old generation; in a young object that has
+       been promoted, its copy */
+    Obj *next;
 };
 
+/* The characters follow the header in the same allocation, with a
+   terminating NUL */
 struct ObjString 
 {
   Obj obj;
   int length;
-  char* chars;
+  uint32_t hash;
+  /* References held to an interned string; unused in a heap */
+  atomic_int refs;
+  char chars[];
 };
 
+/* Interns a string: there is one such ObjString for each distinct content
+   in the process, shared by every VM. Used for the strings in source and
+   images; strings built at run time live in the VM's heap instead. Returns
+   a new reference, which the caller hands on or releases. May be called
+   from several threads at once. */
 ObjString *copyString(const char *chars, int length);
 
+/* As copyString(), for characters in a buffer from ALLOCATE(char, length
+   + 1) that the caller gives up; the buffer is freed. */
+ObjString *takeString(char *chars, int length);
+
+/* An interned string is freed, and leaves the table, once the last
+   reference to it is released. References are held by the constants of
+   chunks and native code, by IR constants and by VM globals; no heap
+   object refers to an interned string. */
+void retainString(ObjString *string);
+void releaseString(ObjString *string);
+
+/* A string built by concatenation whose characters are never copied
+   out: those of left followed by those of right, each a string or a rope.
+   Ropes are immutable, shared between the values built from them, and kept
+   height-balanced, so appending to one costs time logarithmic in its
+   length. */
+typedef struct
+{
+    Obj obj;
+    int length;
+    /* Of the tree below; a string is a leaf of height 0 */
+    int height;
+    Obj *left;
+    Obj *right;
+} ObjRope;
+
+/* Bounds the height of any rope, whose leaves hold a character at least */
+#define ROPE_MAX_HEIGHT 64
+
+/* Replaces *a with *a followed by b, allocated in heap. With heap NULL the
+   result is always an interned string, as constant folding needs, and a
+   new reference to it. Returns
+   NULL, or the runtime error to report if either is not a string or the
+   result would be too long. */
+const char *concatenate(Heap *heap, Value *a, Value b);
+
+/* For two strings or ropes: whether they hold the same characters */
+bool stringsEqual(Obj *a, Obj *b);
+
+/* Of the characters of a string or rope, whichever form it is in */
+uint32_t hashObject(Obj *object);
+
+void printObject(Value value);
+
 static inline bool checkObjType(Value value, ObjType type) 
 {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/* For values that may or may not be interned strings */
+static inline void retainValue(Value value)
+{
+    if (IS_OBJ(value) && AS_OBJ(value)->space == SPACE_INTERNED)
+        retainString((ObjString *)AS_OBJ(value));
+}
+
+static inline void releaseValue(Value value)
+{
+    if (IS_OBJ(value) && AS_OBJ(value)->space == SPACE_INTERNED)
+        releaseString((ObjString *)AS_OBJ(value));
+}
+
+/* A string in either form; the only objects there are */
+static inline bool isStringValue(Value value)
+{
+    return IS_STRING(value) || IS_ROPE(value);
+}
+
 #endif
\ No newline at end of file
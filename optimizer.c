@@ -0,0 +1,381 @@
+#include <string.h>
+
+#include "optimizer.h"
+#include "memory.h"
+
+typedef struct
+{
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+    /* Which of the two instructions the fused one takes its line from:
+       the one that can raise a runtime error. */
+    int lineFrom;
+} Fusion;
+
+static const Fusion fusions[] = {
+    {OP_EQUAL, OP_NOT, OP_NOT_EQUAL, 0},
+    {OP_LESS, OP_NOT, OP_GREATER_EQUAL, 0},
+    {OP_GREATER, OP_NOT, OP_LESS_EQUAL, 0},
+    {OP_CONSTANT, OP_ADD, OP_ADD_CONSTANT, 1},
+    {OP_LESS_NN, OP_NOT, OP_GREATER_EQUAL_NN, 0},
+    {OP_GREATER_NN, OP_NOT, OP_LESS_EQUAL_NN, 0},
+    {OP_CONSTANT, OP_ADD_NN, OP_ADD_CONSTANT_NN, 1},
+};
+
+/* Walks the run-length line table alongside increasing code offsets */
+typedef struct
+{
+    LineArray *lines;
+    int run;
+    int end;
+} LineCursor;
+
+/* What every path taking a jump knows about the value on top of the stack */
+typedef enum
+{
+    TOP_UNKNOWN,
+    TOP_TRUTHY,
+    TOP_FALSEY
+} TopKnowledge;
+
+/* Per byte of the original code */
+#define FLAG_START 0x01
+#define FLAG_REACHABLE 0x02
+#define FLAG_TARGET 0x04
+/* A jump that lands where falling through would have gone */
+#define FLAG_NO_OP 0x08
+/* A jump whose distance fits the short form */
+#define FLAG_SHORT 0x10
+
+typedef struct
+{
+    Chunk *chunk;
+    uint8_t *flags;
+
+    /* New offset of each kept instruction, and of the end of the code */
+    int *offsets;
+} Rewrite;
+
+static void threadJumps(Chunk *chunk, uint8_t *flags);
+static int threadTarget(Chunk *chunk, int offset, TopKnowledge known);
+static void retarget(Chunk *chunk, int offset, int target);
+static void markInstructions(Chunk *chunk, uint8_t *flags);
+static void markReachable(Chunk *chunk, uint8_t *flags);
+static void markNoOpJumps(Chunk *chunk, uint8_t *flags);
+static void relaxJumps(Rewrite *rewrite);
+static void place(Rewrite *rewrite, Chunk *out);
+static void emitJump(Chunk *out, uint8_t opcode, bool isShort, int distance, int line);
+
+static void initLineCursor(LineCursor *cursor, LineArray *lines);
+static int lineAt(LineCursor *cursor, int offset);
+static const Fusion *findFusion(uint8_t first, uint8_t second);
+
+/* Threads jumps through the jumps they land on, then rewrites the chunk in
+   one pass: unreachable code and jumps to where execution goes anyway are
+   dropped, adjacent instruction pairs are replaced with their fused forms,
+   and jumps whose distance fits are shortened. Every jump is relocated to
+   where its target ends up. The code and line table are rebuilt; the
+   constant pool is shared unchanged. */
+void optimizeChunk(Chunk *chunk)
+{
+    uint8_t *flags = ALLOCATE(uint8_t, chunk->count + 1);
+    int *offsets = ALLOCATE(int, chunk->count + 1);
+
+    markInstructions(chunk, flags);
+    threadJumps(chunk, flags);
+    markReachable(chunk, flags);
+    markNoOpJumps(chunk, flags);
+
+    Rewrite rewrite;
+    rewrite.chunk = chunk;
+    rewrite.flags = flags;
+    rewrite.offsets = offsets;
+
+    /* Shortening a jump only brings targets closer, so jumps found to fit
+       with every jump long still fit once the short ones are placed. The
+       emitting pass needs the offsets of targets ahead of it, hence a
+       separate placing pass first. */
+    place(&rewrite, NULL);
+    relaxJumps(&rewrite);
+    place(&rewrite, NULL);
+
+    Chunk optimized;
+    initChunk(&optimized);
+    place(&rewrite, &optimized);
+
+    FREE_ARRAY(int, offsets, chunk->count + 1);
+    FREE_ARRAY(uint8_t, flags, chunk->count + 1);
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    freeLineArray(&chunk->lines);
+
+    chunk->code = optimized.code;
+    chunk->count = optimized.count;
+    chunk->capacity = optimized.capacity;
+    chunk->lines = optimized.lines;
+}
+
+static void markInstructions(Chunk *chunk, uint8_t *flags)
+{
+    memset(flags, 0, chunk->count + 1);
+
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        flags[offset] |= FLAG_START;
+        if (isJump(chunk->code[offset]))
+            flags[jumpTarget(chunk->code, offset)] |= FLAG_TARGET;
+    }
+}
+
+/* Jump Threading */
+
+/* Every destination is worked out from the code as the compiler wrote it
+   before any is changed, since what a jump knows about the top value holds
+   only for the paths that existed when it was worked out. */
+static void threadJumps(Chunk *chunk, uint8_t *flags)
+{
+    int *targets = ALLOCATE(int, chunk->count);
+
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        uint8_t opcode = chunk->code[offset];
+        if (opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG)
+        {
+            targets[offset] = threadTarget(chunk, offset, TOP_FALSEY);
+        }
+        else if (opcode == OP_JUMP || opcode == OP_JUMP_LONG)
+        {
+            /* Only reached by not taking the conditional jump before it */
+            bool afterTest = previous != -1 && !(flags[offset] & FLAG_TARGET) &&
+                             (chunk->code[previous] == OP_JUMP_IF_FALSE ||
+                              chunk->code[previous] == OP_JUMP_IF_FALSE_LONG);
+            targets[offset] = threadTarget(chunk, offset, afterTest ? TOP_TRUTHY : TOP_UNKNOWN);
+        }
+        previous = offset;
+    }
+
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        if (isJump(chunk->code[offset]))
+            retarget(chunk, offset, targets[offset]);
+    }
+
+    FREE_ARRAY(int, targets, chunk->count);
+}
+
+/* Follows a jump on through unconditional jumps, and through conditional
+   ones whose outcome is already known: a value that just failed a test
+   fails it again, and one that passed passes again. Jumps only go forward,
+   so the walk ends. */
+static int threadTarget(Chunk *chunk, int offset, TopKnowledge known)
+{
+    int target = jumpTarget(chunk->code, offset);
+    while (target < chunk->count)
+    {
+        uint8_t opcode = chunk->code[target];
+        bool test = opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG;
+
+        if (opcode == OP_JUMP || opcode == OP_JUMP_LONG || (test && known == TOP_FALSEY))
+            target = jumpTarget(chunk->code, target);
+        else if (test && known == TOP_TRUTHY)
+            target += opcodeLength(opcode);
+        else
+            break;
+    }
+    return target;
+}
+
+/* Rewrites the jump's distance in place, unless it does not fit */
+static void retarget(Chunk *chunk, int offset, int target)
+{
+    uint8_t *ip = &chunk->code[offset];
+    bool isLong = ip[0] == OP_JUMP_LONG || ip[0] == OP_JUMP_IF_FALSE_LONG;
+    int distance = target - offset - opcodeLength(ip[0]);
+    if (distance > (isLong ? JUMP_LONG_MAX : JUMP_MAX))
+        return;
+
+    ip[1] = (uint8_t)(distance & 0xff);
+    ip[2] = (uint8_t)((distance >> 8) & 0xff);
+    if (isLong)
+        ip[3] = (uint8_t)((distance >> 16) & 0xff);
+}
+
+/* Dead Code */
+
+/* Jumps only go forward, so one pass in code order marks every target of
+   a reachable jump before getting there. Only the targets of reachable
+   jumps stay marked as targets. */
+static void markReachable(Chunk *chunk, uint8_t *flags)
+{
+    for (int offset = 0; offset < chunk->count; offset++)
+        flags[offset] &= (uint8_t)~FLAG_TARGET;
+    if (chunk->count > 0)
+        flags[0] |= FLAG_REACHABLE;
+
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        if (!(flags[offset] & FLAG_REACHABLE))
+            continue;
+
+        uint8_t opcode = chunk->code[offset];
+        if (isJump(opcode))
+            flags[jumpTarget(chunk->code, offset)] |= FLAG_REACHABLE | FLAG_TARGET;
+
+        if (opcode != OP_JUMP && opcode != OP_JUMP_LONG && opcode != OP_RETURN)
+            flags[offset + opcodeLength(opcode)] |= FLAG_REACHABLE;
+    }
+}
+
+/* A jump over nothing but dead code goes where falling through would */
+static void markNoOpJumps(Chunk *chunk, uint8_t *flags)
+{
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        if (!(flags[offset] & FLAG_REACHABLE) || !isJump(chunk->code[offset]))
+            continue;
+
+        int next = offset + opcodeLength(chunk->code[offset]);
+        while (next < chunk->count && !(flags[next] & FLAG_REACHABLE))
+            next += opcodeLength(chunk->code[next]);
+
+        if (next == jumpTarget(chunk->code, offset))
+            flags[offset] |= FLAG_NO_OP;
+    }
+}
+
+/* Relocation */
+
+static void relaxJumps(Rewrite *rewrite)
+{
+    Chunk *chunk = rewrite->chunk;
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        if ((rewrite->flags[offset] & (FLAG_REACHABLE | FLAG_NO_OP)) != FLAG_REACHABLE ||
+            !isJump(chunk->code[offset]))
+            continue;
+
+        int end = rewrite->offsets[offset] + opcodeLength(OP_JUMP_LONG);
+        if (rewrite->offsets[jumpTarget(chunk->code, offset)] - end <= JUMP_MAX)
+            rewrite->flags[offset] |= FLAG_SHORT;
+    }
+}
+
+/* Lays the kept instructions out in order, recording where each lands, and
+   writes them to out unless it is NULL. A pair is only fused when nothing
+   jumps between the two. */
+static void place(Rewrite *rewrite, Chunk *out)
+{
+    Chunk *chunk = rewrite->chunk;
+    uint8_t *flags = rewrite->flags;
+    int *offsets = rewrite->offsets;
+
+    LineCursor cursor;
+    initLineCursor(&cursor, &chunk->lines);
+
+    int position = 0;
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        uint8_t opcode = chunk->code[offset];
+        int length = opcodeLength(opcode);
+        int next = offset + length;
+        offsets[offset] = position;
+
+        if ((flags[offset] & (FLAG_REACHABLE | FLAG_NO_OP)) != FLAG_REACHABLE)
+        {
+            offset = next;
+            continue;
+        }
+
+        if (isJump(opcode))
+        {
+            bool isShort = flags[offset] & FLAG_SHORT;
+            int jumpLength = opcodeLength(isShort ? OP_JUMP : OP_JUMP_LONG);
+            if (out != NULL)
+            {
+                int distance = offsets[jumpTarget(chunk->code, offset)] - position - jumpLength;
+                emitJump(out, opcode, isShort, distance, lineAt(&cursor, offset));
+            }
+
+            position += jumpLength;
+            offset = next;
+            continue;
+        }
+
+        if (next < chunk->count && (flags[next] & (FLAG_REACHABLE | FLAG_TARGET)) == FLAG_REACHABLE)
+        {
+            uint8_t nextOpcode = chunk->code[next];
+            const Fusion *fusion = findFusion(opcode, nextOpcode);
+            if (fusion != NULL)
+            {
+                if (out != NULL)
+                {
+                    int line = lineAt(&cursor, fusion->lineFrom == 0 ? offset : next);
+                    writeChunk(out, fusion->fused, line);
+                    for (int i = 1; i < length; i++)
+                        writeChunk(out, chunk->code[offset + i], line);
+                }
+
+                offsets[next] = position;
+                position += length;
+                offset = next + opcodeLength(nextOpcode);
+                continue;
+            }
+        }
+
+        if (out != NULL)
+        {
+            int line = lineAt(&cursor, offset);
+            for (int i = 0; i < length; i++)
+                writeChunk(out, chunk->code[offset + i], line);
+        }
+
+        position += length;
+        offset = next;
+    }
+
+    offsets[chunk->count] = position;
+}
+
+static void emitJump(Chunk *out, uint8_t opcode, bool isShort, int distance, int line)
+{
+    bool conditional = opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG;
+    if (isShort)
+        writeChunk(out, conditional ? OP_JUMP_IF_FALSE : OP_JUMP, line);
+    else
+        writeChunk(out, conditional ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_LONG, line);
+
+    writeChunk(out, (uint8_t)(distance & 0xff), line);
+    writeChunk(out, (uint8_t)((distance >> 8) & 0xff), line);
+    if (!isShort)
+        writeChunk(out, (uint8_t)((distance >> 16) & 0xff), line);
+}
+
+static const Fusion *findFusion(uint8_t first, uint8_t second)
+{
+    for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++)
+    {
+        if (fusions[i].first == first && fusions[i].second == second)
+            return &fusions[i];
+    }
+    return NULL;
+}
+
+static void initLineCursor(LineCursor *cursor, LineArray *lines)
+{
+    cursor->lines = lines;
+    cursor->run = 0;
+    cursor->end = lines->count > 0 ? lines->lines[0] : 0;
+}
+
+static int lineAt(LineCursor *cursor, int offset)
+{
+    while (offset >= cursor->end && cursor->run + 2 < cursor->lines->count)
+    {
+        cursor->run += 2;
+        cursor->end += cursor->lines->lines[cursor->run];
+    }
+    return cursor->lines->lines[cursor->run + 1];
+}
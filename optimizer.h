@@ -0,0 +1,8 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk *chunk);
+
+#endif
@@ -0,0 +1,564 @@
+#include "register.h"
+#include "memory.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+/* Symbolic value of one stack slot while lowering: either already in the
+   slot's register, or a constant that has not been materialized. */
+typedef struct
+{
+    bool isConstant;
+    int index;
+} Operand;
+
+/* A jump emitted before its target was reached: where its distance goes
+   in the output, and the stack offset and depth it lands with */
+typedef struct
+{
+    int site;
+    int target;
+    int depth;
+} PendingJump;
+
+typedef struct
+{
+    Chunk *source;
+    RegChunk *out;
+    Operand stack[REGISTER_MAX];
+    int depth;
+    /* Pool slots given to nil, false and true, or -1 */
+    int literals[3];
+    int line;
+    bool failed;
+
+    PendingJump *jumps;
+    int jumpCount;
+    int jumpCapacity;
+    /* False after an unconditional jump, until a jump lands */
+    bool reachable;
+} Lowering;
+
+static void emit(Lowering *lowering, uint8_t byte);
+static uint8_t operandByte(Operand operand);
+static void pushConstant(Lowering *lowering, int constant);
+static void pushLiteral(Lowering *lowering, int literal, Value value);
+static Operand popOperand(Lowering *lowering);
+static int pushTarget(Lowering *lowering);
+static void lowerUnary(Lowering *lowering, RegOpCode opcode);
+static void lowerBinary(Lowering *lowering, RegOpCode opcode);
+static void pick(Lowering *lowering, int distance);
+static void slide(Lowering *lowering, int dropped);
+static void getLocal(Lowering *lowering, int slot);
+static void setLocal(Lowering *lowering, int slot);
+static void popOperands(Lowering *lowering, int count);
+static void flushStack(Lowering *lowering);
+static void lowerJump(Lowering *lowering, int offset);
+static void landJumps(Lowering *lowering, int offset);
+
+void initRegChunk(RegChunk *chunk)
+{
+    chunk->code = NULL;
+    chunk->capacity = 0;
+    chunk->count = 0;
+    chunk->registerCount = 0;
+
+    initLineArray(&chunk->lines);
+    initValueArray(&chunk->constants);
+}
+
+void writeRegChunk(RegChunk *chunk, uint8_t byte, int line)
+{
+    if (chunk->count + 1 >= chunk->capacity)
+    {
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+    }
+
+    writeLineArray(&chunk->lines, line);
+
+    chunk->code[chunk->count] = byte;
+    chunk->count++;
+}
+
+void freeRegChunk(RegChunk *chunk)
+{
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+
+    freeValueArray(&chunk->constants);
+    freeLineArray(&chunk->lines);
+
+    initRegChunk(chunk);
+}
+
+int regOpcodeLength(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case ROP_LOADK:
+    case ROP_JUMP_IF_FALSE:
+        return 5;
+    case ROP_RETURN:
+        return 2;
+    case ROP_MOVE:
+    case ROP_NEGATE:
+    case ROP_NOT:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+/* Translates a finished stack chunk into three-address code. Stack slot i
+   becomes register i, and constants are folded into the operands that use
+   them instead of being pushed. Returns false when the chunk needs more
+   registers (or has an instruction) the register backend cannot express. */
+bool lowerToRegisters(Chunk *chunk, RegChunk *out)
+{
+    Lowering lowering;
+    lowering.source = chunk;
+    lowering.out = out;
+    lowering.depth = 0;
+    lowering.failed = false;
+    for (int i = 0; i < 3; i++)
+        lowering.literals[i] = -1;
+    lowering.jumps = NULL;
+    lowering.jumpCount = 0;
+    lowering.jumpCapacity = 0;
+    lowering.reachable = true;
+
+    for (int i = 0; i < chunk->constants.count; i++)
+        writeValueArray(&out->constants, chunk->constants.values[i]);
+
+    int offset = 0;
+    while (offset < chunk->count && !lowering.failed)
+    {
+        int instruction = offset;
+        lowering.line = getLine(&chunk->lines, &instruction);
+        landJumps(&lowering, offset);
+
+        uint8_t *code = &chunk->code[offset];
+        switch (code[0])
+        {
+        case OP_CONSTANT:
+            pushConstant(&lowering, code[1]);
+            break;
+        case OP_CONSTANT_LONG:
+            pushConstant(&lowering, code[1] | (code[2] << 8) | (code[3] << 16));
+            break;
+        case OP_NIL:
+            pushLiteral(&lowering, 0, NIL_VAL);
+            break;
+        case OP_FALSE:
+            pushLiteral(&lowering, 1, BOOL_VAL(false));
+            break;
+        case OP_TRUE:
+            pushLiteral(&lowering, 2, BOOL_VAL(true));
+            break;
+
+        case OP_PICK:
+            pick(&lowering, code[1]);
+            break;
+        case OP_SLIDE:
+            slide(&lowering, code[1]);
+            break;
+        case OP_POP:
+            popOperand(&lowering);
+            break;
+        case OP_POPN:
+            popOperands(&lowering, code[1]);
+            break;
+        case OP_GET_LOCAL:
+            getLocal(&lowering, code[1]);
+            break;
+        case OP_SET_LOCAL:
+            setLocal(&lowering, code[1]);
+            break;
+
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            lowerJump(&lowering, offset);
+            break;
+
+        case OP_NEGATE:
+        case OP_NEGATE_N:
+            lowerUnary(&lowering, ROP_NEGATE);
+            break;
+        case OP_NOT:
+            lowerUnary(&lowering, ROP_NOT);
+            break;
+
+        case OP_ADD:
+        case OP_ADD_NN:
+            lowerBinary(&lowering, ROP_ADD);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NN:
+            lowerBinary(&lowering, ROP_SUBTRACT);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NN:
+            lowerBinary(&lowering, ROP_MULTIPLY);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NN:
+            lowerBinary(&lowering, ROP_DIVIDE);
+            break;
+        case OP_EQUAL:
+            lowerBinary(&lowering, ROP_EQUAL);
+            break;
+        case OP_NOT_EQUAL:
+            lowerBinary(&lowering, ROP_NOT_EQUAL);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NN:
+            lowerBinary(&lowering, ROP_GREATER);
+            break;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NN:
+            lowerBinary(&lowering, ROP_GREATER_EQUAL);
+            break;
+        case OP_LESS:
+        case OP_LESS_NN:
+            lowerBinary(&lowering, ROP_LESS);
+            break;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NN:
+            lowerBinary(&lowering, ROP_LESS_EQUAL);
+            break;
+
+        case OP_ADD_CONSTANT:
+        case OP_ADD_CONSTANT_NN:
+            pushConstant(&lowering, code[1]);
+            lowerBinary(&lowering, ROP_ADD);
+            break;
+
+        case OP_RETURN:
+        {
+            Operand result = popOperand(&lowering);
+            emit(&lowering, ROP_RETURN);
+            emit(&lowering, operandByte(result));
+            break;
+        }
+
+        default:
+            lowering.failed = true;
+            break;
+        }
+
+        offset += opcodeLength(code[0]);
+    }
+
+    FREE_ARRAY(PendingJump, lowering.jumps, lowering.jumpCapacity);
+
+#ifdef DEBUG_PRINT_CODE
+    if (!lowering.failed)
+        disassembleRegChunk(out, "registers");
+#endif
+
+    return !lowering.failed;
+}
+
+static void emit(Lowering *lowering, uint8_t byte)
+{
+    writeRegChunk(lowering->out, byte, lowering->line);
+}
+
+static uint8_t operandByte(Operand operand)
+{
+    return operand.isConstant ? (uint8_t)(RK_CONSTANT | operand.index) : (uint8_t)operand.index;
+}
+
+/* Returns the register that a value pushed now would live in */
+static int pushTarget(Lowering *lowering)
+{
+    if (lowering->depth >= REGISTER_MAX)
+    {
+        lowering->failed = true;
+        return lowering->depth - 1;
+    }
+
+    int target = lowering->depth++;
+    if (lowering->depth > lowering->out->registerCount)
+        lowering->out->registerCount = lowering->depth;
+    return target;
+}
+
+/* Constants that fit an RK byte stay symbolic; others are loaded into the
+   register of the slot they are pushed to. */
+static void pushConstant(Lowering *lowering, int constant)
+{
+    int target = pushTarget(lowering);
+    Operand *operand = &lowering->stack[target];
+
+    if (constant <= RK_MAX)
+    {
+        operand->isConstant = true;
+        operand->index = constant;
+        return;
+    }
+
+    emit(lowering, ROP_LOADK);
+    emit(lowering, (uint8_t)target);
+    emit(lowering, (uint8_t)(constant & 0xff));
+    emit(lowering, (uint8_t)((constant >> 8) & 0xff));
+    emit(lowering, (uint8_t)((constant >> 16) & 0xff));
+
+    operand->isConstant = false;
+    operand->index = target;
+}
+
+/* nil, true and false have no pool slot in the stack chunk */
+static void pushLiteral(Lowering *lowering, int literal, Value value)
+{
+    if (lowering->literals[literal] == -1)
+    {
+        writeValueArray(&lowering->out->constants, value);
+        lowering->literals[literal] = lowering->out->constants.count - 1;
+    }
+
+    pushConstant(lowering, lowering->literals[literal]);
+}
+
+static Operand popOperand(Lowering *lowering)
+{
+    if (lowering->depth == 0)
+    {
+        Operand none = {true, 0};
+        lowering->failed = true;
+        return none;
+    }
+    return lowering->stack[--lowering->depth];
+}
+
+static void lowerUnary(Lowering *lowering, RegOpCode opcode)
+{
+    Operand operand = popOperand(lowering);
+    int target = pushTarget(lowering);
+
+    emit(lowering, opcode);
+    emit(lowering, (uint8_t)target);
+    emit(lowering, operandByte(operand));
+
+    lowering->stack[target].isConstant = false;
+    lowering->stack[target].index = target;
+}
+
+static void lowerBinary(Lowering *lowering, RegOpCode opcode)
+{
+    Operand b = popOperand(lowering);
+    Operand a = popOperand(lowering);
+    int target = pushTarget(lowering);
+
+    emit(lowering, opcode);
+    emit(lowering, (uint8_t)target);
+    emit(lowering, operandByte(a));
+    emit(lowering, operandByte(b));
+
+    lowering->stack[target].isConstant = false;
+    lowering->stack[target].index = target;
+}
+
+/* The copy names the same register or constant as the original. That
+   register is safe to read for as long as the copy lives, since its slot
+   lies below the copy and cannot be reused until the copy is popped. */
+static void pick(Lowering *lowering, int distance)
+{
+    if (distance >= lowering->depth)
+    {
+        lowering->failed = true;
+        return;
+    }
+
+    Operand operand = lowering->stack[lowering->depth - 1 - distance];
+    int target = pushTarget(lowering);
+    lowering->stack[target] = operand;
+}
+
+/* The surviving value moves into the lowest dropped slot's register, so
+   nothing refers to the registers that are freed. */
+static void slide(Lowering *lowering, int dropped)
+{
+    if (dropped == 0)
+        return;
+    if (dropped >= lowering->depth)
+    {
+        lowering->failed = true;
+        return;
+    }
+
+    Operand top = popOperand(lowering);
+    lowering->depth -= dropped;
+    int target = pushTarget(lowering);
+
+    if (top.isConstant)
+    {
+        lowering->stack[target] = top;
+        return;
+    }
+
+    emit(lowering, ROP_MOVE);
+    emit(lowering, (uint8_t)target);
+    emit(lowering, operandByte(top));
+
+    lowering->stack[target].isConstant = false;
+    lowering->stack[target].index = target;
+}
+
+/* A local is a slot like any other, addressed from the bottom */
+static void getLocal(Lowering *lowering, int slot)
+{
+    if (slot >= lowering->depth)
+    {
+        lowering->failed = true;
+        return;
+    }
+
+    pick(lowering, lowering->depth - 1 - slot);
+}
+
+/* Assigning is the one write into a register below the top, so copies
+   that still name the local's register get registers of their own first */
+static void setLocal(Lowering *lowering, int slot)
+{
+    if (slot >= lowering->depth - 1)
+    {
+        lowering->failed = true;
+        return;
+    }
+
+    for (int i = slot + 1; i < lowering->depth; i++)
+    {
+        Operand *operand = &lowering->stack[i];
+        if (operand->isConstant || operand->index != slot)
+            continue;
+
+        emit(lowering, ROP_MOVE);
+        emit(lowering, (uint8_t)i);
+        emit(lowering, (uint8_t)slot);
+        operand->index = i;
+    }
+
+    Operand value = lowering->stack[lowering->depth - 1];
+    emit(lowering, ROP_MOVE);
+    emit(lowering, (uint8_t)slot);
+    emit(lowering, operandByte(value));
+
+    lowering->stack[slot].isConstant = false;
+    lowering->stack[slot].index = slot;
+}
+
+static void popOperands(Lowering *lowering, int count)
+{
+    if (count > lowering->depth)
+    {
+        lowering->failed = true;
+        return;
+    }
+
+    lowering->depth -= count;
+}
+
+/* Puts every slot's value in the slot's own register. Paths that meet
+   after a jump may have left different constants and copies behind, so
+   each jump and each instruction jumped to starts from this one layout. */
+static void flushStack(Lowering *lowering)
+{
+    for (int i = 0; i < lowering->depth; i++)
+    {
+        Operand *operand = &lowering->stack[i];
+        if (!operand->isConstant && operand->index == i)
+            continue;
+
+        emit(lowering, ROP_MOVE);
+        emit(lowering, (uint8_t)i);
+        emit(lowering, operandByte(*operand));
+        operand->isConstant = false;
+        operand->index = i;
+    }
+}
+
+/* The distance is patched in by landJumps() once the target is reached */
+static void lowerJump(Lowering *lowering, int offset)
+{
+    uint8_t opcode = lowering->source->code[offset];
+    bool conditional = opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG;
+    if (conditional && lowering->depth == 0)
+    {
+        lowering->failed = true;
+        return;
+    }
+
+    flushStack(lowering);
+    if (conditional)
+    {
+        emit(lowering, ROP_JUMP_IF_FALSE);
+        emit(lowering, (uint8_t)(lowering->depth - 1));
+    }
+    else
+    {
+        emit(lowering, ROP_JUMP);
+        lowering->reachable = false;
+    }
+
+    if (lowering->jumpCount + 1 > lowering->jumpCapacity)
+    {
+        int oldCapacity = lowering->jumpCapacity;
+        lowering->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        lowering->jumps = GROW_ARRAY(PendingJump, lowering->jumps, oldCapacity, lowering->jumpCapacity);
+    }
+
+    PendingJump *jump = &lowering->jumps[lowering->jumpCount++];
+    jump->site = lowering->out->count;
+    jump->target = jumpTarget(lowering->source->code, offset);
+    jump->depth = lowering->depth;
+
+    for (int i = 0; i < 3; i++)
+        emit(lowering, 0);
+}
+
+/* Jumps only go forward, so every jump to offset has been emitted by the
+   time it is reached */
+static void landJumps(Lowering *lowering, int offset)
+{
+    bool landed = false;
+    for (int i = 0; i < lowering->jumpCount; i++)
+    {
+        PendingJump *jump = &lowering->jumps[i];
+        if (jump->target != offset)
+            continue;
+
+        if (!landed && lowering->reachable)
+            flushStack(lowering);
+        landed = true;
+
+        int distance = lowering->out->count - (jump->site + 3);
+        if (distance > 0xffffff || (lowering->reachable && jump->depth != lowering->depth))
+        {
+            lowering->failed = true;
+            return;
+        }
+
+        uint8_t *site = &lowering->out->code[jump->site];
+        site[0] = (uint8_t)(distance & 0xff);
+        site[1] = (uint8_t)((distance >> 8) & 0xff);
+        site[2] = (uint8_t)((distance >> 16) & 0xff);
+
+        if (!lowering->reachable)
+        {
+            lowering->depth = jump->depth;
+            for (int slot = 0; slot < lowering->depth; slot++)
+            {
+                lowering->stack[slot].isConstant = false;
+                lowering->stack[slot].index = slot;
+            }
+            lowering->reachable = true;
+        }
+
+        lowering->jumps[i--] = lowering->jumps[--lowering->jumpCount];
+    }
+}
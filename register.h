@@ -0,0 +1,67 @@
+#ifndef REGISTER_H
+#define REGISTER_H
+
+#include "common.h"
+#include "chunk.h"
+
+/* Operands of three-address instructions are "RK" bytes: a register number,
+   or a constant pool index when RK_CONSTANT is set. */
+#define RK_CONSTANT 0x80
+#define RK_MAX      0x7f
+
+#define REGISTER_MAX (RK_MAX + 1)
+
+typedef enum
+{
+    /* LOADK A idx24: A = K[idx] for constants beyond the RK range */
+    ROP_LOADK,
+    /* MOVE A B: A = RK(B) */
+    ROP_MOVE,
+
+    /* Unary: A = op RK(B) */
+    ROP_NEGATE,
+    ROP_NOT,
+
+    /* Binary: A = RK(B) op RK(C) */
+    ROP_ADD,
+    ROP_SUBTRACT,
+    ROP_MULTIPLY,
+    ROP_DIVIDE,
+    ROP_EQUAL,
+    ROP_NOT_EQUAL,
+    ROP_GREATER,
+    ROP_GREATER_EQUAL,
+    ROP_LESS,
+    ROP_LESS_EQUAL,
+
+    /* JUMP d24: skips d bytes forward. JUMP_IF_FALSE A d24: does the same
+       when RK(A) is falsey. */
+    ROP_JUMP,
+    ROP_JUMP_IF_FALSE,
+
+    /* RETURN A: result is RK(A) */
+    ROP_RETURN
+} RegOpCode;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    LineArray lines;
+
+    ValueArray constants;
+
+    /* Number of registers the code touches */
+    int registerCount;
+} RegChunk;
+
+void initRegChunk(RegChunk *chunk);
+void writeRegChunk(RegChunk *chunk, uint8_t byte, int line);
+void freeRegChunk(RegChunk *chunk);
+int regOpcodeLength(uint8_t opcode);
+
+bool lowerToRegisters(Chunk *chunk, RegChunk *out);
+
+#endif
@@ -5,94 +5,92 @@
 #include "scanner.h"
 #include "token.h"
 
-Scanner scanner;
-
 /* Token generators */
-static Token createToken(TokenType type);
-static Token numberToken();
-static Token stringToken();
-static Token identifierToken();
-static Token errorToken(const char* errorMessage);
+static Token createToken(Scanner *scanner, TokenType type);
+static Token numberToken(Scanner *scanner);
+static Token stringToken(Scanner *scanner);
+static Token identifierToken(Scanner *scanner);
+static Token errorToken(Scanner *scanner, const char* errorMessage);
 
 /* Utils functions */
-static char advance(int steps);
-static bool isEnd();
-static char peekForward(int skip);
-static char peek();
+static char advance(Scanner *scanner, int steps);
+static bool isEnd(Scanner *scanner);
+static char peekForward(Scanner *scanner, int skip);
+static char peek(Scanner *scanner);
 
-static bool isMatch(char expected);
+static bool isMatch(Scanner *scanner, char expected);
 static bool isDigit(char character);
 static bool isChar(char character);
 
-static void skipWhitespace();
-static void skipComment();
+static void skipWhitespace(Scanner *scanner);
+static bool skipComment(Scanner *scanner);
 
-static bool checkKeyword(int start, int length, const char *rest);
-static TokenType identifyType();
+static bool checkKeyword(Scanner *scanner, int start, int length, const char *rest);
+static TokenType identifyType(Scanner *scanner);
 
-void initScanner(const char *src)
+void initScanner(Scanner *scanner, const char *src)
 {
-    scanner.left = src;
-    scanner.right = src;
-    scanner.line = 1;
+    scanner->left = src;
+    scanner->right = src;
+    scanner->line = 1;
 }
 
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-    skipWhitespace();
-    scanner.left = scanner.right;
+    skipWhitespace(scanner);
+    scanner->left = scanner->right;
 
-    if (isEnd()) 
-        return createToken(TOKEN_EOF);
+    if (isEnd(scanner)) 
+        return createToken(scanner, TOKEN_EOF);
     
-    char c = advance(1);
+    char c = advance(scanner, 1);
 
     if (isDigit(c))
-        return numberToken();
+        return numberToken(scanner);
 
     if (isChar(c))
-        return identifierToken();
+        return identifierToken(scanner);
 
 
     switch (c) 
     {
-        case '(': return createToken(TOKEN_LEFT_PAREN);
-        case ')': return createToken(TOKEN_RIGHT_PAREN);
-        case '{': return createToken(TOKEN_LEFT_BRACE);
-        case '}': return createToken(TOKEN_RIGHT_BRACE);
-        case ';': return createToken(TOKEN_SEMICOLON);
-        case ',': return createToken(TOKEN_COMMA);
-        case '.': return createToken(TOKEN_DOT);
-        case '-': return createToken(TOKEN_MINUS);
-        case '+': return createToken(TOKEN_PLUS);
-        case '/': return createToken(TOKEN_SLASH);
-        case '*': return createToken(TOKEN_STAR);
+        case '(': return createToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return createToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return createToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return createToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return createToken(scanner, TOKEN_SEMICOLON);
+        case ',': return createToken(scanner, TOKEN_COMMA);
+        case '.': return createToken(scanner, TOKEN_DOT);
+        case '-': return createToken(scanner, TOKEN_MINUS);
+        case '+': return createToken(scanner, TOKEN_PLUS);
+        case '/': return createToken(scanner, TOKEN_SLASH);
+        case '*': return createToken(scanner, TOKEN_STAR);
         case '"':
-            return stringToken();
+            return stringToken(scanner);
         case '!':
-            return createToken(isMatch('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return createToken(scanner, isMatch(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return createToken(isMatch('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return createToken(scanner, isMatch(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return createToken(isMatch('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return createToken(scanner, isMatch(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return createToken(isMatch('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return createToken(scanner, isMatch(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
 
-static bool isEnd()
+static bool isEnd(Scanner *scanner)
 {
-    return *scanner.right == '\0';
+    return *scanner->right == '\0';
 }
 
-static bool isMatch(char expected)
+static bool isMatch(Scanner *scanner, char expected)
 {
-    if (isEnd() || *scanner.right != expected)
+    if (isEnd(scanner) || *scanner->right != expected)
         return false;
 
-    scanner.right++;
+    scanner->right++;
     return true;
 }
 
@@ -106,25 +104,25 @@ static bool isChar(char character)
     return (character >= 'a' && character <= 'z') || (character >= 'A' && character <= 'Z') || (character == '_');
 }
 
-static char advance(int steps) 
+static char advance(Scanner *scanner, int steps) 
 {
-    while (steps > 0 && !isEnd()) {
-        scanner.right++;
+    while (steps > 0 && !isEnd(scanner)) {
+        scanner->right++;
         steps--;
     }
     
-    return scanner.right[-1];
+    return scanner->right[-1];
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-    return *scanner.right;
+    return *scanner->right;
 }
 
 
-static char peekForward(int skip)
+static char peekForward(Scanner *scanner, int skip)
 {
-    const char *curr = scanner.right;
+    const char *curr = scanner->right;
     for (int i = 0; i < skip; ++i, ++curr)
     {   
         if (*curr == '\0')
@@ -134,11 +132,11 @@ static char peekForward(int skip)
     return *curr;
 }
 
-static void skipWhitespace()
+static void skipWhitespace(Scanner *scanner)
 {
     for (;;)
     {
-        char c = peek();
+        char c = peek(scanner);
         switch(c)
         {
             case ' ':
@@ -147,14 +145,15 @@ static void skipWhitespace()
             case '\n':
             {
                 if (c == '\n')
-                    scanner.line++;
+                    scanner->line++;
 
-                advance(1);
+                advance(scanner, 1);
                 break;
             }
 
             case '/':
-                skipComment();
+                if (!skipComment(scanner))
+                    return;
                 break;
             default:
                 return;
@@ -162,115 +161,119 @@ static void skipWhitespace()
     }
 }
 
-static void skipComment() {
-    const char next = peekForward(1);
+static bool skipComment(Scanner *scanner) {
+    const char next = peekForward(scanner, 1);
     if (next != '/' && next != '*')
-        return;
+        return false;
 
     bool multiline = next == '*';
-    advance(2);
+    advance(scanner, 2);
 
-    while (!isEnd()) {
+    while (!isEnd(scanner)) {
         if (multiline) {
-            if (peekForward(1) == '*' && peekForward(2) == '/') {
-                advance(3);
-                scanner.line++;
-                return;
-            } else if (peekForward(1) == '\n') {
-                scanner.line++;
+            if (peekForward(scanner, 1) == '*' && peekForward(scanner, 2) == '/') {
+                advance(scanner, 3);
+                scanner->line++;
+                return true;
+            } else if (peekForward(scanner, 1) == '\n') {
+                scanner->line++;
             }
         } else {
-            if (peekForward(1) == '\n') {
-                advance(1);
-                return;
+            if (peekForward(scanner, 1) == '\n') {
+                advance(scanner, 1);
+                return true;
             }
         }
 
-        advance(1);
+        advance(scanner, 1);
     }
+
+    return true;
 }
 
-static Token createToken(TokenType type)
+static Token createToken(Scanner *scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.left;
-    token.length = (int)(scanner.right - scanner.left);
-    token.line = scanner.line;
+    token.start = scanner->left;
+    token.length = (int)(scanner->right - scanner->left);
+    token.line = scanner->line;
     return token;
 }
 
-static Token stringToken()
+static Token stringToken(Scanner *scanner)
 {
-    char curr = peek();
-    while (!isEnd() && curr != '"')
+    char curr = peek(scanner);
+    while (!isEnd(scanner) && curr != '"')
     {   
         if (curr == '\n')
-            scanner.line++;
+            scanner->line++;
 
-        advance(1);
+        advance(scanner, 1);
+        curr = peek(scanner);
     }
 
-    if (isEnd())
-        return errorToken("Unterminated string.");
+    if (isEnd(scanner))
+        return errorToken(scanner, "Unterminated string.");
 
-    advance(1); // closing "
-    return createToken(TOKEN_STRING);
+    advance(scanner, 1); // closing "
+    return createToken(scanner, TOKEN_STRING);
 }
 
-static Token numberToken()
+static Token numberToken(Scanner *scanner)
 {
-    while (isDigit(peek()))
-        advance(1);
+    while (isDigit(peek(scanner)))
+        advance(scanner, 1);
 
-    if (peek() == '.' && isDigit(peekForward(1))) // check for decimal number
+    if (peek(scanner) == '.' && isDigit(peekForward(scanner, 1))) // check for decimal number
     {
-        advance(1);
-        while (isDigit(peek()))
-            advance(1);
+        advance(scanner, 1);
+        while (isDigit(peek(scanner)))
+            advance(scanner, 1);
     }
 
-    return createToken(TOKEN_NUMBER);
+    return createToken(scanner, TOKEN_NUMBER);
 }
 
-static TokenType identifyType() 
+static TokenType identifyType(Scanner *scanner) 
 {
-    switch (scanner.left[0]) 
+    switch (scanner->left[0]) 
     {
-        case 'a': return checkKeyword(1, 2, "nd") ? TOKEN_AND : TOKEN_IDENTIFIER;
-        case 'c': return checkKeyword(1, 4, "lass") ? TOKEN_CLASS : TOKEN_IDENTIFIER;
-        case 'e': return checkKeyword(1, 3, "lse") ? TOKEN_ELSE : TOKEN_IDENTIFIER;
-        case 'i': return checkKeyword(1, 1, "f") ? TOKEN_IF : TOKEN_IDENTIFIER;
-        case 'n': return checkKeyword(1, 2, "il") ? TOKEN_NIL : TOKEN_IDENTIFIER;
-        case 'o': return checkKeyword(1, 1, "r") ? TOKEN_OR : TOKEN_IDENTIFIER;
-        case 'p': return checkKeyword(1, 4, "rint") ? TOKEN_PRINT : TOKEN_IDENTIFIER;
-        case 'r': return checkKeyword(1, 5, "eturn") ? TOKEN_RETURN : TOKEN_IDENTIFIER;
-        case 's': return checkKeyword(1, 4, "uper") ? TOKEN_SUPER : TOKEN_IDENTIFIER;
-        case 'v': return checkKeyword(1, 2, "ar") ? TOKEN_VAR : TOKEN_IDENTIFIER;
-        case 'w': return checkKeyword(1, 4, "hile") ? TOKEN_WHILE : TOKEN_IDENTIFIER;
+        case 'a': return checkKeyword(scanner, 1, 2, "nd") ? TOKEN_AND : TOKEN_IDENTIFIER;
+        case 'c': return checkKeyword(scanner, 1, 4, "lass") ? TOKEN_CLASS : TOKEN_IDENTIFIER;
+        case 'e': return checkKeyword(scanner, 1, 3, "lse") ? TOKEN_ELSE : TOKEN_IDENTIFIER;
+        case 'i': return checkKeyword(scanner, 1, 1, "f") ? TOKEN_IF : TOKEN_IDENTIFIER;
+        case 'n': return checkKeyword(scanner, 1, 2, "il") ? TOKEN_NIL : TOKEN_IDENTIFIER;
+        case 'o': return checkKeyword(scanner, 1, 1, "r") ? TOKEN_OR : TOKEN_IDENTIFIER;
+        case 'p': return checkKeyword(scanner, 1, 4, "rint") ? TOKEN_PRINT : TOKEN_IDENTIFIER;
+        case 'r': return checkKeyword(scanner, 1, 5, "eturn") ? TOKEN_RETURN : TOKEN_IDENTIFIER;
+        case 's': return checkKeyword(scanner, 1, 4, "uper") ? TOKEN_SUPER : TOKEN_IDENTIFIER;
+        case 'v': return checkKeyword(scanner, 1, 2, "ar") ? TOKEN_VAR : TOKEN_IDENTIFIER;
+        case 'w': return checkKeyword(scanner, 1, 4, "hile") ? TOKEN_WHILE : TOKEN_IDENTIFIER;
         case 'f': 
         {
-            if (scanner.right - scanner.left > 1)
+            if (scanner->right - scanner->left > 1)
             {
-                switch (scanner.left[1])
+                switch (scanner->left[1])
                 {
-                    case 'a': return checkKeyword(2, 3, "lse") ? TOKEN_FALSE : TOKEN_IDENTIFIER;
-                    case 'o': return checkKeyword(2, 1, "r") ? TOKEN_FOR : TOKEN_IDENTIFIER;
-                    case 'u': return checkKeyword(2, 2, "un") ? TOKEN_FUN : TOKEN_IDENTIFIER;
+                    case 'a': return checkKeyword(scanner, 2, 3, "lse") ? TOKEN_FALSE : TOKEN_IDENTIFIER;
+                    case 'o': return checkKeyword(scanner, 2, 1, "r") ? TOKEN_FOR : TOKEN_IDENTIFIER;
+                    case 'u': return checkKeyword(scanner, 2, 2, "un") ? TOKEN_FUN : TOKEN_IDENTIFIER;
                 }
             }
             break;
         }
         case 't':
         {
-            if (scanner.right - scanner.left > 1)
+            if (scanner->right - scanner->left > 1)
             {
-                switch (scanner.left[1])
+                switch (scanner->left[1])
                 {
-                    case 'h': return checkKeyword(2, 2, "is") ? TOKEN_THIS : TOKEN_IDENTIFIER;
-                    case 'r': return checkKeyword(2, 2, "ue") ? TOKEN_TRUE : TOKEN_IDENTIFIER;
+                    case 'h': return checkKeyword(scanner, 2, 2, "is") ? TOKEN_THIS : TOKEN_IDENTIFIER;
+                    case 'r': return checkKeyword(scanner, 2, 2, "ue") ? TOKEN_TRUE : TOKEN_IDENTIFIER;
                     }
             }
+            break;
         }
         default:
             return TOKEN_IDENTIFIER;
@@ -279,33 +282,33 @@ static TokenType identifyType()
     return TOKEN_IDENTIFIER;
 }
 
-static bool checkKeyword(int start, int length, const char *rest)
+static bool checkKeyword(Scanner *scanner, int start, int length, const char *rest)
 {
-    if (scanner.right - scanner.left == start + length &&
-        memcmp(scanner.left + start, rest, length) == 0)
+    if (scanner->right - scanner->left == start + length &&
+        memcmp(scanner->left + start, rest, length) == 0)
         return true;
 
     return false;
 }
 
-static Token identifierToken()
+static Token identifierToken(Scanner *scanner)
 {
-    char curr = peek();
+    char curr = peek(scanner);
     while (isChar(curr) || isDigit(curr)) 
     {
-        advance(1);
-        curr = peek();
+        advance(scanner, 1);
+        curr = peek(scanner);
     }
 
-    return createToken(identifyType());
+    return createToken(scanner, identifyType(scanner));
 }
 
-static Token errorToken(const char* errorMessage)
+static Token errorToken(Scanner *scanner, const char* errorMessage)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = errorMessage;
     token.length = (int)strlen(errorMessage);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
\ No newline at end of file
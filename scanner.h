@@ -10,7 +10,7 @@ typedef struct
     int line;
 } Scanner;
 
-void initScanner(const char *src);
-Token scanToken();
+void initScanner(Scanner *scanner, const char *src);
+Token scanToken(Scanner *scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+#include "vm.h"
+
+#define ROWS 600
+
+/* Expressions whose batch results must match a scalar run of every row */
+static const char *const agreeing[] = {
+    "x + y * 2 - x / (y - 0.5)",
+    "x < y",
+    "!(x >= y) == (x != y)",
+    "-x * -0",
+    "x > 0 and y > 1",
+    "x > 0 or y <= 1",
+    "(x < y and x > -2) or (y == 0 and x != 0)",
+    "x and y and x + y",
+    "!x or !y",
+    "(x >= 0 or y >= 0) == (y < 0 and x < 0)",
+    "x != x or y / x > 1 and y < 0",
+    "(x or y) * 2 - (x and y)",
+    "nil",
+    "x == nil or y",
+};
+
+/* Rows take different sides of an and/or whose operands differ in type */
+static const char *const failing[] = {
+    "x > 0 or 5",
+    "y < 1 and nil",
+};
+
+static const char *const names[] = {"x", "y"};
+
+static bool checkAgreeing(const char *src, const double *const *columns);
+static bool checkFailing(const char *src, const double *const *columns);
+static double scalarResult(Value value);
+
+/* Compares executeBatch() with one vmExecute() per row, over rows that
+   include NaN, infinities and both zeros; prints what disagrees */
+int main(void)
+{
+    static const double values[] = {0.0, -0.0, 1.5, -3, INFINITY, -INFINITY, NAN, 2, 0.5, 1};
+    static double x[ROWS], y[ROWS];
+    int count = sizeof(values) / sizeof(values[0]);
+    for (int row = 0; row < ROWS; row++)
+    {
+        x[row] = values[row % count];
+        y[row] = values[(row / count + row * 3) % count];
+    }
+    const double *const columns[] = {x, y};
+
+    initVM();
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(agreeing) / sizeof(agreeing[0]); i++)
+        passed &= checkAgreeing(agreeing[i], columns);
+    for (size_t i = 0; i < sizeof(failing) / sizeof(failing[0]); i++)
+        passed &= checkFailing(failing[i], columns);
+    freeVM();
+
+    return passed ? 0 : 1;
+}
+
+static bool checkAgreeing(const char *src, const double *const *columns)
+{
+    Prepared *prepared = prepareInputs(src, BACKEND_STACK, names, 2);
+    if (prepared == NULL)
+    {
+        printf("'%s' does not compile.\n", src);
+        return false;
+    }
+
+    static double output[ROWS];
+    bool passed = executeBatch(prepared, columns, ROWS, output) == INTERPRET_OK;
+    if (!passed)
+        printf("'%s' fails in a batch.\n", src);
+
+    for (int row = 0; passed && row < ROWS; row++)
+    {
+        Value inputs[] = {NUMBER_VAL(columns[0][row]), NUMBER_VAL(columns[1][row])};
+        Value result;
+        bindInputs(inputs);
+        if (execute(prepared, &result) != INTERPRET_OK)
+        {
+            printf("'%s' fails on row %d.\n", src, row);
+            passed = false;
+            break;
+        }
+
+        double expected = scalarResult(result);
+        bool same = isnan(expected) ? isnan(output[row])
+                                    : memcmp(&expected, &output[row], sizeof(double)) == 0;
+        if (!same)
+        {
+            printf("'%s' gives %g on row %d, not %g.\n", src, output[row], row, expected);
+            passed = false;
+        }
+    }
+
+    release(prepared);
+    return passed;
+}
+
+static bool checkFailing(const char *src, const double *const *columns)
+{
+    Prepared *prepared = prepareInputs(src, BACKEND_STACK, names, 2);
+    if (prepared == NULL)
+    {
+        printf("'%s' does not compile.\n", src);
+        return false;
+    }
+
+    static double output[ROWS];
+    bool passed = executeBatch(prepared, columns, ROWS, output) == INTERPRET_RUNTIME_ERROR;
+    if (!passed)
+        printf("'%s' does not fail in a batch.\n", src);
+
+    release(prepared);
+    return passed;
+}
+
+/* The value executeBatch() writes for a scalar result */
+static double scalarResult(Value value)
+{
+    if (IS_BOOL(value))
+        return AS_BOOL(value) ? 1 : 0;
+    if (IS_NIL(value))
+        return NAN;
+    return AS_NUMBER(value);
+}
@@ -1,10 +1,21 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    /* Numbers compare as doubles so that NaN != NaN under both layouts. */
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a == b)
+        return true;
+    /* Distinct strings may still hold the same characters; see stringsEqual() */
+    return IS_OBJ(a) && IS_OBJ(b) && stringsEqual(AS_OBJ(a), AS_OBJ(b));
+#else
     if (a.type != b.type)
         return false;
     switch (a.type)
@@ -15,10 +26,82 @@ bool valuesEqual(Value a, Value b)
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ:
+            return stringsEqual(AS_OBJ(a), AS_OBJ(b));
         default:
             return false; // Unreachable.
     }
+#endif
 }
+
+/* The equality under which one constant can stand in for another. It is
+   stricter than valuesEqual() for numbers, which must be bit-identical, so
+   0 and -0 stay distinct and NaN matches itself; strings compare by
+   content under both. */
+bool valuesIdentical(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+
+    return valuesEqual(a, b);
+}
+
+static uint32_t hashBytes(const void *key, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* Consistent with valuesIdentical() */
+uint32_t hashValue(Value value)
+{
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        return hashBytes(&number, sizeof(double));
+    }
+
+    if (isStringValue(value))
+        return hashObject(AS_OBJ(value));
+
+    if (IS_BOOL(value))
+        return AS_BOOL(value) ? 1 : 2;
+
+    return 0;
+}
+
+StaticType staticTypeOf(Value value)
+{
+    if (IS_NUMBER(value))
+        return TYPE_NUMBER;
+    if (IS_BOOL(value))
+        return TYPE_BOOL;
+    if (IS_NIL(value))
+        return TYPE_NIL;
+    if (isStringValue(value))
+        return TYPE_STRING;
+    return TYPE_UNKNOWN;
+}
+
+StaticType additionType(StaticType a, StaticType b)
+{
+    if (a == TYPE_NUMBER || b == TYPE_NUMBER)
+        return TYPE_NUMBER;
+    if (a == TYPE_STRING || b == TYPE_STRING)
+        return TYPE_STRING;
+    return TYPE_UNKNOWN;
+}
+
 void initValueArray(ValueArray *array)
 {
     array->count = 0;
@@ -47,20 +130,12 @@ void freeValueArray(ValueArray *array)
 
 void printValue(Value value)
 {
-    switch (value.type)
-    {
-    case VAL_BOOL:
+    if (IS_BOOL(value))
         printf(AS_BOOL(value) ? "true" : "false");
-        break;
-
-    case VAL_NIL:
+    else if (IS_NIL(value))
         printf("nil");
-        break;
-
-    case VAL_NUMBER:
+    else if (IS_NUMBER(value))
         printf("%g", AS_NUMBER(value));
-
-    case VAL_OBJ:
-        printf("a freaking object ok");
-    }
+    else if (IS_OBJ(value))
+        printObject(value);
 }
\ No newline at end of file
@@ -6,12 +6,65 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/* A Value is a single 64-bit word: any double that is not a quiet NaN is a
+   number, quiet NaNs carry the singleton tags, and quiet NaNs with the sign
+   bit set carry a 48-bit Obj pointer. */
+typedef uint64_t Value;
+
+#define SIGN_BIT            ((uint64_t)0x8000000000000000)
+#define QNAN                ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL             1
+#define TAG_FALSE           2
+#define TAG_TRUE            3
+#define TAG_UNDEFINED       4
+
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(value)     ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(value)   numberToValue(value)
+#define OBJ_VAL(value)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value))
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    valueToNumber(value)
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+static inline double valueToNumber(Value value)
+{
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value numberToValue(double number)
+{
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct
@@ -27,6 +80,7 @@ typedef struct
 
 #define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(value)      ((Value){VAL_OBJ, {.obj = (Obj*) value}})
 
@@ -36,9 +90,15 @@ typedef struct
 
 #define IS_BOOL(value)      ((value).type == VAL_BOOL)
 #define IS_NIL(value)       ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
 
+#endif
+
+/* UNDEFINED_VAL marks a global that has not been given a value; no script
+   can produce one, so it never escapes the VM's globals array */
+
 typedef struct
 {
     int capacity;
@@ -46,7 +106,24 @@ typedef struct
     Value *values;
 } ValueArray;
 
+/* What the compiler can prove about a value without running anything;
+   TYPE_UNKNOWN is the top of the lattice and admits every value. */
+typedef enum
+{
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_BOOL,
+    TYPE_NIL,
+    TYPE_STRING
+} StaticType;
+
 bool valuesEqual(Value a, Value b);
+bool valuesIdentical(Value a, Value b);
+uint32_t hashValue(Value value);
+StaticType staticTypeOf(Value value);
+/* The type of a + b for operands of the given types, should it succeed:
+   + takes two numbers or two strings */
+StaticType additionType(StaticType a, StaticType b);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
@@ -0,0 +1,413 @@
+#include "verifier.h"
+#include "memory.h"
+
+/* What forward jumps tell the instruction they land on: the stack depth
+   they agree on, -1 while none lands there, and the slot types joined
+   over all of them */
+typedef struct
+{
+    int *depths;
+    StaticType **types;
+} JumpEntries;
+
+static bool verifyCode(Chunk *chunk, int inputCount, StaticType *types, JumpEntries *entries);
+static bool enterJump(JumpEntries *entries, int target, StaticType *types, int depth);
+static void joinTypes(StaticType *into, StaticType *from, int depth);
+static bool knownOpcode(uint8_t opcode);
+static int stackInputs(const uint8_t *ip);
+static bool validOperands(Chunk *chunk, uint8_t *ip, int inputCount);
+static bool numericOperands(StaticType *types, int depth, int count);
+static StaticType resultType(Chunk *chunk, uint8_t *ip, StaticType *types, int depth);
+static bool leavesResult(uint8_t opcode);
+static bool linesCover(Chunk *chunk);
+
+bool verifyChunk(Chunk *chunk, int inputCount)
+{
+    chunk->verified = false;
+
+    if (chunk->maxStack < 0)
+        return false;
+
+    /* Every push takes at least one byte of code, so the stack can never
+       outgrow the code; that also bounds an untrusted maxStack */
+    int slots = chunk->maxStack < chunk->count ? chunk->maxStack : chunk->count;
+    StaticType *types = ALLOCATE(StaticType, slots);
+
+    JumpEntries entries;
+    entries.depths = ALLOCATE(int, chunk->count);
+    entries.types = ALLOCATE(StaticType *, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        entries.depths[i] = -1;
+        entries.types[i] = NULL;
+    }
+
+    chunk->verified = verifyCode(chunk, inputCount, types, &entries);
+
+    for (int i = 0; i < chunk->count; i++)
+    {
+        if (entries.types[i] != NULL)
+            FREE_ARRAY(StaticType, entries.types[i], entries.depths[i]);
+    }
+    FREE_ARRAY(StaticType *, entries.types, chunk->count);
+    FREE_ARRAY(int, entries.depths, chunk->count);
+    FREE_ARRAY(StaticType, types, slots);
+
+    return chunk->verified;
+}
+
+/* Abstract interpretation over stack heights and the static type of each
+   slot, which is what lets the unchecked _NN forms run without guards.
+   Jumps only go forward, so one pass in code order sees every jump into an
+   instruction before the instruction itself. All paths into an instruction
+   must agree on the depth, and a slot keeps a type only if they agree on
+   it too. Unreachable code is rejected, so that backends translating the
+   code in order never meet an instruction whose stack they cannot know. */
+static bool verifyCode(Chunk *chunk, int inputCount, StaticType *types, JumpEntries *entries)
+{
+    int depth = 0;
+    int offset = 0;
+    bool reachable = true;
+    while (offset < chunk->count)
+    {
+        int entryDepth = entries->depths[offset];
+        if (entryDepth != -1)
+        {
+            if (!reachable)
+            {
+                depth = entryDepth;
+                for (int i = 0; i < depth; i++)
+                    types[i] = entries->types[offset][i];
+                reachable = true;
+            }
+            else if (depth != entryDepth)
+            {
+                return false;
+            }
+            else
+            {
+                joinTypes(types, entries->types[offset], depth);
+            }
+        }
+
+        if (!reachable)
+            return false;
+
+        uint8_t *ip = &chunk->code[offset];
+        if (!knownOpcode(ip[0]))
+            return false;
+
+        int length = opcodeLength(ip[0]);
+        if (length > chunk->count - offset || !validOperands(chunk, ip, inputCount))
+            return false;
+
+        /* A jump may not land inside an instruction */
+        for (int i = offset + 1; i < offset + length; i++)
+        {
+            if (entries->depths[i] != -1)
+                return false;
+        }
+
+        int inputs = stackInputs(ip);
+        if (depth < inputs)
+            return false;
+        if ((ip[0] == OP_GET_LOCAL || ip[0] == OP_SET_LOCAL) && ip[1] >= depth)
+            return false;
+        if (assumesNumbers(ip[0]) && !numericOperands(types, depth, inputs))
+            return false;
+
+        StaticType result = resultType(chunk, ip, types, depth);
+        depth += stackEffect(ip);
+        if (depth > chunk->maxStack)
+            return false;
+
+        if (leavesResult(ip[0]))
+            types[depth - 1] = result;
+        if (ip[0] == OP_SET_LOCAL)
+            types[ip[1]] = result;
+
+        if (isJump(ip[0]))
+        {
+            int target = jumpTarget(chunk->code, offset);
+            if (target >= chunk->count || !enterJump(entries, target, types, depth))
+                return false;
+            if (ip[0] == OP_JUMP || ip[0] == OP_JUMP_LONG)
+                reachable = false;
+        }
+
+        offset += length;
+
+        /* Code is straight-line, so the return must be its last instruction */
+        if (ip[0] == OP_RETURN)
+            return offset == chunk->count && linesCover(chunk);
+    }
+
+    /* Execution would run off the end of the code */
+    return false;
+}
+
+static bool enterJump(JumpEntries *entries, int target, StaticType *types, int depth)
+{
+    if (entries->depths[target] == -1)
+    {
+        entries->depths[target] = depth;
+        entries->types[target] = ALLOCATE(StaticType, depth);
+        for (int i = 0; i < depth; i++)
+            entries->types[target][i] = types[i];
+        return true;
+    }
+
+    if (entries->depths[target] != depth)
+        return false;
+
+    joinTypes(entries->types[target], types, depth);
+    return true;
+}
+
+static void joinTypes(StaticType *into, StaticType *from, int depth)
+{
+    for (int i = 0; i < depth; i++)
+    {
+        if (into[i] != from[i])
+            into[i] = TYPE_UNKNOWN;
+    }
+}
+static bool knownOpcode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_GET_INPUT:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_PICK:
+    case OP_SLIDE:
+    case OP_POP:
+    case OP_POPN:
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_NIL:
+    case OP_NOT:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD_CONSTANT:
+    case OP_NEGATE_NUM:
+    case OP_ADD_CONSTANT_NUM:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_NEGATE_N:
+    case OP_ADD_CONSTANT_NN:
+    case OP_ADD_NN:
+    case OP_SUBTRACT_NN:
+    case OP_MULTIPLY_NN:
+    case OP_DIVIDE_NN:
+    case OP_GREATER_NN:
+    case OP_LESS_NN:
+    case OP_GREATER_EQUAL_NN:
+    case OP_LESS_EQUAL_NN:
+    case OP_RETURN:
+    case OP_NEGATE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/* Values an instruction reads from the stack; PICK, SLIDE and POPN reach
+   as far down as their operand says. Local slots are checked against the
+   depth separately. */
+static int stackInputs(const uint8_t *ip)
+{
+    switch (ip[0])
+    {
+    case OP_PICK:
+    case OP_SLIDE:
+        return ip[1] + 1;
+    case OP_POPN:
+        return ip[1];
+
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_GET_INPUT:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        return 0;
+
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_POP:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+    case OP_NEGATE_N:
+    case OP_ADD_CONSTANT_NN:
+    case OP_RETURN:
+        return 1;
+
+    default:
+        return 2;
+    }
+}
+
+static bool validOperands(Chunk *chunk, uint8_t *ip, int inputCount)
+{
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+    case OP_ADD_CONSTANT:
+        return ip[1] < chunk->constants.count;
+    case OP_CONSTANT_LONG:
+        return (ip[1] | (ip[2] << 8) | (ip[3] << 16)) < chunk->constants.count;
+    case OP_ADD_CONSTANT_NUM:
+    case OP_ADD_CONSTANT_NN:
+        return ip[1] < chunk->constants.count && IS_NUMBER(chunk->constants.values[ip[1]]);
+    case OP_GET_INPUT:
+        return ip[1] < inputCount;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+        return (ip[1] | (ip[2] << 8)) < chunk->globalLimit;
+    default:
+        return true;
+    }
+}
+
+static bool numericOperands(StaticType *types, int depth, int count)
+{
+    for (int i = depth - count; i < depth; i++)
+    {
+        if (types[i] != TYPE_NUMBER)
+            return false;
+    }
+    return true;
+}
+
+/* Type of the value an instruction leaves on top of the stack. Checked
+   arithmetic yields a number too, since any other operand stops the VM. */
+static StaticType resultType(Chunk *chunk, uint8_t *ip, StaticType *types, int depth)
+{
+    switch (ip[0])
+    {
+    case OP_PICK:
+        return types[depth - 1 - ip[1]];
+    case OP_GET_LOCAL:
+        return types[ip[1]];
+    case OP_SLIDE:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+        return types[depth - 1];
+
+    case OP_CONSTANT:
+        return staticTypeOf(chunk->constants.values[ip[1]]);
+    case OP_CONSTANT_LONG:
+        return staticTypeOf(chunk->constants.values[ip[1] | (ip[2] << 8) | (ip[3] << 16)]);
+    case OP_NIL:
+        return TYPE_NIL;
+
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_GREATER_NN:
+    case OP_LESS_NN:
+    case OP_GREATER_EQUAL_NN:
+    case OP_LESS_EQUAL_NN:
+        return TYPE_BOOL;
+
+    /* The quickened forms revert to the generic ones for strings */
+    case OP_ADD:
+    case OP_ADD_NUM:
+        return additionType(types[depth - 2], types[depth - 1]);
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+        return additionType(types[depth - 1], staticTypeOf(chunk->constants.values[ip[1]]));
+
+    case OP_NEGATE:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NEGATE_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_NEGATE_N:
+    case OP_ADD_CONSTANT_NN:
+    case OP_ADD_NN:
+    case OP_SUBTRACT_NN:
+    case OP_MULTIPLY_NN:
+    case OP_DIVIDE_NN:
+        return TYPE_NUMBER;
+
+    default:
+        return TYPE_UNKNOWN;
+    }
+}
+
+/* Everything but the return, the unconditional jumps and the ones that
+   consume values leaves its result on top */
+static bool leavesResult(uint8_t opcode)
+{
+    return opcode != OP_RETURN && opcode != OP_POP && opcode != OP_POPN && opcode != OP_DEFINE_GLOBAL &&
+           opcode != OP_JUMP && opcode != OP_JUMP_LONG;
+}
+
+/* Every instruction needs a line for runtime errors to report */
+static bool linesCover(Chunk *chunk)
+{
+    if (chunk->lines.count % 2 != 0)
+        return false;
+
+    long covered = 0;
+    for (int i = 0; i < chunk->lines.count; i += 2)
+    {
+        if (chunk->lines.lines[i] <= 0)
+            return false;
+        covered += chunk->lines.lines[i];
+    }
+
+    return covered >= chunk->count;
+}
@@ -0,0 +1,14 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "common.h"
+#include "chunk.h"
+
+/* Proves, by abstract interpretation of the stack height and slot types,
+   that running the chunk cannot read outside its code, constant pool or
+   inputs, cannot move the stack outside [0, maxStack], and never hands an
+   unchecked _NN instruction anything but numbers. Sets chunk->verified
+   accordingly. */
+bool verifyChunk(Chunk *chunk, int inputCount);
+
+#endif
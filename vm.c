@@ -1,86 +1,277 @@
 #include <stdarg.h>
+#include <string.h>
 
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "memory.h"
+#include "verifier.h"
+#include "globals.h"
+#include "object.h"
 
-#define BINARY_OPERATION(type, op)                      \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-                                                        \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(type(a op b));                             \
-    } while (false)
+/* Instance behind the single-VM convenience API */
+static VM defaultVM;
 
-/* Global Virtual Machine instance */
-VM vm;
-
-static InterpretResult run();
-static Value peek(int skip);
-static void resetStack();
+static InterpretResult run(VM *vm, Value *result);
+static InterpretResult runRegisters(VM *vm, RegChunk *chunk, Value *result);
+static void resetStack(VM *vm);
+static bool reserveStack(VM *vm, LineArray *lines, int slots);
+static void reserveGlobals(VM *vm, int count);
+static void storeGlobal(Value *global, Value value);
+static void collectHeap(VM *vm, Value *stackTop);
 static bool isFalsey(Value value);
-static void runtimeError(const char *format, ...);
+static bool numericInputs(const Value *inputs, int count);
+static Prepared *newPrepared(int inputCount);
+static void translateChunk(Prepared *prepared, Backend backend);
+static void runtimeError(VM *vm, LineArray *lines, int offset, const char *format, ...);
 
-void initVM()
+void vmInit(VM *vm)
 {
-    resetStack();
+    vm->stack = ALLOCATE(Value, STACK_MAX);
+    vm->stackCapacity = STACK_MAX;
+    vm->stackLimit = STACK_LIMIT;
+    vm->inputs = NULL;
+    vm->globals = NULL;
+    vm->globalCount = 0;
+    initHeap(&vm->heap);
+    resetStack(vm);
 }
 
-void freeVM()
+void vmFree(VM *vm)
 {
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->stackTop = NULL;
+
+    for (int i = 0; i < vm->globalCount; i++)
+        releaseValue(vm->globals[i]);
+    FREE_ARRAY(Value, vm->globals, vm->globalCount);
+    vm->globals = NULL;
+    vm->globalCount = 0;
+
+    freeHeap(&vm->heap);
 }
 
-InterpretResult interpret(const char *src)
+void vmSetStackLimit(VM *vm, int slots)
 {
-    Chunk chunk;
-    initChunk(&chunk);
+    vm->stackLimit = slots;
+}
 
-    if (!compile(src, &chunk))
+void vmSetGcBudget(VM *vm, size_t nurseryBytes, int stepObjects)
+{
+    setHeapBudget(&vm->heap, nurseryBytes, stepObjects);
+}
+
+Prepared *prepare(const char *src, Backend backend)
+{
+    return prepareInputs(src, backend, NULL, 0);
+}
+
+Prepared *prepareInputs(const char *src, Backend backend,
+                        const char *const *inputs, int inputCount)
+{
+    Prepared *prepared = newPrepared(inputCount);
+
+    /* Cached native code needs nothing from the compiler */
+    if (backend == BACKEND_NATIVE && loadNative(&prepared->native, src, inputs, inputCount))
+        return prepared;
+
+    Compiler compiler;
+    if (!compileInputs(&compiler, src, &prepared->chunk, inputs, inputCount))
     {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+        release(prepared);
+        return NULL;
+    }
+
+    translateChunk(prepared, backend);
+    return prepared;
+}
+
+Prepared *prepareChunk(Chunk *chunk, Backend backend)
+{
+    Prepared *prepared = newPrepared(0);
+    prepared->chunk = *chunk;
+    initChunk(chunk);
+
+    if (!verifyChunk(&prepared->chunk, 0))
+    {
+        release(prepared);
+        return NULL;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    translateChunk(prepared, backend);
+    return prepared;
+}
 
-    InterpretResult result = run();
+void release(Prepared *prepared)
+{
+    freeRegChunk(&prepared->regChunk);
+    freeJitCode(&prepared->jit);
+    freeNativeCode(&prepared->native);
+    freeChunk(&prepared->chunk);
+    FREE(Prepared, prepared);
+}
 
-    freeChunk(&chunk);
+InterpretResult vmExecute(VM *vm, Prepared *prepared, Value *result)
+{
+    if (prepared->inputCount > 0 && vm->inputs == NULL)
+    {
+        runtimeError(vm, &prepared->chunk.lines, 0, "Inputs are not bound.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    /* Native code has no safepoints of its own */
+    if (vm->heap.full)
+        collectHeap(vm, vm->stackTop);
+
+    if (prepared->native.function != NULL)
+        return (InterpretResult)runNative(&prepared->native, &vm->heap, vm->inputs, result);
+
+    /* run() trusts its bytecode; only verified chunks get that far */
+    if (!prepared->chunk.verified)
+    {
+        runtimeError(vm, &prepared->chunk.lines, 0, "Chunk has not been verified.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    reserveGlobals(vm, prepared->chunk.globalLimit);
+
+    /* Native code assumes every input is a number */
+    if (prepared->jit.function != NULL && numericInputs(vm->inputs, prepared->inputCount))
+    {
+        *result = jitCall(&prepared->jit, vm->inputs);
+        return INTERPRET_OK;
+    }
+
+    if (prepared->lowered)
+    {
+        RegChunk *regChunk = &prepared->regChunk;
+        return reserveStack(vm, &regChunk->lines, regChunk->registerCount)
+                   ? runRegisters(vm, regChunk, result)
+                   : INTERPRET_RUNTIME_ERROR;
+    }
+
+    Chunk *chunk = &prepared->chunk;
+    vm->chunk = chunk;
+    vm->ip = chunk->code;
+    return reserveStack(vm, &chunk->lines, chunk->maxStack) ? run(vm, result) : INTERPRET_RUNTIME_ERROR;
+}
+
+InterpretResult vmInterpret(VM *vm, const char *src, Backend backend)
+{
+    Prepared *prepared = prepare(src, backend);
+    if (prepared == NULL)
+        return INTERPRET_COMPILE_ERROR;
+
+    Value value;
+    InterpretResult result = vmExecute(vm, prepared, &value);
+    if (result == INTERPRET_OK)
+    {
+        printValue(value);
+        printf("\n");
+    }
+
+    release(prepared);
     return result;
 }
 
-uint8_t readByte()
+void vmPush(VM *vm, Value value)
 {
-    return *vm.ip++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value readConstant()
+Value vmPop(VM *vm)
+{
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+void vmBindInputs(VM *vm, const Value *inputs)
+{
+    vm->inputs = inputs;
+}
+
+bool vmSetGlobal(VM *vm, const char *name, Value value)
+{
+    int slot = resolveGlobal(name, (int)strlen(name));
+    if (slot == -1)
+        return false;
+
+    reserveGlobals(vm, slot + 1);
+    storeGlobal(&vm->globals[slot], value);
+    return true;
+}
+
+bool vmGetGlobal(VM *vm, const char *name, Value *value)
+{
+    int slot = findGlobal(name, (int)strlen(name));
+    if (slot == -1 || slot >= vm->globalCount || IS_UNDEFINED(vm->globals[slot]))
+        return false;
+
+    *value = vm->globals[slot];
+    return true;
+}
+
+void initVM()
+{
+    vmInit(&defaultVM);
+}
+
+void freeVM()
 {
-    return vm.chunk->constants.values[readByte()];
+    vmFree(&defaultVM);
+}
+
+void setStackLimit(int slots)
+{
+    vmSetStackLimit(&defaultVM, slots);
+}
+
+void setGcBudget(size_t nurseryBytes, int stepObjects)
+{
+    vmSetGcBudget(&defaultVM, nurseryBytes, stepObjects);
+}
+
+InterpretResult interpret(const char *src)
+{
+    return vmInterpret(&defaultVM, src, BACKEND_STACK);
+}
+
+InterpretResult interpretWith(const char *src, Backend backend)
+{
+    return vmInterpret(&defaultVM, src, backend);
+}
+
+InterpretResult execute(Prepared *prepared, Value *result)
+{
+    return vmExecute(&defaultVM, prepared, result);
 }
 
 void push(Value value)
 {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    vmPush(&defaultVM, value);
 }
 
 Value pop()
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    return vmPop(&defaultVM);
+}
+
+void bindInputs(const Value *inputs)
+{
+    vmBindInputs(&defaultVM, inputs);
+}
+
+bool setGlobal(const char *name, Value value)
+{
+    return vmSetGlobal(&defaultVM, name, value);
 }
 
-static Value peek(int skip)
+bool getGlobal(const char *name, Value *value)
 {
-    return vm.stackTop[-1 - skip];
+    return vmGetGlobal(&defaultVM, name, value);
 }
 
 static bool isFalsey(Value value)
@@ -91,110 +282,999 @@ static bool isFalsey(Value value)
     return IS_BOOL(value) && !AS_BOOL(value);
 }
 
-static InterpretResult run()
+static Prepared *newPrepared(int inputCount)
 {
+    Prepared *prepared = ALLOCATE(Prepared, 1);
+    initChunk(&prepared->chunk);
+    initRegChunk(&prepared->regChunk);
+    prepared->lowered = false;
+    initJitCode(&prepared->jit);
+    initNativeCode(&prepared->native);
+    prepared->inputCount = inputCount;
+    return prepared;
+}
 
-    InterpretResult result;
-    for (;;)
+/* Builds whatever the backend executes besides the bytecode itself */
+static void translateChunk(Prepared *prepared, Backend backend)
+{
+    /* Chunks the register backend cannot express run on the stack VM */
+    prepared->lowered = backend == BACKEND_REGISTER &&
+                        lowerToRegisters(&prepared->chunk, &prepared->regChunk);
+    if (backend == BACKEND_JIT)
+        jitCompile(&prepared->chunk, &prepared->jit);
+}
+
+static bool numericInputs(const Value *inputs, int count)
+{
+    for (int i = 0; i < count; i++)
     {
+        if (!IS_NUMBER(inputs[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static InterpretResult run(VM *vm, Value *result)
+{
+    /* Hot interpreter state is cached in locals so it can live in registers;
+       it is written back to the VM only when something outside run() needs it. */
+    uint8_t *ip = vm->ip;
+    Value *stackTop = vm->stackTop;
+    Value *globals = vm->globals;
+
+    /* Locals are addressed from the stack slot the chunk started at */
+    Value *frame = stackTop;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] | (ip[-1] << 8)))
+#define READ_LONG() (ip += 3, ip[-3] | (ip[-2] << 8) | (ip[-1] << 16))
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+    (ip += 3, vm->chunk->constants.values[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(skip) (stackTop[-1 - (skip)])
+
+#define SYNC_STATE()          \
+    do                        \
+    {                         \
+        vm->ip = ip;           \
+        vm->stackTop = stackTop; \
+    } while (false)
+
+/* Only strings are allocated, so only the paths building them offer to
+   collect */
+#define SAFEPOINT()                         \
+    do                                      \
+    {                                       \
+        if (vm->heap.full)                  \
+        {                                   \
+            SYNC_STATE();                   \
+            collectHeap(vm, stackTop);      \
+        }                                   \
+    } while (false)
+
+#define RUNTIME_ERROR(...)                  \
+    do                                      \
+    {                                       \
+        SYNC_STATE();                       \
+        runtimeError(vm, &vm->chunk->lines,      \
+                     (int)(ip - vm->chunk->code - 1), __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+
+/* Generic arithmetic checks its operands and, once they have been seen to
+   be numbers, quickens its own opcode byte in place so later executions
+   take the numeric fast path. */
+#define BINARY_OPERATION(type, op, quickened)           \
+    do                                                  \
+    {                                                   \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+            RUNTIME_ERROR("Operands must be numbers."); \
+                                                        \
+        ip[-1] = (quickened);                           \
+        NUMERIC_OPERATION(type, op);                    \
+    } while (false)
+
+#define NUMERIC_OPERATION(type, op)                                    \
+    do                                                                 \
+    {                                                                  \
+        PEEK(1) = type(AS_NUMBER(PEEK(1)) op AS_NUMBER(PEEK(0)));      \
+        stackTop--;                                                    \
+    } while (false)
+
+/* A quickened instruction whose cheap guard fails reverts to its generic
+   form and re-executes, so it can quicken again later. */
+#define DEOPTIMIZE(generic) \
+    {                       \
+        ip[-1] = (generic); \
+        ip--;               \
+        DISPATCH();         \
+    }
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
 
 #ifdef DEBUG_TRACE_EXECUTION
-        int offset = (int)(vm.ip - vm.chunk->code);
-        disassembleInstruction(vm.chunk, &offset);
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+#define TRACE_EXECUTION()                                              \
+    do                                                                 \
+    {                                                                  \
+        int offset = (int)(ip - vm->chunk->code);                       \
+        disassembleInstruction(vm->chunk, &offset);                     \
+        printf("          ");                                          \
+        for (Value *slot = vm->stack; slot < stackTop; slot++)          \
+        {                                                              \
+            printf("[ ");                                              \
+            printValue(*slot);                                         \
+            printf(" ]");                                              \
+        }                                                              \
+        printf("\n");                                                  \
+        printf("\n");                                                  \
+    } while (false)
+#else
+#define TRACE_EXECUTION() \
+    do                    \
+    {                     \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    /* Every opcode gets its own indirect jump at the end of its handler, which
+       gives the branch predictor one history per opcode instead of one shared
+       switch branch. Bytes without a handler land on the unknown label. */
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+    static void *dispatchTable[UINT8_MAX + 1] = {
+        [0 ... UINT8_MAX] = &&LABEL_UNKNOWN,
+        [OP_CONSTANT] = &&LABEL_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&LABEL_OP_CONSTANT_LONG,
+        [OP_GET_INPUT] = &&LABEL_OP_GET_INPUT,
+        [OP_GET_GLOBAL] = &&LABEL_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&LABEL_OP_SET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&LABEL_OP_DEFINE_GLOBAL,
+        [OP_GET_LOCAL] = &&LABEL_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&LABEL_OP_SET_LOCAL,
+        [OP_POPN] = &&LABEL_OP_POPN,
+        [OP_PICK] = &&LABEL_OP_PICK,
+        [OP_SLIDE] = &&LABEL_OP_SLIDE,
+        [OP_POP] = &&LABEL_OP_POP,
+        [OP_JUMP] = &&LABEL_OP_JUMP,
+        [OP_JUMP_LONG] = &&LABEL_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE] = &&LABEL_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_FALSE_LONG] = &&LABEL_OP_JUMP_IF_FALSE_LONG,
+        [OP_NIL] = &&LABEL_OP_NIL,
+        [OP_NOT] = &&LABEL_OP_NOT,
+        [OP_TRUE] = &&LABEL_OP_TRUE,
+        [OP_FALSE] = &&LABEL_OP_FALSE,
+        [OP_EQUAL] = &&LABEL_OP_EQUAL,
+        [OP_GREATER] = &&LABEL_OP_GREATER,
+        [OP_LESS] = &&LABEL_OP_LESS,
+        [OP_NOT_EQUAL] = &&LABEL_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&LABEL_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&LABEL_OP_LESS_EQUAL,
+        [OP_ADD_CONSTANT] = &&LABEL_OP_ADD_CONSTANT,
+        [OP_NEGATE_NUM] = &&LABEL_OP_NEGATE_NUM,
+        [OP_ADD_CONSTANT_NUM] = &&LABEL_OP_ADD_CONSTANT_NUM,
+        [OP_ADD_NUM] = &&LABEL_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM] = &&LABEL_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&LABEL_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&LABEL_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM] = &&LABEL_OP_GREATER_NUM,
+        [OP_LESS_NUM] = &&LABEL_OP_LESS_NUM,
+        [OP_GREATER_EQUAL_NUM] = &&LABEL_OP_GREATER_EQUAL_NUM,
+        [OP_LESS_EQUAL_NUM] = &&LABEL_OP_LESS_EQUAL_NUM,
+        [OP_NEGATE_N] = &&LABEL_OP_NEGATE_N,
+        [OP_ADD_CONSTANT_NN] = &&LABEL_OP_ADD_CONSTANT_NN,
+        [OP_ADD_NN] = &&LABEL_OP_ADD_NN,
+        [OP_SUBTRACT_NN] = &&LABEL_OP_SUBTRACT_NN,
+        [OP_MULTIPLY_NN] = &&LABEL_OP_MULTIPLY_NN,
+        [OP_DIVIDE_NN] = &&LABEL_OP_DIVIDE_NN,
+        [OP_GREATER_NN] = &&LABEL_OP_GREATER_NN,
+        [OP_LESS_NN] = &&LABEL_OP_LESS_NN,
+        [OP_GREATER_EQUAL_NN] = &&LABEL_OP_GREATER_EQUAL_NN,
+        [OP_LESS_EQUAL_NN] = &&LABEL_OP_LESS_EQUAL_NN,
+        [OP_RETURN] = &&LABEL_OP_RETURN,
+        [OP_NEGATE] = &&LABEL_OP_NEGATE,
+        [OP_ADD] = &&LABEL_OP_ADD,
+        [OP_SUBTRACT] = &&LABEL_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&LABEL_OP_MULTIPLY,
+        [OP_DIVIDE] = &&LABEL_OP_DIVIDE,
+    };
+#pragma GCC diagnostic pop
+
+#define DISPATCH()                            \
+    do                                        \
+    {                                         \
+        TRACE_EXECUTION();                    \
+        goto *dispatchTable[READ_BYTE()];     \
+    } while (false)
+#define CASE(opcode) LABEL_##opcode:
+#define DEFAULT LABEL_UNKNOWN:
+
+    DISPATCH();
+#else
+#define DISPATCH() continue
+#define CASE(opcode) case opcode:
+#if defined(__GNUC__) && defined(NDEBUG)
+/* Only verified code gets here, so every byte read is a known opcode;
+   saying so lets the compiler drop the switch's range check. */
+#define DEFAULT default: __builtin_unreachable();
+#else
+#define DEFAULT default:
+#endif
+
+    for (;;)
+    {
+        TRACE_EXECUTION();
+        switch (READ_BYTE())
         {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        printf("\n");
 #endif
 
-        uint8_t instruction;
-        switch (instruction = readByte())
+        CASE(OP_NEGATE)
+        {
+            if (!IS_NUMBER(PEEK(0)))
+                RUNTIME_ERROR("Operand must be a number.");
+
+            ip[-1] = OP_NEGATE_NUM;
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        }
+
+        /* Only numbers quicken; strings stay on the generic path, where
+           the dispatch is cheap next to the concatenation */
+        CASE(OP_ADD)
         {
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
             {
-                runtimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
+                ip[-1] = OP_ADD_NUM;
+                NUMERIC_OPERATION(NUMBER_VAL, +);
+                DISPATCH();
             }
 
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
+            const char *error = concatenate(&vm->heap, &PEEK(1), PEEK(0));
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            stackTop--;
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT)
+        {
+            BINARY_OPERATION(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY)
+        {
+            BINARY_OPERATION(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE)
+        {
+            BINARY_OPERATION(NUMBER_VAL, /, OP_DIVIDE_NUM);
+            DISPATCH();
+        }
+
+        CASE(OP_CONSTANT)
+        {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
 
-        case OP_ADD:
-            BINARY_OPERATION(NUMBER_VAL, +);
-            break;
-        case OP_SUBTRACT:
-            BINARY_OPERATION(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OPERATION(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OPERATION(NUMBER_VAL, /);
-            break;
+        CASE(OP_CONSTANT_LONG)
+        {
+            Value constant = READ_CONSTANT_LONG();
+            PUSH(constant);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_INPUT)
+        {
+            PUSH(vm->inputs[READ_BYTE()]);
+            DISPATCH();
+        }
+
+        /* The slot was resolved by the compiler and the array sized for it
+           before run() started, so a global costs one indexed load */
+        CASE(OP_GET_GLOBAL)
+        {
+            uint16_t slot = READ_SHORT();
+            Value value = globals[slot];
+            if (IS_UNDEFINED(value))
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot));
+
+            PUSH(value);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_GLOBAL)
+        {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(globals[slot]))
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot));
+
+            storeGlobal(&globals[slot], PEEK(0));
+            DISPATCH();
+        }
+
+        CASE(OP_DEFINE_GLOBAL)
+        {
+            uint16_t slot = READ_SHORT();
+            storeGlobal(&globals[slot], POP());
+            DISPATCH();
+        }
+
+        CASE(OP_GET_LOCAL)
+        {
+            PUSH(frame[READ_BYTE()]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL)
+        {
+            frame[READ_BYTE()] = PEEK(0);
+            DISPATCH();
+        }
+
+        CASE(OP_PICK)
+        {
+            Value value = PEEK(READ_BYTE());
+            PUSH(value);
+            DISPATCH();
+        }
+
+        CASE(OP_SLIDE)
+        {
+            Value value = PEEK(0);
+            stackTop -= READ_BYTE();
+            PEEK(0) = value;
+            DISPATCH();
+        }
+
+        CASE(OP_POP)
+        {
+            stackTop--;
+            DISPATCH();
+        }
+
+        CASE(OP_POPN)
+        {
+            stackTop -= READ_BYTE();
+            DISPATCH();
+        }
+
+        /* The distance is read before it is added, so it counts from the
+           end of the instruction */
+        CASE(OP_JUMP)
+        {
+            uint16_t distance = READ_SHORT();
+            ip += distance;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_LONG)
+        {
+            int distance = READ_LONG();
+            ip += distance;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_FALSE)
+        {
+            uint16_t distance = READ_SHORT();
+            if (isFalsey(PEEK(0)))
+                ip += distance;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_FALSE_LONG)
+        {
+            int distance = READ_LONG();
+            if (isFalsey(PEEK(0)))
+                ip += distance;
+            DISPATCH();
+        }
+
+        CASE(OP_NOT)
+        {
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        }
+
+        CASE(OP_NIL)
+        {
+            PUSH(NIL_VAL);
+            DISPATCH();
+        }
+
+        CASE(OP_TRUE)
+        {
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        }
+
+        CASE(OP_FALSE)
+        {
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        }
+
+        CASE(OP_EQUAL)
+        {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+
+        CASE(OP_GREATER)
+        {
+            BINARY_OPERATION(BOOL_VAL, >, OP_GREATER_NUM);
+            DISPATCH();
+        }
+        CASE(OP_LESS)
+        {
+            BINARY_OPERATION(BOOL_VAL, <, OP_LESS_NUM);
+            DISPATCH();
+        }
 
-        case OP_CONSTANT:
+        /* The fused comparisons keep the exact semantics of the pairs they
+           replace, so NaN operands still compare the same way. */
+        CASE(OP_NOT_EQUAL)
+        {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL)
         {
-            Value constant = readConstant();
-            push(constant);
-            break;
+            BINARY_OPERATION(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUM);
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL)
+        {
+            BINARY_OPERATION(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUM);
+            DISPATCH();
         }
 
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
+        CASE(OP_ADD_CONSTANT)
+        {
+            Value constant = READ_CONSTANT();
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(constant))
+            {
+                ip[-2] = OP_ADD_CONSTANT_NUM;
+                PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(constant));
+                DISPATCH();
+            }
 
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
+            const char *error = concatenate(&vm->heap, &PEEK(0), constant);
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            SAFEPOINT();
+            DISPATCH();
+        }
 
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
+        /* Quickened forms: the verifier only lets OP_ADD_CONSTANT_NUM name
+           a number, and pool entries never change. */
+        CASE(OP_NEGATE_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)))
+                DEOPTIMIZE(OP_NEGATE);
 
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        }
+        CASE(OP_ADD_CONSTANT_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)))
+                DEOPTIMIZE(OP_ADD_CONSTANT);
 
-        case OP_EQUAL:
+            Value constant = READ_CONSTANT();
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(constant));
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_ADD);
+
+            NUMERIC_OPERATION(NUMBER_VAL, +);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_SUBTRACT);
+
+            NUMERIC_OPERATION(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_MULTIPLY);
+
+            NUMERIC_OPERATION(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE_NUM)
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_DIVIDE);
+
+            NUMERIC_OPERATION(NUMBER_VAL, /);
+            DISPATCH();
         }
+        CASE(OP_GREATER_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_GREATER);
 
-        case OP_GREATER:
+            NUMERIC_OPERATION(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_LESS_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_LESS);
+
+            NUMERIC_OPERATION(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_GREATER_EQUAL);
+
+            NUMERIC_OPERATION(NOT_BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL_NUM)
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                DEOPTIMIZE(OP_LESS_EQUAL);
+
+            NUMERIC_OPERATION(NOT_BOOL_VAL, >);
+            DISPATCH();
+        }
+
+        /* Statically typed forms: the verifier has checked the compiler's
+           proof that every operand is a number, so there is nothing to guard */
+        CASE(OP_NEGATE_N)
+        {
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        }
+        CASE(OP_ADD_CONSTANT_NN)
+        {
+            Value constant = READ_CONSTANT();
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(constant));
+            DISPATCH();
+        }
+        CASE(OP_ADD_NN)
+        {
+            NUMERIC_OPERATION(NUMBER_VAL, +);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_NN)
+        {
+            NUMERIC_OPERATION(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY_NN)
+        {
+            NUMERIC_OPERATION(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE_NN)
+        {
+            NUMERIC_OPERATION(NUMBER_VAL, /);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_NN)
+        {
+            NUMERIC_OPERATION(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_LESS_NN)
+        {
+            NUMERIC_OPERATION(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL_NN)
+        {
+            NUMERIC_OPERATION(NOT_BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL_NN)
+        {
+            NUMERIC_OPERATION(NOT_BOOL_VAL, >);
+            DISPATCH();
+        }
+
+        CASE(OP_RETURN)
+        {
+            *result = POP();
+            SYNC_STATE();
+            return INTERPRET_OK;
+        }
+
+        DEFAULT
+        {
+            RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+        }
+
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SYNC_STATE
+#undef SAFEPOINT
+#undef RUNTIME_ERROR
+#undef BINARY_OPERATION
+#undef NUMERIC_OPERATION
+#undef DEOPTIMIZE
+#undef NOT_BOOL_VAL
+#undef TRACE_EXECUTION
+#undef DISPATCH
+#undef CASE
+#undef DEFAULT
+}
+
+static inline Value readOperand(uint8_t operand, Value *registers, Value *constants)
+{
+    return (operand & RK_CONSTANT) ? constants[operand & RK_MAX] : registers[operand];
+}
+
+/* Executes three-address code. Registers live in the VM stack array above
+   whatever the host has pushed, so a chunk can use at most REGISTER_MAX of
+   them. */
+static InterpretResult runRegisters(VM *vm, RegChunk *chunk, Value *result)
+{
+    uint8_t *ip = chunk->code;
+    Value *registers = vm->stackTop;
+    Value *constants = chunk->constants.values;
+
+    for (int i = 0; i < chunk->registerCount; i++)
+        registers[i] = NIL_VAL;
+
+#define READ_BYTE() (*ip++)
+#define READ_RK() readOperand(READ_BYTE(), registers, constants)
+
+#define RUNTIME_ERROR(...)                                                        \
+    do                                                                            \
+    {                                                                             \
+        runtimeError(vm, &chunk->lines, (int)(ip - chunk->code - 1), __VA_ARGS__);    \
+        return INTERPRET_RUNTIME_ERROR;                                           \
+    } while (false)
+
+#define BINARY_OPERATION(type, op)                        \
+    do                                                    \
+    {                                                     \
+        uint8_t target = READ_BYTE();                     \
+        Value a = READ_RK();                              \
+        Value b = READ_RK();                              \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))               \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+                                                          \
+        registers[target] = type(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION()                                              \
+    do                                                                 \
+    {                                                                  \
+        int offset = (int)(ip - chunk->code);                          \
+        disassembleRegInstruction(chunk, &offset);                     \
+        printf("          ");                                          \
+        for (int i = 0; i < chunk->registerCount; i++)                 \
+        {                                                              \
+            printf("[ ");                                              \
+            printValue(registers[i]);                                  \
+            printf(" ]");                                              \
+        }                                                              \
+        printf("\n");                                                  \
+        printf("\n");                                                  \
+    } while (false)
+#else
+#define TRACE_EXECUTION() \
+    do                    \
+    {                     \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+    static void *dispatchTable[UINT8_MAX + 1] = {
+        [0 ... UINT8_MAX] = &&LABEL_UNKNOWN,
+        [ROP_LOADK] = &&LABEL_ROP_LOADK,
+        [ROP_MOVE] = &&LABEL_ROP_MOVE,
+        [ROP_NEGATE] = &&LABEL_ROP_NEGATE,
+        [ROP_NOT] = &&LABEL_ROP_NOT,
+        [ROP_ADD] = &&LABEL_ROP_ADD,
+        [ROP_SUBTRACT] = &&LABEL_ROP_SUBTRACT,
+        [ROP_MULTIPLY] = &&LABEL_ROP_MULTIPLY,
+        [ROP_DIVIDE] = &&LABEL_ROP_DIVIDE,
+        [ROP_EQUAL] = &&LABEL_ROP_EQUAL,
+        [ROP_NOT_EQUAL] = &&LABEL_ROP_NOT_EQUAL,
+        [ROP_GREATER] = &&LABEL_ROP_GREATER,
+        [ROP_GREATER_EQUAL] = &&LABEL_ROP_GREATER_EQUAL,
+        [ROP_LESS] = &&LABEL_ROP_LESS,
+        [ROP_LESS_EQUAL] = &&LABEL_ROP_LESS_EQUAL,
+        [ROP_JUMP] = &&LABEL_ROP_JUMP,
+        [ROP_JUMP_IF_FALSE] = &&LABEL_ROP_JUMP_IF_FALSE,
+        [ROP_RETURN] = &&LABEL_ROP_RETURN,
+    };
+#pragma GCC diagnostic pop
+
+#define DISPATCH()                            \
+    do                                        \
+    {                                         \
+        TRACE_EXECUTION();                    \
+        goto *dispatchTable[READ_BYTE()];     \
+    } while (false)
+#define CASE(opcode) LABEL_##opcode:
+#define DEFAULT LABEL_UNKNOWN:
+
+    DISPATCH();
+#else
+#define DISPATCH() continue
+#define CASE(opcode) case opcode:
+#if defined(__GNUC__) && defined(NDEBUG)
+/* Only verified code gets here, so every byte read is a known opcode;
+   saying so lets the compiler drop the switch's range check. */
+#define DEFAULT default: __builtin_unreachable();
+#else
+#define DEFAULT default:
+#endif
+
+    for (;;)
+    {
+        TRACE_EXECUTION();
+        switch (READ_BYTE())
+        {
+#endif
+
+        CASE(ROP_LOADK)
+        {
+            uint8_t target = READ_BYTE();
+            ip += 3;
+            registers[target] = constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)];
+            DISPATCH();
+        }
+
+        CASE(ROP_MOVE)
+        {
+            uint8_t target = READ_BYTE();
+            registers[target] = READ_RK();
+            DISPATCH();
+        }
+
+        CASE(ROP_NEGATE)
+        {
+            uint8_t target = READ_BYTE();
+            Value operand = READ_RK();
+            if (!IS_NUMBER(operand))
+                RUNTIME_ERROR("Operand must be a number.");
+
+            registers[target] = NUMBER_VAL(-AS_NUMBER(operand));
+            DISPATCH();
+        }
+
+        CASE(ROP_NOT)
+        {
+            uint8_t target = READ_BYTE();
+            registers[target] = BOOL_VAL(isFalsey(READ_RK()));
+            DISPATCH();
+        }
+
+        CASE(ROP_ADD)
+        {
+            uint8_t target = READ_BYTE();
+            Value a = READ_RK();
+            Value b = READ_RK();
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                registers[target] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                DISPATCH();
+            }
+
+            const char *error = concatenate(&vm->heap, &a, b);
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            registers[target] = a;
+
+            /* The registers are the top of the stack */
+            if (vm->heap.full)
+                collectHeap(vm, registers + chunk->registerCount);
+            DISPATCH();
+        }
+        CASE(ROP_SUBTRACT)
+        {
+            BINARY_OPERATION(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        CASE(ROP_MULTIPLY)
+        {
+            BINARY_OPERATION(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        CASE(ROP_DIVIDE)
+        {
+            BINARY_OPERATION(NUMBER_VAL, /);
+            DISPATCH();
+        }
+
+        CASE(ROP_EQUAL)
+        {
+            uint8_t target = READ_BYTE();
+            Value a = READ_RK();
+            Value b = READ_RK();
+            registers[target] = BOOL_VAL(valuesEqual(a, b));
+            DISPATCH();
+        }
+        CASE(ROP_NOT_EQUAL)
+        {
+            uint8_t target = READ_BYTE();
+            Value a = READ_RK();
+            Value b = READ_RK();
+            registers[target] = BOOL_VAL(!valuesEqual(a, b));
+            DISPATCH();
+        }
+
+        CASE(ROP_GREATER)
+        {
             BINARY_OPERATION(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            DISPATCH();
+        }
+        CASE(ROP_GREATER_EQUAL)
+        {
+            BINARY_OPERATION(NOT_BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(ROP_LESS)
+        {
             BINARY_OPERATION(BOOL_VAL, <);
-            break;
+            DISPATCH();
+        }
+        CASE(ROP_LESS_EQUAL)
+        {
+            BINARY_OPERATION(NOT_BOOL_VAL, >);
+            DISPATCH();
+        }
+
+        CASE(ROP_JUMP)
+        {
+            ip += 3;
+            ip += ip[-3] | (ip[-2] << 8) | (ip[-1] << 16);
+            DISPATCH();
+        }
+
+        CASE(ROP_JUMP_IF_FALSE)
+        {
+            Value condition = READ_RK();
+            ip += 3;
+            if (isFalsey(condition))
+                ip += ip[-3] | (ip[-2] << 8) | (ip[-1] << 16);
+            DISPATCH();
+        }
 
-        case OP_RETURN:
+        CASE(ROP_RETURN)
         {
-            printValue(pop());
-            printf("\n");
+            *result = READ_RK();
             return INTERPRET_OK;
         }
+
+        DEFAULT
+        {
+            RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+        }
+
+#ifndef COMPUTED_GOTO
         }
     }
+#endif
 
-    result = INTERPRET_COMPILE_ERROR;
-    return result;
+#undef READ_BYTE
+#undef READ_RK
+#undef RUNTIME_ERROR
+#undef BINARY_OPERATION
+#undef NOT_BOOL_VAL
+#undef TRACE_EXECUTION
+#undef DISPATCH
+#undef CASE
+#undef DEFAULT
+}
+
+static void resetStack(VM *vm)
+{
+    vm->stackTop = vm->stack;
+}
+
+/* Makes room for a chunk's whole stack up front; this is the only overflow
+   check, paid once per chunk rather than on every push. */
+static bool reserveStack(VM *vm, LineArray *lines, int slots)
+{
+    int needed = (int)(vm->stackTop - vm->stack) + slots;
+    if (needed > vm->stackLimit)
+    {
+        runtimeError(vm, lines, 0, "Stack overflow: needs %d slots, limit is %d.", needed, vm->stackLimit);
+        return false;
+    }
+
+    if (needed <= vm->stackCapacity)
+        return true;
+
+    int used = (int)(vm->stackTop - vm->stack);
+    int capacity = vm->stackCapacity;
+    while (capacity < needed)
+        capacity = GROW_CAPACITY(capacity);
+    if (capacity > vm->stackLimit)
+        capacity = vm->stackLimit;
+
+    vm->stack = GROW_ARRAY(Value, vm->stack, vm->stackCapacity, capacity);
+    vm->stackCapacity = capacity;
+    vm->stackTop = vm->stack + used;
+    return true;
+}
+
+/* Grows the globals array to cover count slots; new slots start out
+   undefined */
+static void reserveGlobals(VM *vm, int count)
+{
+    if (count <= vm->globalCount)
+        return;
+
+    int capacity = vm->globalCount;
+    while (capacity < count)
+        capacity = GROW_CAPACITY(capacity);
+
+    vm->globals = GROW_ARRAY(Value, vm->globals, vm->globalCount, capacity);
+    for (int i = vm->globalCount; i < capacity; i++)
+        vm->globals[i] = UNDEFINED_VAL;
+    vm->globalCount = capacity;
+}
+
+/* A global outlives the chunk that set it, so it holds a reference to an
+   interned string of its own */
+static void storeGlobal(Value *global, Value value)
+{
+    retainValue(value);
+    releaseValue(*global);
+    *global = value;
 }
 
-static void resetStack()
+static void collectHeap(VM *vm, Value *stackTop)
 {
-    vm.stackTop = vm.stack;
+    Roots roots[] = {
+        {vm->stack, (int)(stackTop - vm->stack)},
+        {vm->globals, vm->globalCount},
+    };
+    collectGarbage(&vm->heap, roots, 2);
 }
 
-static void runtimeError(const char *format, ...)
+static void runtimeError(VM *vm, LineArray *lines, int offset, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -202,10 +1282,7 @@ static void runtimeError(const char *format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    /* <-- Replace with code that works with custom line implementation
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    */
-    int line = 1;
+    int line = getLine(lines, &offset);
     fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+    resetStack(vm);
 }
\ No newline at end of file
@@ -1,17 +1,42 @@
 #ifndef VM_H
 #define VM_H
 
+#include "aot.h"
 #include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "register.h"
 #include "value.h"
 
+/* Initial size of the value stack, and the default cap it may grow to */
 #define STACK_MAX 256
+#define STACK_LIMIT (1 << 20)
 
 typedef struct
 {
     Chunk *chunk;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+
+    /* Sized from each chunk's maxStack before it runs, so pushes inside
+       run() need no bounds checks. */
+    Value *stack;
+    int stackCapacity;
+    int stackLimit;
     Value *stackTop;
+
+    /* Values read by OP_GET_INPUT, indexed like the names the running
+       script was prepared with */
+    const Value *inputs;
+
+    /* This VM's value of every global, indexed by slot; grown before a
+       chunk runs to cover every slot it refers to. Globals without a value
+       hold UNDEFINED_VAL. */
+    Value *globals;
+    int globalCount;
+
+    /* Strings built by the scripts this VM runs. Collected only at
+       safepoints inside execution, from the stack and globals. */
+    Heap heap;
 } VM;
 
 typedef enum
@@ -21,12 +46,79 @@ typedef enum
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+/* Which bytecode design a compiled script is executed with */
+typedef enum
+{
+    BACKEND_STACK,
+    BACKEND_REGISTER,
+    /* Native code where the chunk allows it, the stack VM otherwise */
+    BACKEND_JIT,
+    /* A shared object from the native cache if one was built for the
+       script, the stack VM otherwise */
+    BACKEND_NATIVE
+} Backend;
+
+/* A compiled script that can be executed any number of times. Execution
+   may rewrite its bytecode in place (quickening), so one handle must not be
+   executed by two threads at once. */
+typedef struct
+{
+    Chunk chunk;
+    RegChunk regChunk;
+    bool lowered;
+    JitCode jit;
+    NativeCode native;
+    int inputCount;
+} Prepared;
+
+/* Returns NULL, after reporting the errors, if src does not compile */
+Prepared *prepare(const char *src, Backend backend);
+Prepared *prepareInputs(const char *src, Backend backend,
+                        const char *const *inputs, int inputCount);
+/* Takes ownership of an already compiled chunk, leaving *chunk empty.
+   Returns NULL, and frees the chunk, if it fails verification. */
+Prepared *prepareChunk(Chunk *chunk, Backend backend);
+void release(Prepared *prepared);
+
+/* Each VM is independent; threads may run one VM apiece concurrently.
+   A string a VM hands back lives in its heap, or is one of the script's
+   own: it stays valid until the VM next runs a script, unless it is kept
+   in a global or on the stack, and at most as long as the script is not
+   released. It must not be given to another VM. */
+void vmInit(VM *vm);
+void vmFree(VM *vm);
+void vmSetStackLimit(VM *vm, int slots);
+/* Bounds each pause: bytes allocated between minor collections, and old
+   objects visited per increment of a major one */
+void vmSetGcBudget(VM *vm, size_t nurseryBytes, int stepObjects);
+InterpretResult vmInterpret(VM *vm, const char *src, Backend backend);
+void vmPush(VM *vm, Value value);
+Value vmPop(VM *vm);
+void vmBindInputs(VM *vm, const Value *inputs);
+
+/* Globals by name, for hosts sharing values with the scripts they run.
+   vmSetGlobal() fails only when no slot is left for a new name;
+   vmGetGlobal() fails for a global without a value. */
+bool vmSetGlobal(VM *vm, const char *name, Value value);
+bool vmGetGlobal(VM *vm, const char *name, Value *value);
+
+/* Runs a prepared script, storing the value it returns in *result */
+InterpretResult vmExecute(VM *vm, Prepared *prepared, Value *result);
+
+/* Single-instance API over a process-wide default VM */
 void initVM();
 void freeVM();
+void setStackLimit(int slots);
+void setGcBudget(size_t nurseryBytes, int stepObjects);
 InterpretResult interpret(const char *src);
+InterpretResult interpretWith(const char *src, Backend backend);
+InterpretResult execute(Prepared *prepared, Value *result);
 
 /* Stack operations */
 void push(Value value);
 Value pop();
+void bindInputs(const Value *inputs);
+bool setGlobal(const char *name, Value value);
+bool getGlobal(const char *name, Value *value);
 
 #endif
\ No newline at end of file